@@ -0,0 +1,853 @@
+/* Headless front end to the offline store, for servers, cron jobs
+ * and profiling without the Evolution UI around. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <locale.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib-unix.h>
+
+#include <libedataserver/libedataserver.h>
+#include <libemail-engine/libemail-engine.h>
+
+#include "libemail-engine/m-attachment-stubs.h"
+#include "libemail-engine/m-export-manifest.h"
+#include "libemail-engine/m-export-options.h"
+#include "libemail-engine/m-mail-folder-utils.h"
+#include "libemail-engine/m-mail-folder-restore.h"
+#include "libemail-engine/m-maildir-watcher.h"
+#include "libemail-engine/m-mbox-import.h"
+#include "libemail-engine/m-store-bundle.h"
+
+#define DEFAULT_FOLDER "INBOX"
+
+typedef struct _ToolContext ToolContext;
+typedef gboolean (* ToolCommandFunc)	(ToolContext *tool,
+					 GError **error);
+
+struct _ToolContext {
+	GMainLoop *main_loop;
+	GCancellable *cancellable;
+
+	ESourceRegistry *registry;
+	CamelSession *session;
+	CamelStore *store;
+
+	MExportOptions *options;
+	ToolCommandFunc command;
+	gboolean success;
+	GError *error;
+};
+
+static gchar *opt_account = NULL;
+static gchar *opt_store = NULL;
+static gchar **opt_folders = NULL;
+static gboolean opt_all_folders = FALSE;
+static gchar *opt_destination = NULL;
+static gchar *opt_source = NULL;
+static gchar *opt_mbox = NULL;
+static gint opt_pack_age_days = -1;
+static gchar *opt_layout = NULL;
+static gboolean opt_snapshot = FALSE;
+static gboolean opt_no_cache_hints = FALSE;
+static gint opt_direct_io_threshold = -1;
+static gint opt_max_workers = -1;
+static gint opt_max_kib_per_second = -1;
+static gint opt_max_files_per_second = -1;
+static gchar *opt_io_priority = NULL;
+static gchar *opt_trace = NULL;
+static gint opt_stub_attachments = -1;
+static gboolean opt_newest_first = FALSE;
+static gchar *opt_bundle = NULL;
+static gint opt_since = -1;
+static gboolean opt_quiet = FALSE;
+
+static GOptionEntry entries[] = {
+	{ "account", 'a', 0, G_OPTION_ARG_STRING, &opt_account,
+	  N_("UID of the mail account to use, as known to the ESource registry"), N_("UID") },
+	{ "store", 's', 0, G_OPTION_ARG_FILENAME, &opt_store,
+	  N_("Path of a local maildir store to use instead of an account"), N_("PATH") },
+	{ "folder", 'f', 0, G_OPTION_ARG_STRING_ARRAY, &opt_folders,
+	  N_("Full name of a folder to work on; may be given several times"), N_("NAME") },
+	{ "all-folders", 0, 0, G_OPTION_ARG_NONE, &opt_all_folders,
+	  N_("Export every folder of the store"), NULL },
+	{ "destination", 'd', 0, G_OPTION_ARG_FILENAME, &opt_destination,
+	  N_("Offline store to write to"), N_("DIR") },
+	{ "source", 0, 0, G_OPTION_ARG_FILENAME, &opt_source,
+	  N_("Offline store to restore from"), N_("DIR") },
+	{ "mbox", 0, 0, G_OPTION_ARG_FILENAME, &opt_mbox,
+	  N_("mbox file to import"), N_("FILE") },
+	{ "pack-age-days", 0, 0, G_OPTION_ARG_INT, &opt_pack_age_days,
+	  N_("Pack messages older than this many days, 0 to disable"), N_("DAYS") },
+	{ "layout", 0, 0, G_OPTION_ARG_STRING, &opt_layout,
+	  N_("Folder layout of the offline store: flat, year or month"), N_("LAYOUT") },
+	{ "snapshot", 0, 0, G_OPTION_ARG_NONE, &opt_snapshot,
+	  N_("Export into a new dated snapshot, hardlinking unchanged messages from the previous one"), NULL },
+	{ "no-cache-hints", 0, 0, G_OPTION_ARG_NONE, &opt_no_cache_hints,
+	  N_("Do not keep the export from flushing the page cache"), NULL },
+	{ "direct-io-threshold", 0, 0, G_OPTION_ARG_INT, &opt_direct_io_threshold,
+	  N_("Write messages of at least this many KiB with direct I/O, 0 to disable"), N_("KIB") },
+	{ "max-workers", 0, 0, G_OPTION_ARG_INT, &opt_max_workers,
+	  N_("Upper bound of fetch and write workers, 0 for automatic"), N_("N") },
+	{ "max-kib-per-second", 0, 0, G_OPTION_ARG_INT, &opt_max_kib_per_second,
+	  N_("Write at most this many KiB per second, 0 for no limit"), N_("KIB") },
+	{ "max-files-per-second", 0, 0, G_OPTION_ARG_INT, &opt_max_files_per_second,
+	  N_("Write at most this many messages per second, 0 for no limit"), N_("N") },
+	{ "io-priority", 0, 0, G_OPTION_ARG_STRING, &opt_io_priority,
+	  N_("I/O scheduling class of the export: normal, low or idle"), N_("CLASS") },
+	{ "stub-attachments", 0, 0, G_OPTION_ARG_INT, &opt_stub_attachments,
+	  N_("Leave out non-text parts of at least this many KiB, to be fetched later with fetch-stubs"), N_("KIB") },
+	{ "newest-first", 0, 0, G_OPTION_ARG_NONE, &opt_newest_first,
+	  N_("Export the newest messages first, making the store readable after the last day, week and month"), NULL },
+	{ "bundle", 0, 0, G_OPTION_ARG_FILENAME, &opt_bundle,
+	  N_("The bundle to write or apply"), N_("FILE") },
+	{ "since", 0, 0, G_OPTION_ARG_INT, &opt_since,
+	  N_("Make the bundle from generation N, 0 for a complete one; the latest by default"), N_("N") },
+	{ "trace", 0, 0, G_OPTION_ARG_FILENAME, &opt_trace,
+	  N_("Write the steps of every message to FILE, in Chrome trace format"), N_("FILE") },
+	{ "quiet", 'q', 0, G_OPTION_ARG_NONE, &opt_quiet,
+	  N_("Do not print progress"), NULL },
+	{ NULL }
+};
+
+static void
+tool_operation_status_cb (CamelOperation *operation,
+			  const gchar *what,
+			  gint pc,
+			  gpointer user_data)
+{
+	if (what == NULL)
+		return;
+
+	if (isatty (STDERR_FILENO))
+		g_printerr ("\r\033[K%s (%d%%)", what, pc);
+	else
+		g_printerr ("%s (%d%%)\n", what, pc);
+}
+
+static gboolean
+tool_cancel_cb (gpointer user_data)
+{
+	ToolContext *tool = user_data;
+
+	g_cancellable_cancel (tool->cancellable);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+tool_quit_idle_cb (gpointer user_data)
+{
+	ToolContext *tool = user_data;
+
+	g_main_loop_quit (tool->main_loop);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gpointer
+tool_command_thread (gpointer user_data)
+{
+	ToolContext *tool = user_data;
+
+	tool->success = tool->command (tool, &tool->error);
+
+	g_idle_add (tool_quit_idle_cb, tool);
+
+	return NULL;
+}
+
+static gboolean
+tool_apply_options (ToolContext *tool,
+		    GError **error)
+{
+	/* Command line beats the GSettings, which beat the defaults. */
+	tool->options = m_export_options_new_from_settings ();
+
+	if (opt_pack_age_days >= 0)
+		tool->options->pack_age_days = opt_pack_age_days;
+
+	if (opt_snapshot)
+		tool->options->snapshots = TRUE;
+
+	if (opt_no_cache_hints)
+		tool->options->cache_hints = FALSE;
+
+	if (opt_direct_io_threshold >= 0)
+		tool->options->direct_io_threshold = opt_direct_io_threshold;
+
+	if (opt_max_workers >= 0)
+		tool->options->max_workers = opt_max_workers;
+
+	if (opt_stub_attachments >= 0)
+		tool->options->attachment_stub_threshold = opt_stub_attachments;
+
+	if (opt_newest_first)
+		tool->options->newest_first = TRUE;
+
+	/* Limits given here replace the configured ones altogether,
+	 * rather than following later changes of the settings. */
+	if (opt_max_kib_per_second >= 0 || opt_max_files_per_second >= 0) {
+		m_throttle_unref (tool->options->throttle);
+		tool->options->throttle = m_throttle_new (
+			(guint) MAX (opt_max_kib_per_second, 0) * 1024,
+			(guint) MAX (opt_max_files_per_second, 0));
+	}
+
+	if (opt_io_priority != NULL) {
+		if (g_ascii_strcasecmp (opt_io_priority, "normal") == 0) {
+			tool->options->io_priority = M_THROTTLE_IO_PRIORITY_NORMAL;
+		} else if (g_ascii_strcasecmp (opt_io_priority, "low") == 0) {
+			tool->options->io_priority = M_THROTTLE_IO_PRIORITY_LOW;
+		} else if (g_ascii_strcasecmp (opt_io_priority, "idle") == 0) {
+			tool->options->io_priority = M_THROTTLE_IO_PRIORITY_IDLE;
+		} else {
+			g_set_error (
+				error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+				_("Unknown I/O priority “%s”"), opt_io_priority);
+			return FALSE;
+		}
+	}
+
+	if (opt_trace != NULL) {
+		tool->options->trace = m_export_trace_new (opt_trace, error);
+		if (tool->options->trace == NULL)
+			return FALSE;
+	}
+
+	if (opt_layout != NULL) {
+		if (g_ascii_strcasecmp (opt_layout, "flat") == 0) {
+			tool->options->layout = M_EXPORT_LAYOUT_FLAT;
+		} else if (g_ascii_strcasecmp (opt_layout, "year") == 0) {
+			tool->options->layout = M_EXPORT_LAYOUT_YEAR;
+		} else if (g_ascii_strcasecmp (opt_layout, "month") == 0) {
+			tool->options->layout = M_EXPORT_LAYOUT_MONTH;
+		} else {
+			g_set_error (
+				error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+				_("Unknown layout “%s”"), opt_layout);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+tool_open_store (ToolContext *tool,
+		 GError **error)
+{
+	CamelService *service;
+
+	if (opt_account != NULL && opt_store != NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("Use either --account or --store, not both"));
+		return FALSE;
+	}
+
+	if (opt_account != NULL) {
+		tool->registry = e_source_registry_new_sync (tool->cancellable, error);
+		if (tool->registry == NULL)
+			return FALSE;
+
+		/* EMailSession adds a service for every mail account
+		 * of the registry, with the user's configuration. */
+		tool->session = CAMEL_SESSION (e_mail_session_new (tool->registry));
+
+		service = camel_session_ref_service (tool->session, opt_account);
+		if (service == NULL || !CAMEL_IS_STORE (service)) {
+			g_clear_object (&service);
+			g_set_error (
+				error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+				_("No mail account with UID “%s”"), opt_account);
+			return FALSE;
+		}
+
+	} else if (opt_store != NULL) {
+		CamelSettings *settings;
+		gchar *data_dir, *cache_dir;
+
+		data_dir = g_build_filename (g_get_user_data_dir (), PROJECT_NAME, NULL);
+		cache_dir = g_build_filename (g_get_user_cache_dir (), PROJECT_NAME, NULL);
+
+		tool->session = g_object_new (
+			CAMEL_TYPE_SESSION,
+			"user-data-dir", data_dir,
+			"user-cache-dir", cache_dir,
+			"online", FALSE,
+			NULL);
+
+		g_free (data_dir);
+		g_free (cache_dir);
+
+		service = camel_session_add_service (
+			tool->session, "offline-store-tool",
+			"maildir", CAMEL_PROVIDER_STORE, error);
+		if (service == NULL)
+			return FALSE;
+
+		settings = camel_service_ref_settings (service);
+		camel_local_settings_set_path (CAMEL_LOCAL_SETTINGS (settings), opt_store);
+		g_object_unref (settings);
+
+	} else {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("Either --account or --store is required"));
+		return FALSE;
+	}
+
+	tool->store = CAMEL_STORE (service);
+
+	if (CAMEL_IS_OFFLINE_STORE (tool->store) &&
+	    !camel_offline_store_set_online_sync (
+		CAMEL_OFFLINE_STORE (tool->store), TRUE,
+		tool->cancellable, error))
+		return FALSE;
+
+	return camel_service_connect_sync (service, tool->cancellable, error);
+}
+
+static CamelFolder *
+tool_open_folder (ToolContext *tool,
+		  const gchar *full_name,
+		  GError **error)
+{
+	CamelFolder *folder;
+
+	folder = camel_store_get_folder_sync (
+		tool->store, full_name, 0,
+		tool->cancellable, error);
+
+	if (folder != NULL &&
+	    !camel_folder_refresh_info_sync (folder, tool->cancellable, error))
+		g_clear_object (&folder);
+
+	return folder;
+}
+
+/* Helper for tool_command_export() */
+static void
+tool_collect_folder_names (CamelFolderInfo *info,
+			   GPtrArray *names)
+{
+	while (info != NULL) {
+		if ((info->flags & CAMEL_FOLDER_NOSELECT) == 0)
+			g_ptr_array_add (names, g_strdup (info->full_name));
+
+		tool_collect_folder_names (info->child, names);
+
+		info = info->next;
+	}
+}
+
+static gboolean
+tool_command_export (ToolContext *tool,
+		     GError **error)
+{
+	GPtrArray *names;
+	GFile *root;
+	gboolean success = TRUE;
+	guint n_unchanged = 0;
+	guint n_failed = 0;
+	guint ii;
+
+	if (opt_destination == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--destination is required"));
+		return FALSE;
+	}
+
+	if (!tool_open_store (tool, error))
+		return FALSE;
+
+	names = g_ptr_array_new_with_free_func (g_free);
+
+	if (opt_all_folders) {
+		CamelFolderInfo *info;
+
+		info = camel_store_get_folder_info_sync (
+			tool->store, NULL,
+			CAMEL_STORE_FOLDER_INFO_RECURSIVE,
+			tool->cancellable, error);
+		if (info == NULL) {
+			g_ptr_array_unref (names);
+			return FALSE;
+		}
+
+		tool_collect_folder_names (info, names);
+		camel_folder_info_free (info);
+
+	} else if (opt_folders != NULL) {
+		for (ii = 0; opt_folders[ii] != NULL; ii++)
+			g_ptr_array_add (names, g_strdup (opt_folders[ii]));
+
+	} else {
+		g_ptr_array_add (names, g_strdup (DEFAULT_FOLDER));
+	}
+
+	root = g_file_new_for_commandline_arg (opt_destination);
+
+	for (ii = 0; ii < names->len && success; ii++) {
+		const gchar *full_name = g_ptr_array_index (names, ii);
+		CamelFolder *folder;
+		GFile *destination;
+		gboolean unchanged = FALSE;
+		GError *local_error = NULL;
+
+		folder = tool_open_folder (tool, full_name, &local_error);
+
+		if (folder != NULL) {
+			/* A single folder goes straight into the destination,
+			 * several of them get one maildir each below it. */
+			if (names->len > 1) {
+				gchar *name;
+
+				name = g_strdup (full_name);
+				g_strdelimit (name, "/", '.');
+				destination = g_file_get_child (root, name);
+				g_free (name);
+			} else {
+				destination = g_object_ref (root);
+			}
+
+			/* Folders unchanged since the last run are skipped. */
+			m_mail_folder_sync_messages_sync (
+				folder, destination, tool->options, &unchanged,
+				tool->cancellable, &local_error);
+
+			if (unchanged)
+				n_unchanged++;
+
+			g_object_unref (destination);
+			g_object_unref (folder);
+		}
+
+		if (local_error == NULL)
+			continue;
+
+		/* One folder failing does not stop the others from
+		 * being exported, only an interruption does. */
+		if (names->len == 1 ||
+		    g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_propagate_error (error, local_error);
+			success = FALSE;
+		} else {
+			g_printerr ("%s: %s\n", full_name, local_error->message);
+			g_error_free (local_error);
+			n_failed++;
+		}
+	}
+
+	if (!opt_quiet && n_unchanged > 0)
+		g_printerr (
+			ngettext (
+			"\n%u folder unchanged\n",
+			"\n%u folders unchanged\n",
+			n_unchanged), n_unchanged);
+
+	if (success && n_failed > 0) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			ngettext (
+			"%u folder could not be exported",
+			"%u folders could not be exported",
+			n_failed), n_failed);
+		success = FALSE;
+	}
+
+	g_object_unref (root);
+	g_ptr_array_unref (names);
+
+	return success;
+}
+
+static gboolean
+tool_command_restore (ToolContext *tool,
+		      GError **error)
+{
+	CamelFolder *folder;
+	GFile *source;
+	gboolean success;
+
+	if (opt_source == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--source is required"));
+		return FALSE;
+	}
+
+	if (!tool_open_store (tool, error))
+		return FALSE;
+
+	folder = tool_open_folder (
+		tool, opt_folders != NULL ? opt_folders[0] : DEFAULT_FOLDER, error);
+	if (folder == NULL)
+		return FALSE;
+
+	source = g_file_new_for_commandline_arg (opt_source);
+
+	success = m_mail_folder_restore_messages_sync (
+		folder, source, tool->cancellable, error);
+
+	g_object_unref (source);
+	g_object_unref (folder);
+
+	return success;
+}
+
+static gboolean
+tool_command_import_mbox (ToolContext *tool,
+			  GError **error)
+{
+	GFile *mbox, *destination;
+	gboolean success;
+
+	if (opt_mbox == NULL || opt_destination == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--mbox and --destination are required"));
+		return FALSE;
+	}
+
+	mbox = g_file_new_for_commandline_arg (opt_mbox);
+	destination = g_file_new_for_commandline_arg (opt_destination);
+
+	success = m_mbox_import_sync (
+		mbox, destination, tool->options,
+		tool->cancellable, error);
+
+	g_object_unref (destination);
+	g_object_unref (mbox);
+
+	return success;
+}
+
+static gboolean
+tool_command_fetch_stubs (ToolContext *tool,
+			  GError **error)
+{
+	CamelFolder *folder;
+	GFile *source;
+	guint n_fetched = 0;
+	gboolean success;
+
+	if (opt_source == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--source is required"));
+		return FALSE;
+	}
+
+	if (!tool_open_store (tool, error))
+		return FALSE;
+
+	folder = tool_open_folder (
+		tool, opt_folders != NULL ? opt_folders[0] : DEFAULT_FOLDER, error);
+	if (folder == NULL)
+		return FALSE;
+
+	source = g_file_new_for_commandline_arg (opt_source);
+
+	success = m_attachment_stubs_fetch_sync (
+		folder, source, &n_fetched, tool->cancellable, error);
+
+	if (!opt_quiet)
+		g_printerr (
+			ngettext (
+			"\nCompleted %u message\n",
+			"\nCompleted %u messages\n",
+			n_fetched), n_fetched);
+
+	g_object_unref (source);
+	g_object_unref (folder);
+
+	return success;
+}
+
+static gboolean
+tool_command_verify (ToolContext *tool,
+		     GError **error)
+{
+	GPtrArray *problems = NULL;
+	GFile *source;
+	guint n_checked = 0;
+	gboolean success;
+	guint ii;
+
+	if (opt_source == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--source is required"));
+		return FALSE;
+	}
+
+	source = g_file_new_for_commandline_arg (opt_source);
+
+	success = m_export_manifest_verify_sync (
+		source, &n_checked, &problems,
+		tool->cancellable, error);
+
+	/* The list is the result, even with --quiet. */
+	for (ii = 0; problems != NULL && ii < problems->len; ii++)
+		g_print ("%s\n", (const gchar *) g_ptr_array_index (problems, ii));
+
+	if (!opt_quiet)
+		g_printerr (
+			ngettext (
+			"\nChecked %u message\n",
+			"\nChecked %u messages\n",
+			n_checked), n_checked);
+
+	if (problems != NULL)
+		g_ptr_array_unref (problems);
+	g_object_unref (source);
+
+	return success;
+}
+
+static gboolean
+tool_command_bundle_create (ToolContext *tool,
+			    GError **error)
+{
+	GFile *source, *bundle;
+	guint generation = 0;
+	gboolean success;
+
+	if (opt_source == NULL || opt_bundle == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--source and --bundle are required"));
+		return FALSE;
+	}
+
+	source = g_file_new_for_commandline_arg (opt_source);
+	bundle = g_file_new_for_commandline_arg (opt_bundle);
+
+	success = m_store_bundle_create_sync (
+		source, bundle,
+		opt_since >= 0 ? (guint) opt_since : M_STORE_BUNDLE_SINCE_LATEST,
+		&generation, tool->cancellable, error);
+
+	if (success && !opt_quiet)
+		g_printerr (_("\nWrote generation %u\n"), generation);
+
+	g_object_unref (bundle);
+	g_object_unref (source);
+
+	return success;
+}
+
+static gboolean
+tool_command_bundle_apply (ToolContext *tool,
+			   GError **error)
+{
+	GFile *bundle, *destination;
+	guint generation = 0;
+	gboolean success;
+
+	if (opt_bundle == NULL || opt_destination == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--bundle and --destination are required"));
+		return FALSE;
+	}
+
+	bundle = g_file_new_for_commandline_arg (opt_bundle);
+	destination = g_file_new_for_commandline_arg (opt_destination);
+
+	success = m_store_bundle_apply_sync (
+		bundle, destination, tool->options,
+		&generation, tool->cancellable, error);
+
+	if (success && !opt_quiet)
+		g_printerr (_("\nNow at generation %u\n"), generation);
+
+	g_object_unref (destination);
+	g_object_unref (bundle);
+
+	return success;
+}
+
+/* Helper for tool_command_watch() */
+static void
+tool_watch_cancelled_cb (GCancellable *cancellable,
+			 GMainLoop *main_loop)
+{
+	g_main_loop_quit (main_loop);
+}
+
+static gboolean
+tool_command_watch (ToolContext *tool,
+		    GError **error)
+{
+	MMaildirWatcher *watcher;
+	GMainContext *context;
+	GMainLoop *main_loop;
+	CamelFolder *folder;
+	GFile *source;
+	gulong handler_id;
+
+	if (opt_source == NULL) {
+		g_set_error (
+			error, G_OPTION_ERROR, G_OPTION_ERROR_FAILED,
+			_("--source is required"));
+		return FALSE;
+	}
+
+	if (!tool_open_store (tool, error))
+		return FALSE;
+
+	folder = tool_open_folder (
+		tool, opt_folders != NULL ? opt_folders[0] : DEFAULT_FOLDER, error);
+	if (folder == NULL)
+		return FALSE;
+
+	/* The watcher lives in this thread's own main context,
+	 * until SIGINT or SIGTERM cancel the operation. */
+	context = g_main_context_new ();
+	g_main_context_push_thread_default (context);
+	main_loop = g_main_loop_new (context, FALSE);
+
+	source = g_file_new_for_commandline_arg (opt_source);
+	watcher = m_maildir_watcher_new (folder, source, error);
+	g_object_unref (source);
+
+	if (watcher != NULL) {
+		handler_id = g_cancellable_connect (
+			tool->cancellable,
+			G_CALLBACK (tool_watch_cancelled_cb),
+			main_loop, NULL);
+
+		if (!g_cancellable_is_cancelled (tool->cancellable))
+			g_main_loop_run (main_loop);
+
+		g_cancellable_disconnect (tool->cancellable, handler_id);
+
+		m_maildir_watcher_free (watcher);
+	}
+
+	g_main_loop_unref (main_loop);
+	g_main_context_pop_thread_default (context);
+	g_main_context_unref (context);
+
+	if (watcher != NULL)
+		camel_folder_synchronize_sync (folder, FALSE, NULL, NULL);
+
+	g_object_unref (folder);
+
+	return watcher != NULL;
+}
+
+static const struct {
+	const gchar *name;
+	ToolCommandFunc func;
+} commands[] = {
+	{ "export", tool_command_export },
+	{ "restore", tool_command_restore },
+	{ "import-mbox", tool_command_import_mbox },
+	{ "watch", tool_command_watch },
+	{ "fetch-stubs", tool_command_fetch_stubs },
+	{ "verify", tool_command_verify },
+	{ "bundle-create", tool_command_bundle_create },
+	{ "bundle-apply", tool_command_bundle_apply }
+};
+
+gint
+main (gint argc,
+      gchar **argv)
+{
+	GOptionContext *option_context;
+	ToolContext tool;
+	GError *error = NULL;
+	guint ii;
+
+	setlocale (LC_ALL, "");
+	bindtextdomain (GETTEXT_PACKAGE, LOCALEDIR);
+	bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
+
+	option_context = g_option_context_new (_("COMMAND — export, restore, import-mbox, watch, fetch-stubs, verify, bundle-create or bundle-apply"));
+	g_option_context_add_main_entries (option_context, entries, GETTEXT_PACKAGE);
+	g_option_context_set_summary (
+		option_context,
+		_("Maintain an offline copy of mail without a running Evolution."));
+
+	if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		g_option_context_free (option_context);
+		return 2;
+	}
+
+	memset (&tool, 0, sizeof (ToolContext));
+
+	for (ii = 0; argc == 2 && ii < G_N_ELEMENTS (commands); ii++) {
+		if (g_str_equal (argv[1], commands[ii].name))
+			tool.command = commands[ii].func;
+	}
+
+	if (tool.command == NULL) {
+		gchar *help;
+
+		help = g_option_context_get_help (option_context, TRUE, NULL);
+		g_printerr ("%s", help);
+		g_free (help);
+		g_option_context_free (option_context);
+		return 2;
+	}
+
+	g_option_context_free (option_context);
+
+	if (!tool_apply_options (&tool, &error)) {
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		return 2;
+	}
+
+	tool.main_loop = g_main_loop_new (NULL, FALSE);
+	tool.cancellable = camel_operation_new ();
+
+	if (!opt_quiet)
+		g_signal_connect (
+			tool.cancellable, "status",
+			G_CALLBACK (tool_operation_status_cb), NULL);
+
+	/* Let an interrupted cron job leave a consistent store behind. */
+	g_unix_signal_add (SIGINT, tool_cancel_cb, &tool);
+	g_unix_signal_add (SIGTERM, tool_cancel_cb, &tool);
+
+	/* The command runs in its own thread, so that Camel can
+	 * dispatch status and other events in the main loop. */
+	g_thread_unref (g_thread_new ("offline-store-tool", tool_command_thread, &tool));
+
+	g_main_loop_run (tool.main_loop);
+
+	if (!opt_quiet && isatty (STDERR_FILENO))
+		g_printerr ("\n");
+
+	if (tool.error != NULL)
+		g_printerr ("%s\n", tool.error->message);
+
+	if (tool.store != NULL)
+		camel_service_disconnect_sync (
+			CAMEL_SERVICE (tool.store), TRUE, NULL, NULL);
+
+	g_clear_error (&tool.error);
+	g_clear_object (&tool.store);
+	g_clear_object (&tool.session);
+	g_clear_object (&tool.registry);
+	g_clear_object (&tool.cancellable);
+	g_main_loop_unref (tool.main_loop);
+	m_export_options_free (tool.options);
+
+	return tool.success ? 0 : 1;
+}
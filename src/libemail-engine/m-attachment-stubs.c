@@ -0,0 +1,559 @@
+#include "config.h"
+
+#include "m-attachment-stubs.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+
+#include "m-export-manifest.h"
+#include "m-mail-folder-utils.h"
+
+typedef struct _StubsData StubsData;
+
+struct _StubsData {
+	GHashTable *stubs;	/* part number ~> CamelMimePart */
+	gchar *uid;
+};
+
+static gboolean
+attachment_stubs_is_stub (CamelMimePart *part)
+{
+	CamelContentType *type;
+
+	type = camel_mime_part_get_content_type (part);
+
+	return type != NULL &&
+		camel_content_type_is (type, "message", "external-body") &&
+		g_strcmp0 (camel_content_type_param (type, "access-type"),
+		M_ATTACHMENT_STUB_ACCESS_TYPE) == 0;
+}
+
+static gboolean
+attachment_stubs_foreach_part (CamelMimePart *part,
+                               const gchar *part_id,
+                               MAttachmentStubsFunc func,
+                               gpointer user_data)
+{
+	CamelDataWrapper *content;
+
+	content = camel_medium_get_content (CAMEL_MEDIUM (part));
+
+	if (content == NULL)
+		return TRUE;
+
+	/* A stub is a leaf, however the parser took it. */
+	if (attachment_stubs_is_stub (part))
+		return func (part, *part_id != '\0' ? part_id : "1", user_data);
+
+	if (CAMEL_IS_MULTIPART (content)) {
+		guint n_parts, ii;
+
+		n_parts = camel_multipart_get_number (CAMEL_MULTIPART (content));
+
+		for (ii = 0; ii < n_parts; ii++) {
+			gchar *child_id;
+			gboolean keep_going;
+
+			if (*part_id != '\0')
+				child_id = g_strdup_printf ("%s.%u", part_id, ii + 1);
+			else
+				child_id = g_strdup_printf ("%u", ii + 1);
+
+			keep_going = attachment_stubs_foreach_part (
+				camel_multipart_get_part (CAMEL_MULTIPART (content), ii),
+				child_id, func, user_data);
+
+			g_free (child_id);
+
+			if (!keep_going)
+				return FALSE;
+		}
+
+		return TRUE;
+	}
+
+	/* An attached message counts its parts below its own number. */
+	if (CAMEL_IS_MIME_MESSAGE (content))
+		return attachment_stubs_foreach_part (
+			CAMEL_MIME_PART (content), part_id, func, user_data);
+
+	return func (part, *part_id != '\0' ? part_id : "1", user_data);
+}
+
+/**
+ * m_attachment_stubs_foreach_part:
+ * @part: a #CamelMimePart, usually a #CamelMimeMessage
+ * @func: called for every leaf part
+ * @user_data: data passed to @func
+ *
+ * Calls @func for every part of @part which is neither a multipart nor
+ * an attached message, with its part number, descending into attached
+ * messages.  Stubs are leaves too.
+ *
+ * Returns: %FALSE if @func stopped it early
+ **/
+gboolean
+m_attachment_stubs_foreach_part (CamelMimePart *part,
+                                 MAttachmentStubsFunc func,
+                                 gpointer user_data)
+{
+	g_return_val_if_fail (CAMEL_IS_MIME_PART (part), FALSE);
+	g_return_val_if_fail (func != NULL, FALSE);
+
+	return attachment_stubs_foreach_part (part, "", func, user_data);
+}
+
+/**
+ * m_attachment_stub_replace:
+ * @part: a leaf #CamelMimePart
+ * @uid: UID of the message @part belongs to
+ * @part_id: the part number of @part
+ * @size: the decoded size of @part
+ *
+ * Replaces the content of @part with a stub referring to it, keeping
+ * its other headers, like the file name in Content-Disposition.
+ **/
+void
+m_attachment_stub_replace (CamelMimePart *part,
+                           const gchar *uid,
+                           const gchar *part_id,
+                           gsize size)
+{
+	CamelContentType *stub_type;
+	CamelTransferEncoding encoding;
+	GString *body;
+	gchar *str;
+
+	g_return_if_fail (CAMEL_IS_MIME_PART (part));
+	g_return_if_fail (uid != NULL);
+	g_return_if_fail (part_id != NULL);
+
+	/* The body of an external-body part holds the headers
+	 * of the part it stands for, RFC 2046 section 5.2.3. */
+	body = g_string_new ("Content-Type: ");
+
+	str = camel_content_type_format (camel_mime_part_get_content_type (part));
+	g_string_append (body, str);
+	g_string_append_c (body, '\n');
+	g_free (str);
+
+	encoding = camel_mime_part_get_encoding (part);
+	if (encoding != CAMEL_TRANSFER_ENCODING_DEFAULT)
+		g_string_append_printf (
+			body, "Content-Transfer-Encoding: %s\n",
+			camel_transfer_encoding_to_string (encoding));
+
+	g_string_append_c (body, '\n');
+
+	stub_type = camel_content_type_new ("message", "external-body");
+	camel_content_type_set_param (stub_type, "access-type", M_ATTACHMENT_STUB_ACCESS_TYPE);
+	camel_content_type_set_param (stub_type, "uid", uid);
+	camel_content_type_set_param (stub_type, "part", part_id);
+
+	str = g_strdup_printf ("%" G_GSIZE_FORMAT, size);
+	camel_content_type_set_param (stub_type, "size", str);
+	g_free (str);
+
+	str = camel_content_type_format (stub_type);
+	camel_mime_part_set_content (part, body->str, body->len, str);
+	camel_mime_part_set_encoding (part, CAMEL_TRANSFER_ENCODING_7BIT);
+	g_free (str);
+
+	camel_content_type_unref (stub_type);
+	g_string_free (body, TRUE);
+}
+
+/* Helper for attachment_stubs_fetch_file() */
+static gboolean
+attachment_stubs_collect_cb (CamelMimePart *part,
+                             const gchar *part_id,
+                             gpointer user_data)
+{
+	StubsData *data = user_data;
+
+	if (!attachment_stubs_is_stub (part))
+		return TRUE;
+
+	/* All stubs of one file refer to the same message. */
+	if (data->uid == NULL)
+		data->uid = g_strdup (camel_content_type_param (
+			camel_mime_part_get_content_type (part), "uid"));
+
+	g_hash_table_insert (data->stubs, g_strdup (part_id), part);
+
+	return TRUE;
+}
+
+/* Helper for attachment_stubs_fetch_file() */
+static gboolean
+attachment_stubs_restore_cb (CamelMimePart *part,
+                             const gchar *part_id,
+                             gpointer user_data)
+{
+	GHashTable *stubs = user_data;
+	CamelMimePart *stub;
+
+	stub = g_hash_table_lookup (stubs, part_id);
+	if (stub == NULL)
+		return TRUE;
+
+	/* Setting the content sets the Content-Type header as well. */
+	camel_medium_set_content (
+		CAMEL_MEDIUM (stub),
+		camel_medium_get_content (CAMEL_MEDIUM (part)));
+	camel_mime_part_set_encoding (stub, camel_mime_part_get_encoding (part));
+
+	g_hash_table_remove (stubs, part_id);
+
+	return g_hash_table_size (stubs) > 0;
+}
+
+/* Helper for attachment_stubs_rewrite() */
+static void
+attachment_stubs_update_manifest (MExportManifest *manifest,
+                                  const gchar *root_path,
+                                  const gchar *maildir,
+                                  const gchar *basename,
+                                  const gchar *uid,
+                                  GByteArray *byte_array)
+{
+	guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+	const gchar *info;
+	gchar *name, *location;
+
+	/* Located like the writer does, without the flags. */
+	info = strchr (basename, ':');
+	name = info != NULL ? g_strndup (basename, info - basename) : g_strdup (basename);
+
+	if (g_str_equal (maildir, root_path)) {
+		location = name;
+	} else {
+		gchar *subfolder;
+
+		subfolder = g_path_get_basename (maildir);
+		location = g_build_filename (subfolder, name, NULL);
+		g_free (subfolder);
+		g_free (name);
+	}
+
+	m_export_manifest_compute (byte_array->data, byte_array->len, digest);
+	m_export_manifest_set (manifest, uid, location, digest, byte_array->len);
+
+	g_free (location);
+}
+
+/* Helper for attachment_stubs_fetch_file() */
+static gboolean
+attachment_stubs_rewrite (const gchar *path,
+                          const gchar *uid,
+                          MExportManifest *manifest,
+                          const gchar *root_path,
+                          CamelMimeMessage *message,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+	CamelStream *stream;
+	GByteArray *byte_array;
+	gchar *dirname, *maildir, *basename, *tmp_path;
+	gboolean success;
+
+	byte_array = g_byte_array_new ();
+
+	/* CamelStreamMem does NOT take ownership of the byte
+	 * array when set with camel_stream_mem_set_byte_array(). */
+	stream = camel_stream_mem_new ();
+	camel_stream_mem_set_byte_array (CAMEL_STREAM_MEM (stream), byte_array);
+
+	success = camel_data_wrapper_write_to_stream_sync (
+		CAMEL_DATA_WRAPPER (message), stream, cancellable, error) != -1;
+
+	g_object_unref (stream);
+
+	if (!success) {
+		g_byte_array_free (byte_array, TRUE);
+		return FALSE;
+	}
+
+	dirname = g_path_get_dirname (path);
+	maildir = g_path_get_dirname (dirname);
+	basename = g_path_get_basename (path);
+	tmp_path = g_build_filename (maildir, "tmp", basename, NULL);
+
+	/* Through tmp/ like any delivery, then renamed over the old
+	 * file, which stays as it was in snapshots hardlinking it. */
+	success = g_file_set_contents (
+		tmp_path, (gchar *) byte_array->data,
+		byte_array->len, error);
+
+	if (success && g_rename (tmp_path, path) == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to update “%s”: %s"),
+			path, g_strerror (errsv));
+		g_unlink (tmp_path);
+		success = FALSE;
+	}
+
+	if (success && manifest != NULL)
+		attachment_stubs_update_manifest (
+			manifest, root_path, maildir,
+			basename, uid, byte_array);
+
+	g_free (tmp_path);
+	g_free (basename);
+	g_free (maildir);
+	g_free (dirname);
+	g_byte_array_free (byte_array, TRUE);
+
+	return success;
+}
+
+/* Helper for m_attachment_stubs_fetch_sync() */
+static gboolean
+attachment_stubs_fetch_file (CamelFolder *folder,
+                             const gchar *path,
+                             MExportManifest *manifest,
+                             const gchar *root_path,
+                             gboolean *out_fetched,
+                             GCancellable *cancellable,
+                             GError **error)
+{
+	CamelMimeMessage *message, *source;
+	CamelStream *stream;
+	GMappedFile *mapped_file;
+	StubsData data = { NULL, NULL };
+	GError *local_error = NULL;
+	const gchar *contents;
+	gsize length;
+	gboolean success;
+
+	*out_fetched = FALSE;
+
+	mapped_file = g_mapped_file_new (path, FALSE, error);
+	if (mapped_file == NULL)
+		return FALSE;
+
+	contents = g_mapped_file_get_contents (mapped_file);
+	length = g_mapped_file_get_length (mapped_file);
+
+	/* Most messages have no stubs, those are not even parsed. */
+	if (length == 0 || memmem (
+		contents, length, M_ATTACHMENT_STUB_ACCESS_TYPE,
+		strlen (M_ATTACHMENT_STUB_ACCESS_TYPE)) == NULL) {
+		g_mapped_file_unref (mapped_file);
+		return TRUE;
+	}
+
+	stream = camel_stream_mem_new_with_buffer (contents, length);
+	g_mapped_file_unref (mapped_file);
+
+	message = camel_mime_message_new ();
+
+	success = camel_data_wrapper_construct_from_stream_sync (
+		CAMEL_DATA_WRAPPER (message), stream, cancellable, error);
+
+	g_object_unref (stream);
+
+	if (!success)
+		goto exit;
+
+	data.stubs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	m_attachment_stubs_foreach_part (
+		CAMEL_MIME_PART (message), attachment_stubs_collect_cb, &data);
+
+	if (g_hash_table_size (data.stubs) == 0 || data.uid == NULL)
+		goto exit;
+
+	source = camel_folder_get_message_sync (
+		folder, data.uid, cancellable, &local_error);
+
+	if (source == NULL) {
+		/* Deleted from the source since, the stubs stay. */
+		if (g_error_matches (local_error, CAMEL_FOLDER_ERROR, CAMEL_FOLDER_ERROR_INVALID_UID)) {
+			g_clear_error (&local_error);
+		} else {
+			g_propagate_error (error, local_error);
+			success = FALSE;
+		}
+
+		goto exit;
+	}
+
+	m_attachment_stubs_foreach_part (
+		CAMEL_MIME_PART (source), attachment_stubs_restore_cb, data.stubs);
+
+	g_object_unref (source);
+
+	success = attachment_stubs_rewrite (
+		path, data.uid, manifest, root_path,
+		message, cancellable, error);
+	*out_fetched = success;
+
+exit:
+	if (data.stubs != NULL)
+		g_hash_table_destroy (data.stubs);
+
+	g_free (data.uid);
+	g_object_unref (message);
+
+	return success;
+}
+
+/* Helper for m_attachment_stubs_fetch_sync() */
+static void
+attachment_stubs_scan_maildir (const gchar *maildir,
+                               GPtrArray *paths)
+{
+	const gchar *subdirs[] = { "cur", "new" };
+	guint ii;
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		const gchar *name;
+		gchar *path;
+		GDir *dir;
+
+		path = g_build_filename (maildir, subdirs[ii], NULL);
+		dir = g_dir_open (path, 0, NULL);
+
+		while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+			if (*name != '.')
+				g_ptr_array_add (paths, g_build_filename (path, name, NULL));
+		}
+
+		if (dir != NULL)
+			g_dir_close (dir);
+
+		g_free (path);
+	}
+}
+
+/**
+ * m_attachment_stubs_fetch_sync:
+ * @folder: the #CamelFolder the offline store was exported from
+ * @source: root of the offline store
+ * @out_n_fetched: (out) (optional): return location for the number
+ *    of messages completed
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Completes the messages of a lightweight export: every maildir file
+ * with attachment stubs, in the store root and its Maildir++
+ * subfolders, has the real parts fetched from @folder put back in, and
+ * is replaced atomically, and its entry in the manifest updated.
+ * Messages packed by age are left alone.
+ * When @source holds export snapshots, the latest snapshot is completed.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_attachment_stubs_fetch_sync (CamelFolder *folder,
+                               GFile *source,
+                               guint *out_n_fetched,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+	MExportManifest *manifest;
+	GPtrArray *paths;
+	const gchar *name;
+	gchar *root_path, *cur;
+	gboolean success = TRUE;
+	guint n_fetched = 0;
+	guint ii;
+	GDir *dir;
+
+	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), FALSE);
+	g_return_val_if_fail (G_IS_FILE (source), FALSE);
+
+	root_path = g_file_get_path (source);
+	if (root_path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Attachments can be fetched only into a local directory"));
+		return FALSE;
+	}
+
+	/* A destination holding snapshots completes its latest one. */
+	cur = g_build_filename (root_path, "cur", NULL);
+	if (!g_file_test (cur, G_FILE_TEST_IS_DIR)) {
+		gchar *latest;
+
+		latest = g_build_filename (root_path, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+
+		if (g_file_test (latest, G_FILE_TEST_IS_DIR)) {
+			g_free (root_path);
+			root_path = latest;
+		} else {
+			g_free (latest);
+		}
+	}
+	g_free (cur);
+
+	dir = g_dir_open (root_path, 0, error);
+	if (dir == NULL) {
+		g_free (root_path);
+		return FALSE;
+	}
+
+	paths = g_ptr_array_new_with_free_func (g_free);
+
+	attachment_stubs_scan_maildir (root_path, paths);
+
+	/* Maildir++ subfolders of the date-partitioned layout. */
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		gchar *path;
+
+		if (*name != '.' || g_str_equal (name, "..") || g_str_equal (name, "."))
+			continue;
+
+		path = g_build_filename (root_path, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_IS_DIR))
+			attachment_stubs_scan_maildir (path, paths);
+		g_free (path);
+	}
+
+	g_dir_close (dir);
+
+	/* Stores exported before there were manifests have none. */
+	manifest = m_export_manifest_load (root_path, NULL);
+
+	camel_operation_push_message (cancellable, _("Fetching attachments"));
+
+	for (ii = 0; ii < paths->len && success; ii++) {
+		gboolean fetched = FALSE;
+
+		success = !g_cancellable_set_error_if_cancelled (cancellable, error) &&
+			attachment_stubs_fetch_file (
+				folder, g_ptr_array_index (paths, ii),
+				manifest, root_path, &fetched,
+				cancellable, error);
+
+		if (fetched)
+			n_fetched++;
+
+		camel_operation_progress (cancellable, (ii + 1) * 100 / paths->len);
+	}
+
+	camel_operation_pop_message (cancellable);
+
+	/* Even after an error, for the messages completed before. */
+	if (manifest != NULL && n_fetched > 0 &&
+	    !m_export_manifest_save (manifest, root_path, success ? error : NULL))
+		success = FALSE;
+
+	m_export_manifest_free (manifest);
+
+	if (out_n_fetched != NULL)
+		*out_n_fetched = n_fetched;
+
+	g_ptr_array_unref (paths);
+	g_free (root_path);
+
+	return success;
+}
@@ -0,0 +1,40 @@
+#ifndef M_ATTACHMENT_STUBS_H
+#define M_ATTACHMENT_STUBS_H
+
+/* Attachments left out of a lightweight export.
+ *
+ * Large non-text parts are replaced by a message/external-body part
+ * (RFC 2046) with the private access type below, whose parameters name
+ * the source UID, the part number and the original size, and whose body
+ * keeps the original MIME headers.  Mail clients show such a stub as an
+ * attachment which is not available; m_attachment_stubs_fetch_sync()
+ * puts the real parts back later. */
+
+#include <camel/camel.h>
+
+#define M_ATTACHMENT_STUB_ACCESS_TYPE "x-evolution-offline-store"
+
+G_BEGIN_DECLS
+
+/* Part numbers are 1-based and dotted like IMAP section numbers;
+ * return FALSE to stop. */
+typedef gboolean (* MAttachmentStubsFunc)	(CamelMimePart *part,
+						 const gchar *part_id,
+						 gpointer user_data);
+
+gboolean	m_attachment_stubs_foreach_part	(CamelMimePart *part,
+						 MAttachmentStubsFunc func,
+						 gpointer user_data);
+void		m_attachment_stub_replace	(CamelMimePart *part,
+						 const gchar *uid,
+						 const gchar *part_id,
+						 gsize size);
+gboolean	m_attachment_stubs_fetch_sync	(CamelFolder *folder,
+						 GFile *source,
+						 guint *out_n_fetched,
+						 GCancellable *cancellable,
+						 GError **error);
+
+G_END_DECLS
+
+#endif /* M_ATTACHMENT_STUBS_H */
@@ -0,0 +1,342 @@
+#include "config.h"
+
+#include "m-export-controller.h"
+
+#include <gio/gio.h>
+
+/* How often worker counts are reconsidered, in microseconds. */
+#define CONTROLLER_INTERVAL (G_USEC_PER_SEC)
+
+/* Throughput changes smaller than this are treated as noise. */
+#define CONTROLLER_TOLERANCE 0.05
+
+/* Per-message latency growing by more than this without any gain
+ * in throughput means the workers got in each other's way. */
+#define CONTROLLER_LATENCY_GROWTH 0.25
+
+/* Messages held in memory per worker, between fetch and write. */
+#define CONTROLLER_IN_FLIGHT_PER_WORKER 2
+
+typedef struct _PhaseState PhaseState;
+
+struct _PhaseState {
+	guint workers;
+	guint limit;
+
+	/* Accumulated since the last tick, under the lock. */
+	gint64 busy;
+	guint n_items;
+	gsize n_bytes;
+
+	/* Mean time per message in the previous window. */
+	gdouble latency;
+};
+
+struct _MExportController {
+	GMutex lock;
+	PhaseState phases[M_EXPORT_N_PHASES];
+
+	gint64 window_start;
+	gdouble throughput;	/* messages per second, previous window */
+
+	/* The last adjustment, judged in the next window. */
+	MExportPhase last_phase;
+	gint last_delta;
+
+	guint max_in_flight;
+	gboolean memory_tight;
+
+	gint low_memory;	/* atomic, set from the monitor's context */
+	GObject *memory_monitor;
+	gulong low_memory_handler_id;
+};
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+static void
+export_controller_low_memory_cb (GMemoryMonitor *monitor,
+				 GMemoryMonitorWarningLevel level,
+				 MExportController *controller)
+{
+	if (level >= G_MEMORY_MONITOR_WARNING_LEVEL_LOW)
+		g_atomic_int_set (&controller->low_memory, 1);
+}
+#endif
+
+static void
+export_controller_update_in_flight (MExportController *controller)
+{
+	guint workers = 0;
+	gint ii;
+
+	for (ii = 0; ii < M_EXPORT_N_PHASES; ii++)
+		workers += controller->phases[ii].workers;
+
+	/* Under memory pressure every worker gets one message only. */
+	controller->max_in_flight = controller->memory_tight ?
+		workers : workers * CONTROLLER_IN_FLIGHT_PER_WORKER;
+}
+
+/**
+ * m_export_controller_new:
+ * @max_workers: the most workers of one phase, or 0 for twice the
+ *    number of processors
+ *
+ * Creates a controller starting with two fetch workers and one write
+ * worker, which is about right for a local source.
+ *
+ * Returns: (transfer full): a new #MExportController
+ **/
+MExportController *
+m_export_controller_new (guint max_workers)
+{
+	MExportController *controller;
+	gint ii;
+
+	if (max_workers == 0)
+		max_workers = g_get_num_processors () * 2;
+
+	controller = g_slice_new0 (MExportController);
+	g_mutex_init (&controller->lock);
+
+	for (ii = 0; ii < M_EXPORT_N_PHASES; ii++)
+		controller->phases[ii].limit = max_workers;
+
+	controller->phases[M_EXPORT_PHASE_FETCH].workers = MIN (2, max_workers);
+	controller->phases[M_EXPORT_PHASE_WRITE].workers = 1;
+	controller->window_start = g_get_monotonic_time ();
+
+#if GLIB_CHECK_VERSION (2, 64, 0)
+	controller->memory_monitor = G_OBJECT (g_memory_monitor_dup_default ());
+	controller->low_memory_handler_id = g_signal_connect (
+		controller->memory_monitor, "low-memory-warning",
+		G_CALLBACK (export_controller_low_memory_cb), controller);
+#endif
+
+	export_controller_update_in_flight (controller);
+
+	return controller;
+}
+
+/**
+ * m_export_controller_set_limit:
+ * @controller: an #MExportController
+ * @phase: an #MExportPhase
+ * @max_workers: the most workers @phase may get, at least 1
+ *
+ * Caps the workers of @phase, for example by the number of connections
+ * a remote store allows.  This never raises the limit given to
+ * m_export_controller_new().
+ **/
+void
+m_export_controller_set_limit (MExportController *controller,
+			       MExportPhase phase,
+			       guint max_workers)
+{
+	PhaseState *state;
+
+	g_return_if_fail (controller != NULL);
+	g_return_if_fail (phase < M_EXPORT_N_PHASES);
+
+	state = &controller->phases[phase];
+	state->limit = MAX (MIN (max_workers, state->limit), 1);
+	state->workers = MIN (state->workers, state->limit);
+
+	export_controller_update_in_flight (controller);
+}
+
+/**
+ * m_export_controller_record:
+ * @controller: an #MExportController
+ * @phase: the #MExportPhase a message went through
+ * @duration: how long it took, in microseconds
+ * @n_bytes: size of the message
+ *
+ * Records one message passing @phase.  May be called from any thread.
+ **/
+void
+m_export_controller_record (MExportController *controller,
+			    MExportPhase phase,
+			    gint64 duration,
+			    gsize n_bytes)
+{
+	PhaseState *state;
+
+	g_return_if_fail (controller != NULL);
+	g_return_if_fail (phase < M_EXPORT_N_PHASES);
+
+	g_mutex_lock (&controller->lock);
+
+	state = &controller->phases[phase];
+	state->busy += MAX (duration, 0);
+	state->n_items++;
+	state->n_bytes += n_bytes;
+
+	g_mutex_unlock (&controller->lock);
+}
+
+/**
+ * m_export_controller_tick:
+ * @controller: an #MExportController
+ *
+ * Reconsiders the worker counts, at most once per second; call it
+ * whenever convenient.  A low memory warning halves the workers of
+ * both phases and tightens the in-flight limit for the rest of the run.
+ * Otherwise the busier phase, the one closest to all of its workers
+ * being occupied all the time, gets one worker more.  Changes which
+ * cost throughput in the following second are undone and the search
+ * turns around, and a phase whose latency only grew loses a worker.
+ *
+ * Returns: %TRUE if worker counts changed
+ **/
+gboolean
+m_export_controller_tick (MExportController *controller)
+{
+	PhaseState *bottleneck = NULL;
+	gdouble throughput, max_utilization = -1.0;
+	gdouble latencies[M_EXPORT_N_PHASES];
+	gint64 now, elapsed;
+	gboolean changed = FALSE;
+	gint ii;
+
+	g_return_val_if_fail (controller != NULL, FALSE);
+
+	now = g_get_monotonic_time ();
+	elapsed = now - controller->window_start;
+
+	if (elapsed < CONTROLLER_INTERVAL)
+		return FALSE;
+
+	g_mutex_lock (&controller->lock);
+
+	/* A single huge message can take longer than the interval,
+	 * in which case there is nothing to judge yet. */
+	if (controller->phases[M_EXPORT_PHASE_WRITE].n_items == 0) {
+		g_mutex_unlock (&controller->lock);
+		return FALSE;
+	}
+
+	throughput = controller->phases[M_EXPORT_PHASE_WRITE].n_items *
+		(gdouble) G_USEC_PER_SEC / elapsed;
+
+	for (ii = 0; ii < M_EXPORT_N_PHASES; ii++) {
+		PhaseState *state = &controller->phases[ii];
+		gdouble utilization;
+
+		latencies[ii] = state->n_items > 0 ?
+			(gdouble) state->busy / state->n_items : 0.0;
+
+		utilization = (gdouble) state->busy / ((gdouble) elapsed * state->workers);
+
+		if (utilization > max_utilization) {
+			max_utilization = utilization;
+			bottleneck = state;
+		}
+
+		state->busy = 0;
+		state->n_items = 0;
+		state->n_bytes = 0;
+	}
+
+	g_mutex_unlock (&controller->lock);
+
+	if (g_atomic_int_compare_and_exchange (&controller->low_memory, 1, 0)) {
+		for (ii = 0; ii < M_EXPORT_N_PHASES; ii++) {
+			PhaseState *state = &controller->phases[ii];
+
+			state->workers = MAX (state->workers / 2, 1);
+		}
+
+		controller->memory_tight = TRUE;
+		controller->last_delta = 0;
+		changed = TRUE;
+
+	} else if (controller->last_delta != 0 &&
+		   throughput < controller->throughput * (1.0 - CONTROLLER_TOLERANCE)) {
+		PhaseState *state = &controller->phases[controller->last_phase];
+
+		/* The last step made things worse, take it back. */
+		state->workers -= controller->last_delta;
+		controller->last_delta = 0;
+		changed = TRUE;
+
+	} else {
+		MExportPhase phase = bottleneck - controller->phases;
+		gboolean gained;
+		guint workers;
+		gint step = 1;
+
+		gained = throughput > controller->throughput * (1.0 + CONTROLLER_TOLERANCE);
+
+		/* Keep walking in the direction that paid off. */
+		if (controller->last_delta != 0 && gained)
+			step = controller->last_delta > 0 ? 1 : -1;
+		else if (!gained && bottleneck->latency > 0.0 &&
+			 latencies[phase] > bottleneck->latency * (1.0 + CONTROLLER_LATENCY_GROWTH))
+			step = -1;
+
+		workers = CLAMP ((gint) bottleneck->workers + step, 1, (gint) bottleneck->limit);
+
+		if (workers != bottleneck->workers) {
+			controller->last_phase = phase;
+			controller->last_delta = (gint) workers - (gint) bottleneck->workers;
+			bottleneck->workers = workers;
+			changed = TRUE;
+		} else {
+			controller->last_delta = 0;
+		}
+	}
+
+	for (ii = 0; ii < M_EXPORT_N_PHASES; ii++)
+		controller->phases[ii].latency = latencies[ii];
+
+	controller->throughput = throughput;
+	controller->window_start = now;
+
+	if (changed)
+		export_controller_update_in_flight (controller);
+
+	return changed;
+}
+
+guint
+m_export_controller_get_workers (MExportController *controller,
+				 MExportPhase phase)
+{
+	g_return_val_if_fail (controller != NULL, 1);
+	g_return_val_if_fail (phase < M_EXPORT_N_PHASES, 1);
+
+	return controller->phases[phase].workers;
+}
+
+/**
+ * m_export_controller_get_max_in_flight:
+ * @controller: an #MExportController
+ *
+ * Returns: how many messages may be between being fetched and
+ *    being written at once, which bounds the memory used
+ **/
+guint
+m_export_controller_get_max_in_flight (MExportController *controller)
+{
+	g_return_val_if_fail (controller != NULL, 1);
+
+	return controller->max_in_flight;
+}
+
+void
+m_export_controller_free (MExportController *controller)
+{
+	if (controller == NULL)
+		return;
+
+	if (controller->memory_monitor != NULL) {
+		g_signal_handler_disconnect (
+			controller->memory_monitor,
+			controller->low_memory_handler_id);
+		g_object_unref (controller->memory_monitor);
+	}
+
+	g_mutex_clear (&controller->lock);
+
+	g_slice_free (MExportController, controller);
+}
@@ -0,0 +1,44 @@
+#ifndef M_EXPORT_CONTROLLER_H
+#define M_EXPORT_CONTROLLER_H
+
+/* Feedback control of the number of export workers.
+ *
+ * The export runs as a pipeline of a fetch phase, which gets and
+ * serializes messages, and a write phase, which delivers them into the
+ * offline store.  The controller watches how long each phase takes per
+ * message and how many messages make it through, and once a second moves
+ * the worker count of the busier phase towards higher throughput.  Low
+ * memory warnings from GMemoryMonitor halve the workers and the number
+ * of messages held in memory at once. */
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+	M_EXPORT_PHASE_FETCH,
+	M_EXPORT_PHASE_WRITE,
+	M_EXPORT_N_PHASES
+} MExportPhase;
+
+typedef struct _MExportController MExportController;
+
+MExportController *
+		m_export_controller_new		(guint max_workers);
+void		m_export_controller_set_limit	(MExportController *controller,
+						 MExportPhase phase,
+						 guint max_workers);
+void		m_export_controller_record	(MExportController *controller,
+						 MExportPhase phase,
+						 gint64 duration,
+						 gsize n_bytes);
+gboolean	m_export_controller_tick	(MExportController *controller);
+guint		m_export_controller_get_workers	(MExportController *controller,
+						 MExportPhase phase);
+guint		m_export_controller_get_max_in_flight
+						(MExportController *controller);
+void		m_export_controller_free	(MExportController *controller);
+
+G_END_DECLS
+
+#endif /* M_EXPORT_CONTROLLER_H */
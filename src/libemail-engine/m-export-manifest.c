@@ -0,0 +1,949 @@
+#include "config.h"
+
+#include "m-export-manifest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+#include <camel/camel.h>
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#define MANIFEST_ALGORITHM "xxh3-128"
+#else
+#define MANIFEST_ALGORITHM "sha256-128"
+#endif
+
+#include "m-mail-folder-utils.h"
+#include "m-mail-pack.h"
+
+#define MANIFEST_HEADER "# offline-store manifest "
+
+typedef struct _ManifestEntry ManifestEntry;
+typedef struct _VerifyContext VerifyContext;
+typedef struct _VerifyItem VerifyItem;
+
+struct _MExportManifest {
+	/* Protects the entries, the writer adds them from
+	 * all of its threads. */
+	GMutex lock;
+	GHashTable *entries;	/* UID ~> ManifestEntry */
+};
+
+struct _ManifestEntry {
+	gchar *location;
+	guint64 size;
+	guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+};
+
+struct _VerifyContext {
+	GCancellable *cancellable;
+
+	/* Protects everything below. */
+	GMutex lock;
+	GCond cond;
+	guint pending;
+	guint n_checked;
+	GPtrArray *problems;
+};
+
+struct _VerifyItem {
+	VerifyContext *context;
+	const gchar *uid;
+	const ManifestEntry *entry;
+
+	/* Either a maildir file, or a pack holding the message. */
+	const gchar *path;
+	MMailPack *pack;
+};
+
+static void
+manifest_entry_free (ManifestEntry *entry)
+{
+	g_free (entry->location);
+
+	g_slice_free (ManifestEntry, entry);
+}
+
+/* Helper for m_export_manifest_load() */
+static gboolean
+export_manifest_parse_digest (const gchar *hex,
+                              guint8 *digest)
+{
+	guint ii;
+
+	if (strlen (hex) != M_EXPORT_MANIFEST_DIGEST_SIZE * 2)
+		return FALSE;
+
+	for (ii = 0; ii < M_EXPORT_MANIFEST_DIGEST_SIZE; ii++) {
+		gint high, low;
+
+		high = g_ascii_xdigit_value (hex[ii * 2]);
+		low = g_ascii_xdigit_value (hex[ii * 2 + 1]);
+
+		if (high == -1 || low == -1)
+			return FALSE;
+
+		digest[ii] = (high << 4) | low;
+	}
+
+	return TRUE;
+}
+
+/* Helper for m_export_manifest_save() */
+static gint
+export_manifest_compare_uids (gconstpointer a,
+                              gconstpointer b,
+                              gpointer user_data)
+{
+	GHashTable *entries = user_data;
+	const gchar *uid_a = *((const gchar **) a);
+	const gchar *uid_b = *((const gchar **) b);
+	const ManifestEntry *entry_a, *entry_b;
+	gint result;
+
+	entry_a = g_hash_table_lookup (entries, uid_a);
+	entry_b = g_hash_table_lookup (entries, uid_b);
+
+	/* In the order of the directories, which is also
+	 * about the order verifying reads them in. */
+	result = strcmp (entry_a->location, entry_b->location);
+	if (result == 0)
+		result = strcmp (uid_a, uid_b);
+
+	return result;
+}
+
+MExportManifest *
+m_export_manifest_new (void)
+{
+	MExportManifest *manifest;
+
+	manifest = g_slice_new0 (MExportManifest);
+	manifest->entries = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) manifest_entry_free);
+
+	g_mutex_init (&manifest->lock);
+
+	return manifest;
+}
+
+/**
+ * m_export_manifest_load:
+ * @root_path: root of the offline store
+ * @error: return location for a #GError, or %NULL
+ *
+ * Reads the manifest of the offline store at @root_path.  Fails with
+ * %G_IO_ERROR_NOT_FOUND when there is none, and with
+ * %G_IO_ERROR_NOT_SUPPORTED when it was written with digests this
+ * build does not compute.
+ *
+ * Returns: (transfer full): a new #MExportManifest, or %NULL on error
+ **/
+MExportManifest *
+m_export_manifest_load (const gchar *root_path,
+                        GError **error)
+{
+	MExportManifest *manifest;
+	GMappedFile *mapped_file;
+	gchar *filename, *contents, *line, *next;
+	gsize length;
+
+	g_return_val_if_fail (root_path != NULL, NULL);
+
+	filename = g_build_filename (root_path, M_EXPORT_MANIFEST_FILE_NAME, NULL);
+
+	mapped_file = g_mapped_file_new (filename, FALSE, error);
+	if (mapped_file == NULL) {
+		g_free (filename);
+		return NULL;
+	}
+
+	length = g_mapped_file_get_length (mapped_file);
+	contents = g_strndup (g_mapped_file_get_contents (mapped_file), length);
+	g_mapped_file_unref (mapped_file);
+
+	if (!g_str_has_prefix (contents, MANIFEST_HEADER)) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			_("“%s” is not a manifest"), filename);
+		g_free (contents);
+		g_free (filename);
+		return NULL;
+	}
+
+	line = contents + strlen (MANIFEST_HEADER);
+	next = strchr (line, '\n');
+	if (next != NULL)
+		*next++ = '\0';
+
+	if (!g_str_equal (line, MANIFEST_ALGORITHM)) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("“%s” holds %s digests, which this build does not compute"),
+			filename, line);
+		g_free (contents);
+		g_free (filename);
+		return NULL;
+	}
+
+	manifest = m_export_manifest_new ();
+
+	for (line = next; line != NULL && *line != '\0'; line = next) {
+		ManifestEntry *entry;
+		gchar **fields;
+		gchar *end;
+
+		next = strchr (line, '\n');
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (*line == '#')
+			continue;
+
+		/* digest, size, UID and location */
+		fields = g_strsplit (line, "\t", 4);
+
+		entry = g_slice_new0 (ManifestEntry);
+
+		if (g_strv_length (fields) != 4 ||
+		    !export_manifest_parse_digest (fields[0], entry->digest) ||
+		    (entry->size = g_ascii_strtoull (fields[1], &end, 10), *end != '\0')) {
+			g_set_error (
+				error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+				_("Malformed line in “%s”: %s"), filename, line);
+			manifest_entry_free (entry);
+			g_strfreev (fields);
+			m_export_manifest_free (manifest);
+			manifest = NULL;
+			break;
+		}
+
+		entry->location = g_strdup (fields[3]);
+		g_hash_table_insert (manifest->entries, g_strdup (fields[2]), entry);
+
+		g_strfreev (fields);
+	}
+
+	g_free (contents);
+	g_free (filename);
+
+	return manifest;
+}
+
+/**
+ * m_export_manifest_compute:
+ * @data: a message as stored
+ * @length: length of @data
+ * @digest: (out caller-allocates): %M_EXPORT_MANIFEST_DIGEST_SIZE bytes
+ *    to store the digest into
+ *
+ * Computes the digest of one message.  May be called from any thread.
+ **/
+void
+m_export_manifest_compute (const guint8 *data,
+                           gsize length,
+                           guint8 *digest)
+{
+#ifdef HAVE_XXHASH
+	XXH128_canonical_t canonical;
+
+	G_STATIC_ASSERT (sizeof (canonical.digest) == M_EXPORT_MANIFEST_DIGEST_SIZE);
+
+	XXH128_canonicalFromHash (&canonical, XXH3_128bits (data, length));
+	memcpy (digest, canonical.digest, M_EXPORT_MANIFEST_DIGEST_SIZE);
+#else
+	GChecksum *checksum;
+	guint8 buffer[32];
+	gsize buffer_len = sizeof (buffer);
+
+	checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+	/* Takes a signed length. */
+	while (length > 0) {
+		gsize chunk = MIN (length, G_MAXSSIZE);
+
+		g_checksum_update (checksum, data, chunk);
+		data += chunk;
+		length -= chunk;
+	}
+
+	g_checksum_get_digest (checksum, buffer, &buffer_len);
+	memcpy (digest, buffer, M_EXPORT_MANIFEST_DIGEST_SIZE);
+
+	g_checksum_free (checksum);
+#endif
+}
+
+/**
+ * m_export_manifest_set:
+ * @manifest: an #MExportManifest
+ * @uid: the message UID
+ * @location: where the message is, relative to the root of the store
+ * @digest: the digest from m_export_manifest_compute()
+ * @size: the size of the message as stored
+ *
+ * Adds the message @uid to @manifest, or updates it.  May be called
+ * from any thread.
+ **/
+void
+m_export_manifest_set (MExportManifest *manifest,
+                       const gchar *uid,
+                       const gchar *location,
+                       const guint8 *digest,
+                       guint64 size)
+{
+	ManifestEntry *entry;
+
+	g_return_if_fail (manifest != NULL);
+	g_return_if_fail (uid != NULL);
+	g_return_if_fail (location != NULL);
+	g_return_if_fail (digest != NULL);
+
+	entry = g_slice_new0 (ManifestEntry);
+	entry->location = g_strdup (location);
+	entry->size = size;
+	memcpy (entry->digest, digest, M_EXPORT_MANIFEST_DIGEST_SIZE);
+
+	g_mutex_lock (&manifest->lock);
+	g_hash_table_insert (manifest->entries, g_strdup (uid), entry);
+	g_mutex_unlock (&manifest->lock);
+}
+
+/**
+ * m_export_manifest_remove:
+ * @manifest: an #MExportManifest
+ * @uid: the message UID
+ *
+ * Drops the message @uid from @manifest, after it was deleted from
+ * the store.  May be called from any thread.
+ **/
+void
+m_export_manifest_remove (MExportManifest *manifest,
+                          const gchar *uid)
+{
+	g_return_if_fail (manifest != NULL);
+	g_return_if_fail (uid != NULL);
+
+	g_mutex_lock (&manifest->lock);
+	g_hash_table_remove (manifest->entries, uid);
+	g_mutex_unlock (&manifest->lock);
+}
+
+/**
+ * m_export_manifest_add_missing:
+ * @manifest: an #MExportManifest
+ * @previous: the #MExportManifest of the previous snapshot
+ *
+ * Adds the entries of @previous for every message @manifest does not
+ * list, for a snapshot which carried those messages over unchanged.
+ **/
+void
+m_export_manifest_add_missing (MExportManifest *manifest,
+                               MExportManifest *previous)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_return_if_fail (manifest != NULL);
+	g_return_if_fail (previous != NULL);
+
+	g_mutex_lock (&manifest->lock);
+	g_mutex_lock (&previous->lock);
+
+	g_hash_table_iter_init (&iter, previous->entries);
+
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		const ManifestEntry *old_entry = value;
+		ManifestEntry *entry;
+
+		if (g_hash_table_contains (manifest->entries, key))
+			continue;
+
+		entry = g_slice_dup (ManifestEntry, old_entry);
+		entry->location = g_strdup (old_entry->location);
+
+		g_hash_table_insert (manifest->entries, g_strdup (key), entry);
+	}
+
+	g_mutex_unlock (&previous->lock);
+	g_mutex_unlock (&manifest->lock);
+}
+
+/**
+ * m_export_manifest_lookup:
+ * @manifest: an #MExportManifest
+ * @uid: the message UID
+ * @out_digest: (out caller-allocates): %M_EXPORT_MANIFEST_DIGEST_SIZE
+ *    bytes to store the digest into
+ * @out_size: (out): return location for the size
+ *
+ * Returns: whether @manifest lists the message @uid
+ **/
+gboolean
+m_export_manifest_lookup (MExportManifest *manifest,
+                          const gchar *uid,
+                          guint8 *out_digest,
+                          guint64 *out_size)
+{
+	ManifestEntry *entry;
+
+	g_return_val_if_fail (manifest != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	g_mutex_lock (&manifest->lock);
+
+	entry = g_hash_table_lookup (manifest->entries, uid);
+
+	if (entry != NULL) {
+		memcpy (out_digest, entry->digest, M_EXPORT_MANIFEST_DIGEST_SIZE);
+		*out_size = entry->size;
+	}
+
+	g_mutex_unlock (&manifest->lock);
+
+	return entry != NULL;
+}
+
+/**
+ * m_export_manifest_dup_location:
+ * @manifest: an #MExportManifest
+ * @uid: the message UID
+ *
+ * Returns: (transfer full) (nullable): where the message @uid is,
+ *    relative to the root of the store, or %NULL when @manifest does
+ *    not list it
+ **/
+gchar *
+m_export_manifest_dup_location (MExportManifest *manifest,
+                                const gchar *uid)
+{
+	ManifestEntry *entry;
+	gchar *location = NULL;
+
+	g_return_val_if_fail (manifest != NULL, NULL);
+	g_return_val_if_fail (uid != NULL, NULL);
+
+	g_mutex_lock (&manifest->lock);
+
+	entry = g_hash_table_lookup (manifest->entries, uid);
+	if (entry != NULL)
+		location = g_strdup (entry->location);
+
+	g_mutex_unlock (&manifest->lock);
+
+	return location;
+}
+
+/**
+ * m_export_manifest_save:
+ * @manifest: an #MExportManifest
+ * @root_path: root of the offline store
+ * @error: return location for a #GError, or %NULL
+ *
+ * Atomically replaces the manifest of the offline store at @root_path
+ * with @manifest.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_export_manifest_save (MExportManifest *manifest,
+                        const gchar *root_path,
+                        GError **error)
+{
+	GPtrArray *uids;
+	GString *contents;
+	GHashTableIter iter;
+	gpointer key;
+	gchar *filename;
+	gboolean success;
+	guint ii;
+
+	g_return_val_if_fail (manifest != NULL, FALSE);
+	g_return_val_if_fail (root_path != NULL, FALSE);
+
+	contents = g_string_new (MANIFEST_HEADER MANIFEST_ALGORITHM "\n");
+	g_string_append (contents, "# digest\tsize\tUID\tlocation\n");
+
+	g_mutex_lock (&manifest->lock);
+
+	uids = g_ptr_array_sized_new (g_hash_table_size (manifest->entries));
+
+	g_hash_table_iter_init (&iter, manifest->entries);
+	while (g_hash_table_iter_next (&iter, &key, NULL))
+		g_ptr_array_add (uids, key);
+
+	g_ptr_array_sort_with_data (uids, export_manifest_compare_uids, manifest->entries);
+
+	for (ii = 0; ii < uids->len; ii++) {
+		const gchar *uid = g_ptr_array_index (uids, ii);
+		const ManifestEntry *entry;
+		guint jj;
+
+		entry = g_hash_table_lookup (manifest->entries, uid);
+
+		for (jj = 0; jj < M_EXPORT_MANIFEST_DIGEST_SIZE; jj++)
+			g_string_append_printf (contents, "%02x", entry->digest[jj]);
+
+		g_string_append_printf (
+			contents, "\t%" G_GUINT64_FORMAT "\t%s\t%s\n",
+			entry->size, uid, entry->location);
+	}
+
+	g_mutex_unlock (&manifest->lock);
+
+	filename = g_build_filename (root_path, M_EXPORT_MANIFEST_FILE_NAME, NULL);
+
+	success = g_file_set_contents (filename, contents->str, contents->len, error);
+
+	g_free (filename);
+	g_ptr_array_unref (uids);
+	g_string_free (contents, TRUE);
+
+	return success;
+}
+
+void
+m_export_manifest_free (MExportManifest *manifest)
+{
+	if (manifest == NULL)
+		return;
+
+	g_hash_table_destroy (manifest->entries);
+	g_mutex_clear (&manifest->lock);
+
+	g_slice_free (MExportManifest, manifest);
+}
+
+/* Helper for export_manifest_verify_thread() */
+static GBytes *
+export_manifest_map_file (const gchar *path,
+                          GError **error)
+{
+	GMappedFile *mapped_file;
+	GBytes *bytes;
+	gint fd;
+
+	fd = g_open (path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to open “%s”: %s"),
+			path, g_strerror (errsv));
+		return NULL;
+	}
+
+	mapped_file = g_mapped_file_new_from_fd (fd, FALSE, error);
+
+	/* The mapping outlives the descriptor. */
+	close (fd);
+
+	if (mapped_file == NULL)
+		return NULL;
+
+#ifdef MADV_SEQUENTIAL
+	if (g_mapped_file_get_length (mapped_file) > 0)
+		madvise (
+			g_mapped_file_get_contents (mapped_file),
+			g_mapped_file_get_length (mapped_file),
+			MADV_SEQUENTIAL);
+#endif
+
+	bytes = g_mapped_file_get_bytes (mapped_file);
+	g_mapped_file_unref (mapped_file);
+
+	return bytes;
+}
+
+/* Helper for export_manifest_verify_thread() */
+static void
+export_manifest_drop_file (const gchar *path)
+{
+#ifdef HAVE_POSIX_FADVISE
+	gint fd;
+
+	/* Verifying the whole store should not flush the page cache. */
+	fd = g_open (path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd != -1) {
+		posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+		close (fd);
+	}
+#endif
+}
+
+static void
+export_manifest_verify_thread (gpointer data,
+                               gpointer user_data)
+{
+	VerifyItem *item = data;
+	VerifyContext *context = item->context;
+	guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+	GBytes *bytes = NULL;
+	GError *local_error = NULL;
+	gchar *problem = NULL;
+
+	if (g_cancellable_is_cancelled (context->cancellable))
+		goto exit;
+
+	if (item->pack != NULL)
+		bytes = m_mail_pack_read (
+			item->pack, item->uid, NULL,
+			context->cancellable, &local_error);
+	else
+		bytes = export_manifest_map_file (item->path, &local_error);
+
+	if (bytes == NULL) {
+		problem = g_strdup (local_error->message);
+		g_clear_error (&local_error);
+	} else if (g_bytes_get_size (bytes) != item->entry->size) {
+		problem = g_strdup (_("size differs"));
+	} else {
+		m_export_manifest_compute (
+			g_bytes_get_data (bytes, NULL),
+			g_bytes_get_size (bytes), digest);
+
+		if (memcmp (digest, item->entry->digest, sizeof (digest)) != 0)
+			problem = g_strdup (_("content differs"));
+	}
+
+	if (bytes != NULL)
+		g_bytes_unref (bytes);
+
+	if (item->path != NULL)
+		export_manifest_drop_file (item->path);
+
+exit:
+	g_mutex_lock (&context->lock);
+
+	if (problem != NULL)
+		g_ptr_array_add (
+			context->problems, g_strdup_printf (
+			"%s (%s): %s", item->uid,
+			item->entry->location, problem));
+
+	context->n_checked++;
+	context->pending--;
+	if (context->pending == 0)
+		g_cond_signal (&context->cond);
+
+	g_mutex_unlock (&context->lock);
+
+	g_free (problem);
+	g_slice_free (VerifyItem, item);
+}
+
+/* Helper for export_manifest_index_files() */
+static void
+export_manifest_index_maildir (const gchar *root_path,
+                               const gchar *subfolder,
+                               GHashTable *files)
+{
+	const gchar *subdirs[] = { "cur", "new" };
+	guint ii;
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		const gchar *name;
+		gchar *path;
+		GDir *dir;
+
+		path = g_build_filename (root_path, subfolder, subdirs[ii], NULL);
+		dir = g_dir_open (path, 0, NULL);
+
+		while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+			const gchar *info;
+			gchar *basename;
+
+			if (*name == '.')
+				continue;
+
+			/* Keyed like the manifest, by the base name,
+			 * which does not change with the flags. */
+			info = strchr (name, ':');
+			if (info == NULL)
+				info = name + strlen (name);
+
+			basename = g_strndup (name, info - name);
+
+			g_hash_table_insert (
+				files,
+				*subfolder != '\0' ?
+					g_build_filename (subfolder, basename, NULL) :
+					g_strdup (basename),
+				g_build_filename (path, name, NULL));
+
+			g_free (basename);
+		}
+
+		if (dir != NULL)
+			g_dir_close (dir);
+		g_free (path);
+	}
+}
+
+/* Helper for m_export_manifest_verify_sync() */
+static gboolean
+export_manifest_index_files (const gchar *root_path,
+                             GHashTable *files,
+                             GError **error)
+{
+	const gchar *name;
+	GDir *dir;
+
+	dir = g_dir_open (root_path, 0, error);
+	if (dir == NULL)
+		return FALSE;
+
+	export_manifest_index_maildir (root_path, "", files);
+
+	/* Maildir++ subfolders of the date-partitioned layout. */
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		gchar *path;
+
+		if (*name != '.' || g_str_equal (name, "..") || g_str_equal (name, "."))
+			continue;
+
+		path = g_build_filename (root_path, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_IS_DIR))
+			export_manifest_index_maildir (root_path, name, files);
+		g_free (path);
+	}
+
+	g_dir_close (dir);
+
+	return TRUE;
+}
+
+/* Helper for m_export_manifest_verify_sync() */
+static MMailPack *
+export_manifest_lookup_pack (const gchar *root_path,
+                             const gchar *location,
+                             GHashTable *packs)
+{
+	MMailPack *pack;
+	gpointer value;
+	gchar *filename;
+
+	if (g_hash_table_lookup_extended (packs, location, NULL, &value))
+		return value;
+
+	filename = g_build_filename (root_path, location, NULL);
+
+	pack = NULL;
+	if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
+		pack = m_mail_pack_open (filename, FALSE, NULL);
+
+	/* Remember missing packs too, so they are tried only once. */
+	g_hash_table_insert (packs, g_strdup (location), pack);
+
+	g_free (filename);
+
+	return pack;
+}
+
+/**
+ * m_export_manifest_verify_sync:
+ * @source: root of the offline store
+ * @out_n_checked: (out) (optional): return location for the number of
+ *    messages checked
+ * @out_problems: (out) (optional) (transfer container): return location
+ *    for a description of every message which is missing or differs
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Checks every message listed in the manifest of the offline store at
+ * @source against its size and digest.  Messages are read through
+ * mappings, by as many threads as there are processors, so that the
+ * disk rather than hashing sets the pace.  When @source holds export
+ * snapshots, the latest snapshot is verified.
+ *
+ * Returns: %TRUE when every message is as listed, %FALSE otherwise
+ **/
+gboolean
+m_export_manifest_verify_sync (GFile *source,
+                               guint *out_n_checked,
+                               GPtrArray **out_problems,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+	MExportManifest *manifest;
+	VerifyContext context;
+	GThreadPool *pool;
+	GHashTable *files, *packs;
+	GHashTableIter iter;
+	gpointer key, value;
+	gchar *root_path, *cur;
+	gboolean success = TRUE;
+	guint n_total;
+
+	g_return_val_if_fail (G_IS_FILE (source), FALSE);
+
+	root_path = g_file_get_path (source);
+	if (root_path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Only a local directory can be verified"));
+		return FALSE;
+	}
+
+	/* A destination holding snapshots verifies its latest one. */
+	cur = g_build_filename (root_path, "cur", NULL);
+	if (!g_file_test (cur, G_FILE_TEST_IS_DIR)) {
+		gchar *latest;
+
+		latest = g_build_filename (root_path, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+
+		if (g_file_test (latest, G_FILE_TEST_IS_DIR)) {
+			g_free (root_path);
+			root_path = latest;
+		} else {
+			g_free (latest);
+		}
+	}
+	g_free (cur);
+
+	manifest = m_export_manifest_load (root_path, error);
+	if (manifest == NULL) {
+		g_free (root_path);
+		return FALSE;
+	}
+
+	files = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) g_free);
+
+	if (!export_manifest_index_files (root_path, files, error)) {
+		g_hash_table_destroy (files);
+		m_export_manifest_free (manifest);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	packs = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) m_mail_pack_free);
+
+	pool = g_thread_pool_new (
+		export_manifest_verify_thread, NULL,
+		g_get_num_processors (), FALSE, error);
+
+	if (pool == NULL) {
+		g_hash_table_destroy (packs);
+		g_hash_table_destroy (files);
+		m_export_manifest_free (manifest);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	memset (&context, 0, sizeof (VerifyContext));
+	context.cancellable = cancellable;
+	context.problems = g_ptr_array_new_with_free_func (g_free);
+
+	g_mutex_init (&context.lock);
+	g_cond_init (&context.cond);
+
+	n_total = g_hash_table_size (manifest->entries);
+
+	camel_operation_push_message (
+		cancellable, ngettext (
+			"Verifying %d message",
+			"Verifying %d messages",
+			n_total),
+		n_total);
+
+	/* Nobody adds entries any longer, so no need for the lock. */
+	g_hash_table_iter_init (&iter, manifest->entries);
+
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		const ManifestEntry *entry = value;
+		VerifyItem *item;
+		gchar *dirname;
+
+		item = g_slice_new0 (VerifyItem);
+		item->context = &context;
+		item->uid = key;
+		item->entry = entry;
+
+		/* Packs are read from the main thread only to open them,
+		 * after that messages can be read from any thread. */
+		dirname = g_path_get_dirname (entry->location);
+		if (g_str_equal (dirname, M_MAIL_PACK_DIR_NAME))
+			item->pack = export_manifest_lookup_pack (
+				root_path, entry->location, packs);
+		else
+			item->path = g_hash_table_lookup (files, entry->location);
+		g_free (dirname);
+
+		g_mutex_lock (&context.lock);
+
+		if (item->pack == NULL && item->path == NULL) {
+			g_ptr_array_add (
+				context.problems, g_strdup_printf (
+				"%s (%s): %s", item->uid,
+				entry->location, _("missing")));
+			context.n_checked++;
+			g_slice_free (VerifyItem, item);
+		} else {
+			context.pending++;
+			g_thread_pool_push (pool, item, NULL);
+		}
+
+		g_mutex_unlock (&context.lock);
+	}
+
+	g_mutex_lock (&context.lock);
+	while (context.pending > 0) {
+		camel_operation_progress (
+			cancellable, n_total > 0 ?
+			context.n_checked * 100 / n_total : 100);
+		g_cond_wait_until (
+			&context.cond, &context.lock,
+			g_get_monotonic_time () + G_USEC_PER_SEC);
+	}
+	g_mutex_unlock (&context.lock);
+
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	camel_operation_pop_message (cancellable);
+
+	if (out_n_checked != NULL)
+		*out_n_checked = context.n_checked;
+
+	if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+		success = FALSE;
+	} else if (context.problems->len > 0) {
+		success = FALSE;
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			ngettext (
+			"%u message of %u is missing or damaged",
+			"%u messages of %u are missing or damaged",
+			context.problems->len),
+			context.problems->len, n_total);
+	}
+
+	if (out_problems != NULL)
+		*out_problems = g_ptr_array_ref (context.problems);
+
+	g_ptr_array_unref (context.problems);
+	g_mutex_clear (&context.lock);
+	g_cond_clear (&context.cond);
+
+	g_hash_table_destroy (packs);
+	g_hash_table_destroy (files);
+	m_export_manifest_free (manifest);
+	g_free (root_path);
+
+	return success;
+}
@@ -0,0 +1,59 @@
+#ifndef M_EXPORT_MANIFEST_H
+#define M_EXPORT_MANIFEST_H
+
+/* Digests of everything in the offline store, to prove it complete.
+ *
+ * The writer hashes every message while it has it in memory anyway,
+ * and lists the digest with the UID, the size and the location in a
+ * manifest at the root of the store.  A maildir file is located by
+ * its subfolder and base name, which do not change with the flags;
+ * a packed message by its pack.  Digests are 128 bits of xxh3 when
+ * built with libxxhash, of SHA-256 otherwise, and the manifest names
+ * the algorithm it was written with. */
+
+#include <gio/gio.h>
+
+#define M_EXPORT_MANIFEST_FILE_NAME "offline-store.manifest"
+#define M_EXPORT_MANIFEST_DIGEST_SIZE 16
+
+G_BEGIN_DECLS
+
+typedef struct _MExportManifest MExportManifest;
+
+MExportManifest *
+		m_export_manifest_new		(void);
+MExportManifest *
+		m_export_manifest_load		(const gchar *root_path,
+						 GError **error);
+void		m_export_manifest_compute	(const guint8 *data,
+						 gsize length,
+						 guint8 *digest);
+void		m_export_manifest_set		(MExportManifest *manifest,
+						 const gchar *uid,
+						 const gchar *location,
+						 const guint8 *digest,
+						 guint64 size);
+void		m_export_manifest_remove	(MExportManifest *manifest,
+						 const gchar *uid);
+void		m_export_manifest_add_missing	(MExportManifest *manifest,
+						 MExportManifest *previous);
+gboolean	m_export_manifest_lookup	(MExportManifest *manifest,
+						 const gchar *uid,
+						 guint8 *out_digest,
+						 guint64 *out_size);
+gchar *		m_export_manifest_dup_location	(MExportManifest *manifest,
+						 const gchar *uid);
+gboolean	m_export_manifest_save		(MExportManifest *manifest,
+						 const gchar *root_path,
+						 GError **error);
+void		m_export_manifest_free		(MExportManifest *manifest);
+
+gboolean	m_export_manifest_verify_sync	(GFile *source,
+						 guint *out_n_checked,
+						 GPtrArray **out_problems,
+						 GCancellable *cancellable,
+						 GError **error);
+
+G_END_DECLS
+
+#endif /* M_EXPORT_MANIFEST_H */
@@ -0,0 +1,115 @@
+#include "config.h"
+
+#include "m-export-options.h"
+
+#include <gio/gio.h>
+
+/**
+ * m_export_options_new:
+ *
+ * Creates a new #MExportOptions with built-in defaults, which export
+ * every message as a plain maildir file.
+ *
+ * Returns: a new #MExportOptions, free with m_export_options_free()
+ **/
+MExportOptions *
+m_export_options_new (void)
+{
+	MExportOptions *options;
+
+	options = g_slice_new0 (MExportOptions);
+	options->pack_age_days = 0;
+	options->layout = M_EXPORT_LAYOUT_FLAT;
+	options->snapshots = FALSE;
+	options->cache_hints = TRUE;
+	options->direct_io_threshold = 0;
+	options->max_workers = 0;
+	options->throttle = NULL;
+	options->attachment_stub_threshold = 0;
+	options->newest_first = FALSE;
+	options->io_priority = M_THROTTLE_IO_PRIORITY_NORMAL;
+	options->trace = NULL;
+
+	return options;
+}
+
+/**
+ * m_export_options_new_from_settings:
+ *
+ * Creates a new #MExportOptions filled from the plugin's #GSettings.
+ * When the schema is not installed the built-in defaults are used,
+ * rather than aborting the whole Evolution process.
+ *
+ * Returns: a new #MExportOptions, free with m_export_options_free()
+ **/
+MExportOptions *
+m_export_options_new_from_settings (void)
+{
+	GSettingsSchemaSource *source;
+	GSettingsSchema *schema;
+	GSettings *settings;
+	MExportOptions *options;
+
+	options = m_export_options_new ();
+
+	source = g_settings_schema_source_get_default ();
+	if (source == NULL)
+		return options;
+
+	schema = g_settings_schema_source_lookup (
+		source, M_EXPORT_SETTINGS_SCHEMA, TRUE);
+	if (schema == NULL)
+		return options;
+
+	settings = g_settings_new_full (schema, NULL, NULL);
+
+	options->pack_age_days = g_settings_get_uint (settings, "pack-age-days");
+	options->layout = g_settings_get_enum (settings, "layout");
+	options->snapshots = g_settings_get_boolean (settings, "snapshots");
+	options->cache_hints = g_settings_get_boolean (settings, "cache-hints");
+	options->direct_io_threshold = g_settings_get_uint (settings, "direct-io-threshold");
+	options->max_workers = g_settings_get_uint (settings, "max-workers");
+	options->io_priority = g_settings_get_enum (settings, "io-priority");
+	options->attachment_stub_threshold = g_settings_get_uint (settings, "attachment-stub-threshold");
+	options->newest_first = g_settings_get_boolean (settings, "newest-first");
+
+	/* Follows the settings, so limits can be changed
+	 * in the middle of a long running export. */
+	options->throttle = m_throttle_new_for_settings (settings);
+
+	g_object_unref (settings);
+	g_settings_schema_unref (schema);
+
+	return options;
+}
+
+MExportOptions *
+m_export_options_copy (const MExportOptions *options)
+{
+	MExportOptions *copy;
+
+	g_return_val_if_fail (options != NULL, NULL);
+
+	copy = g_slice_dup (MExportOptions, options);
+
+	/* Shared, so that changing the limits reaches the copy. */
+	if (copy->throttle != NULL)
+		m_throttle_ref (copy->throttle);
+
+	if (copy->trace != NULL)
+		m_export_trace_ref (copy->trace);
+
+	return copy;
+}
+
+void
+m_export_options_free (MExportOptions *options)
+{
+	if (options == NULL)
+		return;
+
+	m_throttle_unref (options->throttle);
+	m_export_trace_unref (options->trace);
+
+	g_slice_free (MExportOptions, options);
+}
@@ -0,0 +1,82 @@
+#ifndef M_EXPORT_OPTIONS_H
+#define M_EXPORT_OPTIONS_H
+
+/* Tunables for exporting a CamelFolder into the offline store. */
+
+#include <glib.h>
+
+#include "m-export-trace.h"
+#include "m-throttle.h"
+
+#define M_EXPORT_SETTINGS_SCHEMA "org.gnome.evolution.plugin.offline-store"
+
+G_BEGIN_DECLS
+
+/* Keep in sync with the Layout enum of the GSettings schema. */
+typedef enum {
+	M_EXPORT_LAYOUT_FLAT,
+	M_EXPORT_LAYOUT_YEAR,
+	M_EXPORT_LAYOUT_MONTH
+} MExportLayout;
+
+typedef struct _MExportOptions MExportOptions;
+
+struct _MExportOptions {
+	/* Messages received more than this many days ago are packed
+	 * into one compressed archive per month instead of being
+	 * written as single maildir files.  Zero disables tiering. */
+	guint pack_age_days;
+
+	/* Whether messages go straight into the maildir root or into
+	 * Maildir++ subfolders by the year or month of their date. */
+	MExportLayout layout;
+
+	/* Whether every export creates a new dated snapshot below the
+	 * destination, hardlinking messages that did not change since
+	 * the previous snapshot instead of writing them again. */
+	gboolean snapshots;
+
+	/* Whether to keep the export from flushing the page cache: the
+	 * source is read ahead and dropped once copied, and delivered
+	 * files are dropped once they reached the disk. */
+	gboolean cache_hints;
+
+	/* Messages of at least this many KiB bypass the page cache with
+	 * O_DIRECT where the file system supports it.  Zero disables. */
+	guint direct_io_threshold;
+
+	/* The most fetch or write workers the export may grow to; how
+	 * many it actually uses is tuned while it runs.  Zero means
+	 * twice the number of processors. */
+	guint max_workers;
+
+	/* Limits on bytes and files written per second, which may be
+	 * changed while the export runs, or %NULL for no limits. */
+	MThrottle *throttle;
+
+	/* Lightweight export: non-text parts of at least this many KiB
+	 * are replaced by stubs to be fetched later, when needed.  Zero
+	 * exports every message in full. */
+	guint attachment_stub_threshold;
+
+	/* Whether messages are exported by date, newest first, making
+	 * the store readable at the end of the last day, week and month
+	 * already, rather than in the order they were given in. */
+	gboolean newest_first;
+
+	/* I/O scheduling class of the export threads. */
+	MThrottleIOPriority io_priority;
+
+	/* Receives a span for every step of every message, or %NULL. */
+	MExportTrace *trace;
+};
+
+MExportOptions *	m_export_options_new		(void);
+MExportOptions *	m_export_options_new_from_settings
+							(void);
+MExportOptions *	m_export_options_copy		(const MExportOptions *options);
+void			m_export_options_free		(MExportOptions *options);
+
+G_END_DECLS
+
+#endif /* M_EXPORT_OPTIONS_H */
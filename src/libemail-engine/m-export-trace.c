@@ -0,0 +1,205 @@
+#include "config.h"
+
+#include "m-export-trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+/* Events are small, a large buffer keeps the lock short. */
+#define TRACE_BUFFER_SIZE (256 * 1024)
+
+struct _MExportTrace {
+	volatile gint ref_count;
+
+	/* Protects the file. */
+	GMutex lock;
+	FILE *file;
+	gchar *filename;
+	gint pid;
+};
+
+static gint
+export_trace_get_thread_id (void)
+{
+#if defined (HAVE_SYS_SYSCALL_H) && defined (SYS_gettid)
+	/* The real thread ID, so that the trace lines up with perf. */
+	return (gint) syscall (SYS_gettid);
+#else
+	static GPrivate thread_id = G_PRIVATE_INIT (NULL);
+	static gint last_id = 0;
+	gint id;
+
+	id = GPOINTER_TO_INT (g_private_get (&thread_id));
+	if (id == 0) {
+		id = g_atomic_int_add (&last_id, 1) + 1;
+		g_private_set (&thread_id, GINT_TO_POINTER (id));
+	}
+
+	return id;
+#endif
+}
+
+static void
+export_trace_append_string (GString *buffer,
+                            const gchar *str)
+{
+	const gchar *p;
+
+	g_string_append_c (buffer, '"');
+
+	for (p = str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\')
+			g_string_append_printf (buffer, "\\%c", *p);
+		else if ((guchar) *p < 0x20)
+			g_string_append_printf (buffer, "\\u%04x", (guchar) *p);
+		else
+			g_string_append_c (buffer, *p);
+	}
+
+	g_string_append_c (buffer, '"');
+}
+
+/**
+ * m_export_trace_new:
+ * @filename: where to write the trace
+ * @error: return location for a #GError, or %NULL
+ *
+ * Creates @filename, replacing any earlier trace, and opens the event
+ * array in it; the array is closed when the last reference is dropped.
+ *
+ * Returns: (transfer full): a new #MExportTrace, or %NULL on error
+ **/
+MExportTrace *
+m_export_trace_new (const gchar *filename,
+                    GError **error)
+{
+	MExportTrace *trace;
+	GString *buffer;
+	FILE *file;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+
+	file = g_fopen (filename, "we");
+	if (file == NULL) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to create “%s”: %s"),
+			filename, g_strerror (errsv));
+		return NULL;
+	}
+
+	setvbuf (file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	trace = g_slice_new0 (MExportTrace);
+	trace->ref_count = 1;
+	trace->file = file;
+	trace->filename = g_strdup (filename);
+	trace->pid = getpid ();
+
+	g_mutex_init (&trace->lock);
+
+	/* Names the process in the viewer, and spares
+	 * every later event the check for being first. */
+	buffer = g_string_new ("[\n{\"name\":\"process_name\",\"ph\":\"M\",");
+	g_string_append_printf (buffer, "\"pid\":%d,\"args\":{\"name\":", trace->pid);
+	export_trace_append_string (buffer, g_get_prgname () != NULL ? g_get_prgname () : "export");
+	g_string_append (buffer, "}}");
+
+	fputs (buffer->str, file);
+
+	g_string_free (buffer, TRUE);
+
+	return trace;
+}
+
+MExportTrace *
+m_export_trace_ref (MExportTrace *trace)
+{
+	g_return_val_if_fail (trace != NULL, NULL);
+
+	g_atomic_int_inc (&trace->ref_count);
+
+	return trace;
+}
+
+void
+m_export_trace_unref (MExportTrace *trace)
+{
+	if (trace == NULL)
+		return;
+
+	if (!g_atomic_int_dec_and_test (&trace->ref_count))
+		return;
+
+	/* Nothing to hand an error to any longer, and an incomplete
+	 * trace is no reason to fail the export it belongs to. */
+	if (fputs ("\n]\n", trace->file) == EOF || fclose (trace->file) == EOF)
+		g_warning (
+			"Failed to write trace “%s”: %s",
+			trace->filename, g_strerror (errno));
+
+	g_mutex_clear (&trace->lock);
+	g_free (trace->filename);
+
+	g_slice_free (MExportTrace, trace);
+}
+
+/**
+ * m_export_trace_span:
+ * @trace: an #MExportTrace
+ * @step: what was done, like "fetch" or "write"
+ * @uid: the message UID
+ * @started: monotonic time the step started at, in microseconds
+ * @n_bytes: the size of the message, or -1 if the step failed
+ *
+ * Records @step of the message @uid as lasting from @started until
+ * now, on the calling thread.  May be called from any thread.
+ **/
+void
+m_export_trace_span (MExportTrace *trace,
+                     const gchar *step,
+                     const gchar *uid,
+                     gint64 started,
+                     gssize n_bytes)
+{
+	GString *buffer;
+	gint64 now;
+
+	g_return_if_fail (trace != NULL);
+	g_return_if_fail (step != NULL);
+	g_return_if_fail (uid != NULL);
+
+	now = g_get_monotonic_time ();
+
+	buffer = g_string_sized_new (160);
+
+	g_string_append (buffer, ",\n{\"name\":");
+	export_trace_append_string (buffer, step);
+	g_string_append_printf (
+		buffer, ",\"cat\":\"export\",\"ph\":\"X\","
+		"\"ts\":%" G_GINT64_FORMAT ",\"dur\":%" G_GINT64_FORMAT ","
+		"\"pid\":%d,\"tid\":%d,\"args\":{\"uid\":",
+		started, now - started, trace->pid,
+		export_trace_get_thread_id ());
+	export_trace_append_string (buffer, uid);
+	g_string_append_printf (
+		buffer, ",\"bytes\":%" G_GSSIZE_FORMAT "}}", n_bytes);
+
+	g_mutex_lock (&trace->lock);
+	fwrite (buffer->str, 1, buffer->len, trace->file);
+	g_mutex_unlock (&trace->lock);
+
+	g_string_free (buffer, TRUE);
+}
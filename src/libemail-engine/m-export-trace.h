@@ -0,0 +1,49 @@
+#ifndef M_EXPORT_TRACE_H
+#define M_EXPORT_TRACE_H
+
+/* Tracing single messages through an export, for the outliers which
+ * averages hide, like one huge message or a lock everybody waits for.
+ *
+ * Static probes (USDT, from systemtap's sys/sdt.h) mark where the
+ * fetch, prepare, serialize, write and commit steps of every message
+ * start and end, for perf, bpftrace or stap; nobody listening, each is
+ * a single no-op.  The provider is "evolution_offline_store", the
+ * first argument of every probe the UID; the "*__done" probes also get
+ * the size in bytes where known, zero otherwise, and -1 on error.
+ *
+ * An MExportTrace writes the same steps as complete events in the
+ * Chrome trace event format, for about:tracing or Perfetto.  Their
+ * time stamps come from the monotonic clock, as those of perf do. */
+
+#include <glib.h>
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define M_EXPORT_PROBE_START(step, uid) \
+	DTRACE_PROBE1 (evolution_offline_store, step##__start, uid)
+#define M_EXPORT_PROBE_DONE(step, uid, n_bytes) \
+	DTRACE_PROBE2 (evolution_offline_store, step##__done, uid, n_bytes)
+#else
+#define M_EXPORT_PROBE_START(step, uid) \
+	G_STMT_START { (void) (uid); } G_STMT_END
+#define M_EXPORT_PROBE_DONE(step, uid, n_bytes) \
+	G_STMT_START { (void) (uid); (void) (n_bytes); } G_STMT_END
+#endif
+
+G_BEGIN_DECLS
+
+typedef struct _MExportTrace MExportTrace;
+
+MExportTrace *	m_export_trace_new		(const gchar *filename,
+						 GError **error);
+MExportTrace *	m_export_trace_ref		(MExportTrace *trace);
+void		m_export_trace_unref		(MExportTrace *trace);
+void		m_export_trace_span		(MExportTrace *trace,
+						 const gchar *step,
+						 const gchar *uid,
+						 gint64 started,
+						 gssize n_bytes);
+
+G_END_DECLS
+
+#endif /* M_EXPORT_TRACE_H */
@@ -0,0 +1,465 @@
+#include "config.h"
+
+#include "m-folder-digest.h"
+
+#include <string.h>
+
+#include <glib/gi18n-lib.h>
+
+#include "m-export-manifest.h"
+#include "m-maildir-utils.h"
+
+#define DIGEST_SIZE M_EXPORT_MANIFEST_DIGEST_SIZE
+
+/* A range ends after a UID whose hash has the low byte zero,
+ * which makes ranges of about 256 UIDs. */
+#define DIGEST_RANGE_BOUNDARY(uid_digest) ((uid_digest)[0] == 0)
+
+#define DIGEST_HEADER "# offline-store digest\n"
+
+typedef struct _DigestRange DigestRange;
+
+struct _MFolderDigest {
+	guint8 root[DIGEST_SIZE];
+	GArray *ranges;		/* DigestRange */
+
+	/* From m_folder_digest_dup_stamp(), may be NULL. */
+	gchar *stamp;
+
+	/* Only for digests made from a folder. */
+	GPtrArray *uids;	/* sorted UIDs */
+};
+
+struct _DigestRange {
+	guint8 digest[DIGEST_SIZE];
+	guint start;		/* into uids */
+	guint n_uids;
+};
+
+static gint
+folder_digest_compare_uids (gconstpointer a,
+                            gconstpointer b)
+{
+	return strcmp (*((const gchar **) a), *((const gchar **) b));
+}
+
+static void
+folder_digest_append_hex (GString *string,
+                          const guint8 *digest)
+{
+	guint ii;
+
+	for (ii = 0; ii < DIGEST_SIZE; ii++)
+		g_string_append_printf (string, "%02x", digest[ii]);
+}
+
+static gboolean
+folder_digest_parse_hex (const gchar *hex,
+                         guint8 *digest)
+{
+	guint ii;
+
+	for (ii = 0; ii < DIGEST_SIZE; ii++) {
+		gint high, low;
+
+		high = g_ascii_xdigit_value (hex[ii * 2]);
+		if (high == -1)
+			return FALSE;
+
+		low = g_ascii_xdigit_value (hex[ii * 2 + 1]);
+		if (low == -1)
+			return FALSE;
+
+		digest[ii] = (high << 4) | low;
+	}
+
+	return hex[DIGEST_SIZE * 2] == '\0';
+}
+
+static MFolderDigest *
+folder_digest_new (void)
+{
+	MFolderDigest *digest;
+
+	digest = g_slice_new0 (MFolderDigest);
+	digest->ranges = g_array_new (FALSE, FALSE, sizeof (DigestRange));
+
+	return digest;
+}
+
+/**
+ * m_folder_digest_dup_stamp:
+ * @folder: a #CamelFolder
+ *
+ * Describes the state of @folder in a few numbers its summary keeps
+ * anyway, without looking at a single message info.  Only an IMAP
+ * folder on a server with CONDSTORE has them: UIDVALIDITY, UIDNEXT
+ * and HIGHESTMODSEQ, which grows with every flag change, and the
+ * message counts, which also change with flags changed locally and
+ * not yet pushed to the server.  An unchanged stamp then means an
+ * unchanged folder.
+ *
+ * Returns: (transfer full) (nullable): the stamp of @folder, or %NULL
+ *    when its store cannot tell changes apart that cheaply
+ **/
+gchar *
+m_folder_digest_dup_stamp (CamelFolder *folder)
+{
+	CamelFolderSummary *summary;
+	CamelIMAPXSummary *imapx_summary;
+
+	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), NULL);
+
+	summary = camel_folder_get_folder_summary (folder);
+	if (summary == NULL || !CAMEL_IS_IMAPX_SUMMARY (summary))
+		return NULL;
+
+	imapx_summary = CAMEL_IMAPX_SUMMARY (summary);
+
+	/* Without CONDSTORE a flag change leaves no trace here. */
+	if (imapx_summary->modseq == 0)
+		return NULL;
+
+	return g_strdup_printf (
+		"imapx %" G_GUINT64_FORMAT " %u %" G_GUINT64_FORMAT " %u %u %u %u",
+		imapx_summary->validity,
+		imapx_summary->uidnext,
+		imapx_summary->modseq,
+		camel_folder_summary_get_saved_count (summary),
+		camel_folder_summary_get_unread_count (summary),
+		camel_folder_summary_get_deleted_count (summary),
+		camel_folder_summary_get_junk_count (summary));
+}
+
+/**
+ * m_folder_digest_new:
+ * @folder: a #CamelFolder
+ * @uids: the UIDs of all messages in @folder
+ *
+ * Computes the digest of @folder from its summary, without reading a
+ * single message.  This looks up the message info of every UID in
+ * @uids, so it costs a walk over the whole summary, which comparing
+ * stamps first spares folders that did not change.  Only the flags
+ * the offline store keeps count.
+ *
+ * Returns: (transfer full): a new #MFolderDigest
+ **/
+MFolderDigest *
+m_folder_digest_new (CamelFolder *folder,
+                     GPtrArray *uids)
+{
+	MFolderDigest *digest;
+	GByteArray *roots;
+	GString *records;
+	DigestRange range;
+	guint32 flags_mask;
+	guint ii;
+
+	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), NULL);
+	g_return_val_if_fail (uids != NULL, NULL);
+
+	digest = folder_digest_new ();
+	digest->uids = g_ptr_array_new_full (uids->len, g_free);
+
+	for (ii = 0; ii < uids->len; ii++)
+		g_ptr_array_add (digest->uids, g_strdup (g_ptr_array_index (uids, ii)));
+
+	/* Byte order, whatever order the folder sorts its UIDs in. */
+	g_ptr_array_sort (digest->uids, folder_digest_compare_uids);
+
+	flags_mask = m_maildir_get_flags_mask ();
+	records = g_string_sized_new (8192);
+	roots = g_byte_array_new ();
+
+	memset (&range, 0, sizeof (DigestRange));
+
+	for (ii = 0; ii < digest->uids->len; ii++) {
+		const gchar *uid = g_ptr_array_index (digest->uids, ii);
+		guint8 uid_digest[DIGEST_SIZE];
+		CamelMessageInfo *info;
+		guint32 flags = 0, size = 0;
+
+		info = camel_folder_get_message_info (folder, uid);
+		if (info != NULL) {
+			flags = camel_message_info_get_flags (info) & flags_mask;
+			size = camel_message_info_get_size (info);
+			g_object_unref (info);
+		}
+
+		g_string_append_printf (records, "%s\t%u\t%u\n", uid, flags, size);
+		range.n_uids++;
+
+		m_export_manifest_compute ((const guint8 *) uid, strlen (uid), uid_digest);
+
+		if (!DIGEST_RANGE_BOUNDARY (uid_digest) && ii + 1 < digest->uids->len)
+			continue;
+
+		m_export_manifest_compute (
+			(const guint8 *) records->str,
+			records->len, range.digest);
+		g_array_append_val (digest->ranges, range);
+		g_byte_array_append (roots, range.digest, DIGEST_SIZE);
+
+		g_string_truncate (records, 0);
+		range.start = ii + 1;
+		range.n_uids = 0;
+	}
+
+	m_export_manifest_compute (roots->data, roots->len, digest->root);
+
+	g_byte_array_free (roots, TRUE);
+	g_string_free (records, TRUE);
+
+	return digest;
+}
+
+/**
+ * m_folder_digest_load:
+ * @root_path: root of the offline store
+ * @error: return location for a #GError, or %NULL
+ *
+ * Reads the digest saved with the offline store at @root_path.
+ *
+ * Returns: (transfer full): an #MFolderDigest, or %NULL on error
+ **/
+MFolderDigest *
+m_folder_digest_load (const gchar *root_path,
+                      GError **error)
+{
+	MFolderDigest *digest;
+	gchar *filename, *contents = NULL;
+	gchar **lines;
+	gboolean success;
+	guint ii;
+
+	g_return_val_if_fail (root_path != NULL, NULL);
+
+	filename = g_build_filename (root_path, M_FOLDER_DIGEST_FILE_NAME, NULL);
+
+	if (!g_file_get_contents (filename, &contents, NULL, error)) {
+		g_free (filename);
+		return NULL;
+	}
+
+	digest = folder_digest_new ();
+	lines = g_strsplit (contents, "\n", -1);
+
+	/* The header, the root, maybe the stamp, then one line
+	 * per range. */
+	success = g_str_has_prefix (contents, DIGEST_HEADER) &&
+		lines[1] != NULL && g_str_has_prefix (lines[1], "root ") &&
+		folder_digest_parse_hex (lines[1] + 5, digest->root);
+
+	ii = 2;
+
+	if (success && lines[ii] != NULL && g_str_has_prefix (lines[ii], "stamp ")) {
+		digest->stamp = g_strdup (lines[ii] + 6);
+		ii++;
+	}
+
+	for (; success && lines[ii] != NULL && *lines[ii] != '\0'; ii++) {
+		DigestRange range;
+		gchar *tab, *end;
+
+		memset (&range, 0, sizeof (DigestRange));
+
+		tab = strchr (lines[ii], '\t');
+		success = tab != NULL;
+
+		if (success) {
+			*tab++ = '\0';
+			range.n_uids = (guint) g_ascii_strtoull (tab, &end, 10);
+			success = *end == '\0' &&
+				folder_digest_parse_hex (lines[ii], range.digest);
+		}
+
+		if (success)
+			g_array_append_val (digest->ranges, range);
+	}
+
+	if (!success) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			_("“%s” is not a folder digest"), filename);
+		g_clear_pointer (&digest, m_folder_digest_free);
+	}
+
+	g_strfreev (lines);
+	g_free (contents);
+	g_free (filename);
+
+	return digest;
+}
+
+/**
+ * m_folder_digest_save:
+ * @digest: an #MFolderDigest
+ * @root_path: root of the offline store
+ * @error: return location for a #GError, or %NULL
+ *
+ * Atomically replaces the digest saved with the offline store at
+ * @root_path.  Save it only once the store holds every message
+ * @digest covers.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_folder_digest_save (MFolderDigest *digest,
+                      const gchar *root_path,
+                      GError **error)
+{
+	GString *contents;
+	gchar *filename;
+	gboolean success;
+	guint ii;
+
+	g_return_val_if_fail (digest != NULL, FALSE);
+	g_return_val_if_fail (root_path != NULL, FALSE);
+
+	contents = g_string_new (DIGEST_HEADER "root ");
+	folder_digest_append_hex (contents, digest->root);
+	g_string_append_c (contents, '\n');
+
+	if (digest->stamp != NULL)
+		g_string_append_printf (contents, "stamp %s\n", digest->stamp);
+
+	for (ii = 0; ii < digest->ranges->len; ii++) {
+		DigestRange *range;
+
+		range = &g_array_index (digest->ranges, DigestRange, ii);
+
+		folder_digest_append_hex (contents, range->digest);
+		g_string_append_printf (contents, "\t%u\n", range->n_uids);
+	}
+
+	filename = g_build_filename (root_path, M_FOLDER_DIGEST_FILE_NAME, NULL);
+
+	success = g_file_set_contents (filename, contents->str, contents->len, error);
+
+	g_free (filename);
+	g_string_free (contents, TRUE);
+
+	return success;
+}
+
+/**
+ * m_folder_digest_get_stamp:
+ * @digest: an #MFolderDigest
+ *
+ * Returns: (nullable): the stamp of the folder @digest was made from,
+ *    or %NULL when it has none
+ **/
+const gchar *
+m_folder_digest_get_stamp (MFolderDigest *digest)
+{
+	g_return_val_if_fail (digest != NULL, NULL);
+
+	return digest->stamp;
+}
+
+/**
+ * m_folder_digest_set_stamp:
+ * @digest: an #MFolderDigest
+ * @stamp: (nullable): a stamp from m_folder_digest_dup_stamp(), taken
+ *    before the UIDs @digest was made from, or %NULL
+ *
+ * Saves @stamp with @digest, for the next sync to compare first.
+ **/
+void
+m_folder_digest_set_stamp (MFolderDigest *digest,
+                           const gchar *stamp)
+{
+	g_return_if_fail (digest != NULL);
+
+	g_free (digest->stamp);
+	digest->stamp = g_strdup (stamp);
+}
+
+/**
+ * m_folder_digest_equal:
+ * @digest: an #MFolderDigest
+ * @previous: an #MFolderDigest
+ *
+ * Returns: whether the two digests cover the same messages with
+ *    the same flags
+ **/
+gboolean
+m_folder_digest_equal (MFolderDigest *digest,
+                       MFolderDigest *previous)
+{
+	g_return_val_if_fail (digest != NULL, FALSE);
+	g_return_val_if_fail (previous != NULL, FALSE);
+
+	return memcmp (digest->root, previous->root, DIGEST_SIZE) == 0;
+}
+
+/**
+ * m_folder_digest_dup_changed_uids:
+ * @digest: an #MFolderDigest from m_folder_digest_new()
+ * @previous: an earlier #MFolderDigest of the same folder
+ *
+ * Narrows a changed folder down to the ranges of @digest which
+ * @previous does not have.  Messages deleted since @previous are
+ * not in @digest, so they are not returned either, and stay in the
+ * offline store.
+ *
+ * Returns: (transfer full): the UIDs of the changed ranges
+ **/
+GPtrArray *
+m_folder_digest_dup_changed_uids (MFolderDigest *digest,
+                                  MFolderDigest *previous)
+{
+	GHashTable *known;
+	GPtrArray *uids;
+	guint ii, jj;
+
+	g_return_val_if_fail (digest != NULL, NULL);
+	g_return_val_if_fail (digest->uids != NULL, NULL);
+	g_return_val_if_fail (previous != NULL, NULL);
+
+	known = g_hash_table_new_full (
+		g_bytes_hash, g_bytes_equal,
+		(GDestroyNotify) g_bytes_unref, NULL);
+
+	for (ii = 0; ii < previous->ranges->len; ii++) {
+		DigestRange *range;
+
+		range = &g_array_index (previous->ranges, DigestRange, ii);
+		g_hash_table_add (known, g_bytes_new_static (range->digest, DIGEST_SIZE));
+	}
+
+	uids = g_ptr_array_new_with_free_func (g_free);
+
+	for (ii = 0; ii < digest->ranges->len; ii++) {
+		DigestRange *range;
+		GBytes *bytes;
+
+		range = &g_array_index (digest->ranges, DigestRange, ii);
+		bytes = g_bytes_new_static (range->digest, DIGEST_SIZE);
+
+		if (!g_hash_table_contains (known, bytes)) {
+			for (jj = range->start; jj < range->start + range->n_uids; jj++)
+				g_ptr_array_add (uids, g_strdup (g_ptr_array_index (digest->uids, jj)));
+		}
+
+		g_bytes_unref (bytes);
+	}
+
+	g_hash_table_destroy (known);
+
+	return uids;
+}
+
+void
+m_folder_digest_free (MFolderDigest *digest)
+{
+	if (digest == NULL)
+		return;
+
+	g_array_free (digest->ranges, TRUE);
+	if (digest->uids != NULL)
+		g_ptr_array_unref (digest->uids);
+	g_free (digest->stamp);
+
+	g_slice_free (MFolderDigest, digest);
+}
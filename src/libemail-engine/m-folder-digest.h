@@ -0,0 +1,48 @@
+#ifndef M_FOLDER_DIGEST_H
+#define M_FOLDER_DIGEST_H
+
+/* A two-level hash tree over the summary of a CamelFolder, to tell
+ * cheaply whether a folder changed since it was last exported.
+ *
+ * The UIDs, in byte order, are cut into ranges wherever the hash of
+ * a UID says so, about every 256 UIDs; where ranges end thus depends
+ * on the UIDs alone, so a new or deleted message changes one range
+ * only.  Every range has the digest of its (UID, flags, size) records,
+ * and the root the digest of the range digests.  Equal roots mean an
+ * unchanged folder, otherwise only the ranges whose digest the old
+ * tree does not have need to be looked at.
+ *
+ * Building the tree walks the whole summary.  Where the store keeps
+ * a few numbers that change with every change to the folder, the
+ * digest is saved with those as its stamp, and an equal stamp on the
+ * next run says the folder is unchanged without any walk at all. */
+
+#include <camel/camel.h>
+
+#define M_FOLDER_DIGEST_FILE_NAME "offline-store.digest"
+
+G_BEGIN_DECLS
+
+typedef struct _MFolderDigest MFolderDigest;
+
+gchar *		m_folder_digest_dup_stamp	(CamelFolder *folder);
+MFolderDigest *	m_folder_digest_new		(CamelFolder *folder,
+						 GPtrArray *uids);
+MFolderDigest *	m_folder_digest_load		(const gchar *root_path,
+						 GError **error);
+gboolean	m_folder_digest_save		(MFolderDigest *digest,
+						 const gchar *root_path,
+						 GError **error);
+const gchar *	m_folder_digest_get_stamp	(MFolderDigest *digest);
+void		m_folder_digest_set_stamp	(MFolderDigest *digest,
+						 const gchar *stamp);
+gboolean	m_folder_digest_equal		(MFolderDigest *digest,
+						 MFolderDigest *previous);
+GPtrArray *	m_folder_digest_dup_changed_uids
+						(MFolderDigest *digest,
+						 MFolderDigest *previous);
+void		m_folder_digest_free		(MFolderDigest *digest);
+
+G_END_DECLS
+
+#endif /* M_FOLDER_DIGEST_H */
@@ -0,0 +1,714 @@
+#include "config.h"
+
+#include "m-mail-folder-restore.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+
+#include "m-maildir-utils.h"
+#include "m-mail-folder-utils.h"
+#include "m-mail-pack.h"
+
+/* Messages parsed ahead of the appends, and appended between
+ * a single freeze/thaw and summary save of the target folder. */
+#define RESTORE_BATCH_SIZE 256
+
+typedef struct _AsyncContext AsyncContext;
+typedef struct _RestoreBatch RestoreBatch;
+typedef struct _RestoreItem RestoreItem;
+typedef struct _RestoreScan RestoreScan;
+
+struct _AsyncContext {
+	GFile *source;
+};
+
+/* Messages found so far, each UID only once. */
+struct _RestoreScan {
+	GPtrArray *items;
+	GHashTable *uids;
+};
+
+struct _RestoreBatch {
+	GMutex lock;
+	GCond cond;
+	guint pending;
+	guint start;
+	guint end;
+};
+
+struct _RestoreItem {
+	RestoreBatch *batch;
+	GCancellable *cancellable;
+
+	/* Either a maildir file, or a message in a pack. */
+	gchar *filename;
+	MMailPack *pack;
+	gchar *pack_uid;
+
+	guint32 flags;
+
+	CamelMimeMessage *message;
+	GError *error;
+};
+
+static void
+async_context_free (AsyncContext *context)
+{
+	g_clear_object (&context->source);
+
+	g_slice_free (AsyncContext, context);
+}
+
+static void
+restore_item_free (RestoreItem *item)
+{
+	g_clear_object (&item->message);
+	g_clear_error (&item->error);
+	g_free (item->filename);
+	g_free (item->pack_uid);
+
+	g_slice_free (RestoreItem, item);
+}
+
+static void
+mail_folder_restore_messages_thread (GSimpleAsyncResult *simple,
+                                     GObject *object,
+                                     GCancellable *cancellable)
+{
+	AsyncContext *context;
+	GError *error = NULL;
+
+	context = g_simple_async_result_get_op_res_gpointer (simple);
+
+	m_mail_folder_restore_messages_sync (
+		CAMEL_FOLDER (object), context->source,
+		cancellable, &error);
+
+	if (error != NULL)
+		g_simple_async_result_take_error (simple, error);
+}
+
+/* Helper for mail_folder_restore_scan() */
+static void
+mail_folder_restore_scan_maildir (const gchar *maildir,
+                                  RestoreScan *scan)
+{
+	const gchar *subdirs[] = { "cur", "new" };
+	guint ii;
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		const gchar *name;
+		gchar *path;
+		GDir *dir;
+
+		path = g_build_filename (maildir, subdirs[ii], NULL);
+		dir = g_dir_open (path, 0, NULL);
+
+		while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+			RestoreItem *item;
+			gchar *uid;
+
+			if (*name == '.')
+				continue;
+
+			/* A message left in a file and a pack, or under two
+			 * names, by an older version goes back only once;
+			 * files not written by us are all restored. */
+			uid = m_maildir_dup_uid (name);
+
+			if (uid != NULL && !g_hash_table_add (scan->uids, uid))
+				continue;
+
+			item = g_slice_new0 (RestoreItem);
+			item->filename = g_build_filename (path, name, NULL);
+			item->flags = m_maildir_get_flags (name);
+
+			g_ptr_array_add (scan->items, item);
+		}
+
+		if (dir != NULL)
+			g_dir_close (dir);
+
+		g_free (path);
+	}
+}
+
+/* Helper for mail_folder_restore_scan() */
+static gboolean
+mail_folder_restore_add_pack_item (MMailPack *pack,
+                                   const gchar *uid,
+                                   guint32 flags,
+                                   gint64 date,
+                                   gpointer user_data)
+{
+	RestoreScan *scan = user_data;
+	RestoreItem *item;
+
+	if (g_hash_table_contains (scan->uids, uid))
+		return TRUE;
+
+	g_hash_table_add (scan->uids, g_strdup (uid));
+
+	item = g_slice_new0 (RestoreItem);
+	item->pack = pack;
+	item->pack_uid = g_strdup (uid);
+	item->flags = flags;
+
+	g_ptr_array_add (scan->items, item);
+
+	return TRUE;
+}
+
+/* Helper for m_mail_folder_restore_messages_sync() */
+static gboolean
+mail_folder_restore_scan (const gchar *root_path,
+                          GPtrArray *items,
+                          GPtrArray *packs,
+                          GError **error)
+{
+	RestoreScan scan;
+	const gchar *name;
+	gchar *pack_dir;
+	GDir *dir;
+
+	dir = g_dir_open (root_path, 0, error);
+	if (dir == NULL)
+		return FALSE;
+
+	scan.items = items;
+	scan.uids = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free, NULL);
+
+	/* Maildir files come first, a packed copy of the same
+	 * message, which has the same content, is skipped. */
+	mail_folder_restore_scan_maildir (root_path, &scan);
+
+	/* Maildir++ subfolders of the date-partitioned layout. */
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		gchar *path;
+
+		if (*name != '.' || g_str_equal (name, "..") || g_str_equal (name, "."))
+			continue;
+
+		path = g_build_filename (root_path, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_IS_DIR))
+			mail_folder_restore_scan_maildir (path, &scan);
+		g_free (path);
+	}
+
+	g_dir_close (dir);
+
+	pack_dir = g_build_filename (root_path, M_MAIL_PACK_DIR_NAME, NULL);
+	dir = g_dir_open (pack_dir, 0, NULL);
+
+	while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+		MMailPack *pack;
+		gchar *path;
+
+		if (!g_str_has_suffix (name, ".pack"))
+			continue;
+
+		path = g_build_filename (pack_dir, name, NULL);
+		pack = m_mail_pack_open (path, FALSE, error);
+		g_free (path);
+
+		if (pack == NULL) {
+			g_hash_table_destroy (scan.uids);
+			g_dir_close (dir);
+			g_free (pack_dir);
+			return FALSE;
+		}
+
+		g_ptr_array_add (packs, pack);
+		m_mail_pack_foreach (pack, mail_folder_restore_add_pack_item, &scan);
+	}
+
+	if (dir != NULL)
+		g_dir_close (dir);
+
+	g_hash_table_destroy (scan.uids);
+	g_free (pack_dir);
+
+	return TRUE;
+}
+
+/* Helper for mail_folder_restore_parse_thread() */
+static CamelMimeMessage *
+mail_folder_restore_parse_file (const gchar *filename,
+                                GCancellable *cancellable,
+                                GError **error)
+{
+	CamelMimeMessage *message;
+	CamelMimeParser *parser;
+	gchar head[5];
+	gboolean has_from_line;
+	gint fd;
+
+	fd = g_open (filename, O_RDONLY | O_CLOEXEC, 0);
+	if (fd == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to open “%s”: %s"),
+			filename, g_strerror (errsv));
+		return NULL;
+	}
+
+	/* Files written by older versions start with an mbox
+	 * From_ line, which the parser has to step over. */
+	has_from_line = read (fd, head, sizeof (head)) == sizeof (head) &&
+		strncmp (head, "From ", sizeof (head)) == 0;
+	lseek (fd, 0, SEEK_SET);
+
+	parser = camel_mime_parser_new ();
+
+	/* The parser takes ownership of the file descriptor. */
+	camel_mime_parser_init_with_fd (parser, fd);
+	camel_mime_parser_scan_from (parser, has_from_line);
+
+	if (has_from_line &&
+	    camel_mime_parser_step (parser, NULL, NULL) != CAMEL_MIME_PARSER_STATE_FROM) {
+		g_set_error (
+			error, CAMEL_ERROR, CAMEL_ERROR_GENERIC,
+			_("Failed to parse “%s”"), filename);
+		g_object_unref (parser);
+		return NULL;
+	}
+
+	message = camel_mime_message_new ();
+
+	if (!camel_mime_part_construct_from_parser_sync (
+		CAMEL_MIME_PART (message), parser, cancellable, error))
+		g_clear_object (&message);
+
+	g_object_unref (parser);
+
+	return message;
+}
+
+/* Helper for mail_folder_restore_parse_thread() */
+static CamelMimeMessage *
+mail_folder_restore_parse_pack_entry (MMailPack *pack,
+                                      const gchar *uid,
+                                      GCancellable *cancellable,
+                                      GError **error)
+{
+	CamelMimeMessage *message;
+	CamelStream *stream;
+	GBytes *bytes;
+	gconstpointer data;
+	gsize length;
+
+	bytes = m_mail_pack_read (pack, uid, NULL, cancellable, error);
+	if (bytes == NULL)
+		return NULL;
+
+	data = g_bytes_get_data (bytes, &length);
+	stream = camel_stream_mem_new_with_buffer (data, length);
+	g_bytes_unref (bytes);
+
+	message = camel_mime_message_new ();
+
+	if (!camel_data_wrapper_construct_from_stream_sync (
+		CAMEL_DATA_WRAPPER (message), stream, cancellable, error))
+		g_clear_object (&message);
+
+	g_object_unref (stream);
+
+	return message;
+}
+
+static void
+mail_folder_restore_parse_thread (gpointer data,
+                                  gpointer user_data)
+{
+	RestoreItem *item = data;
+	RestoreBatch *batch = item->batch;
+
+	if (!g_cancellable_set_error_if_cancelled (item->cancellable, &item->error)) {
+		if (item->filename != NULL)
+			item->message = mail_folder_restore_parse_file (
+				item->filename, item->cancellable, &item->error);
+		else
+			item->message = mail_folder_restore_parse_pack_entry (
+				item->pack, item->pack_uid,
+				item->cancellable, &item->error);
+	}
+
+	g_mutex_lock (&batch->lock);
+	batch->pending--;
+	if (batch->pending == 0)
+		g_cond_signal (&batch->cond);
+	g_mutex_unlock (&batch->lock);
+}
+
+/* Helper for m_mail_folder_restore_messages_sync() */
+static RestoreBatch *
+mail_folder_restore_submit_batch (GThreadPool *pool,
+                                  GPtrArray *items,
+                                  guint start,
+                                  GCancellable *cancellable)
+{
+	RestoreBatch *batch;
+	guint ii;
+
+	if (start >= items->len)
+		return NULL;
+
+	batch = g_slice_new0 (RestoreBatch);
+	g_mutex_init (&batch->lock);
+	g_cond_init (&batch->cond);
+	batch->start = start;
+	batch->end = MIN (start + RESTORE_BATCH_SIZE, items->len);
+	batch->pending = batch->end - batch->start;
+
+	for (ii = batch->start; ii < batch->end; ii++) {
+		RestoreItem *item = g_ptr_array_index (items, ii);
+
+		item->batch = batch;
+		item->cancellable = cancellable;
+
+		g_thread_pool_push (pool, item, NULL);
+	}
+
+	return batch;
+}
+
+/* Helper for m_mail_folder_restore_messages_sync() */
+static void
+mail_folder_restore_wait_batch (RestoreBatch *batch)
+{
+	g_mutex_lock (&batch->lock);
+	while (batch->pending > 0)
+		g_cond_wait (&batch->cond, &batch->lock);
+	g_mutex_unlock (&batch->lock);
+}
+
+/* Helper for m_mail_folder_restore_messages_sync() */
+static void
+mail_folder_restore_free_batch (RestoreBatch *batch)
+{
+	if (batch == NULL)
+		return;
+
+	mail_folder_restore_wait_batch (batch);
+
+	g_mutex_clear (&batch->lock);
+	g_cond_clear (&batch->cond);
+
+	g_slice_free (RestoreBatch, batch);
+}
+
+/* Helper for mail_folder_restore_append_batch() */
+static void
+mail_folder_restore_add_failure (GPtrArray *failures,
+                                 RestoreItem *item,
+                                 const GError *local_error)
+{
+	if (item->filename != NULL)
+		g_ptr_array_add (
+			failures, g_strdup_printf (
+			"%s: %s", item->filename, local_error->message));
+	else
+		g_ptr_array_add (
+			failures, g_strdup_printf (
+			"%s (%s): %s", item->pack_uid,
+			m_mail_pack_get_filename (item->pack),
+			local_error->message));
+}
+
+/* Helper for m_mail_folder_restore_messages_sync() */
+static gboolean
+mail_folder_restore_append_batch (CamelFolder *folder,
+                                  GPtrArray *items,
+                                  RestoreBatch *batch,
+                                  GPtrArray *failures,
+                                  GCancellable *cancellable,
+                                  GError **error)
+{
+	CamelFolderSummary *summary;
+	gboolean success = TRUE;
+	guint ii;
+
+	/* Camel has no multi-message append, but freezing the folder
+	 * coalesces the change notifications of the whole batch and
+	 * the summary is written once per batch, not per message. */
+	camel_folder_freeze (folder);
+
+	for (ii = batch->start; ii < batch->end && success; ii++) {
+		RestoreItem *item = g_ptr_array_index (items, ii);
+		CamelMessageInfo *info;
+		GError *local_error = NULL;
+
+		if (item->error != NULL) {
+			local_error = item->error;
+			item->error = NULL;
+		} else {
+			info = camel_message_info_new (NULL);
+			camel_message_info_set_flags (info, ~0, item->flags);
+
+			camel_folder_append_message_sync (
+				folder, item->message, info, NULL,
+				cancellable, &local_error);
+
+			g_object_unref (info);
+		}
+
+		/* Do not keep parsed messages around longer than needed. */
+		g_clear_object (&item->message);
+
+		if (local_error == NULL)
+			continue;
+
+		/* One message failing to parse or to append does not
+		 * keep the others out of the folder, only cancelling
+		 * stops the restore; the failures are told at the end. */
+		if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+			g_propagate_error (error, local_error);
+			success = FALSE;
+		} else {
+			mail_folder_restore_add_failure (failures, item, local_error);
+			g_error_free (local_error);
+		}
+	}
+
+	camel_folder_thaw (folder);
+
+	summary = camel_folder_get_folder_summary (folder);
+
+	if (success && summary != NULL)
+		success = camel_folder_summary_save (summary, error);
+
+	return success;
+}
+
+/* Helper for m_mail_folder_restore_messages_sync() */
+static gboolean
+mail_folder_restore_is_maildir (const gchar *path)
+{
+	gchar *cur;
+	gboolean is_maildir;
+
+	cur = g_build_filename (path, "cur", NULL);
+	is_maildir = g_file_test (cur, G_FILE_TEST_IS_DIR);
+	g_free (cur);
+
+	return is_maildir;
+}
+
+/**
+ * m_mail_folder_restore_messages_sync:
+ * @folder: the target #CamelFolder
+ * @source: root of the offline store to restore from
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Appends every message of the offline store at @source, including
+ * its Maildir++ subfolders and month packs, to @folder.  When @source
+ * holds export snapshots, the latest snapshot is restored.  Messages are
+ * parsed in parallel one batch ahead of the appends, and the flags
+ * are taken from the maildir info suffix or the pack index.  A message
+ * the store has in more than one place is appended once.
+ *
+ * A message which fails to parse or to append is skipped, and the
+ * others are still restored; all of them are listed in @error at the
+ * end.  Only cancelling stops the restore early.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_folder_restore_messages_sync (CamelFolder *folder,
+                                     GFile *source,
+                                     GCancellable *cancellable,
+                                     GError **error)
+{
+	GThreadPool *pool;
+	GPtrArray *items;
+	GPtrArray *packs;
+	GPtrArray *failures;
+	RestoreBatch *current, *next;
+	gchar *root_path;
+	gboolean success = TRUE;
+
+	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), FALSE);
+	g_return_val_if_fail (G_IS_FILE (source), FALSE);
+
+	root_path = g_file_get_path (source);
+	if (root_path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Messages can be restored only from a local directory"));
+		return FALSE;
+	}
+
+	/* A destination holding snapshots restores its latest one. */
+	if (!mail_folder_restore_is_maildir (root_path)) {
+		gchar *latest;
+
+		latest = g_build_filename (root_path, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+
+		if (g_file_test (latest, G_FILE_TEST_IS_DIR)) {
+			g_free (root_path);
+			root_path = latest;
+		} else {
+			g_free (latest);
+		}
+	}
+
+	items = g_ptr_array_new_with_free_func ((GDestroyNotify) restore_item_free);
+	packs = g_ptr_array_new_with_free_func ((GDestroyNotify) m_mail_pack_free);
+
+	if (!mail_folder_restore_scan (root_path, items, packs, error)) {
+		g_ptr_array_unref (packs);
+		g_ptr_array_unref (items);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	if (items->len == 0) {
+		g_ptr_array_unref (packs);
+		g_ptr_array_unref (items);
+		g_free (root_path);
+		return TRUE;
+	}
+
+	pool = g_thread_pool_new (
+		mail_folder_restore_parse_thread, NULL,
+		g_get_num_processors (), FALSE, error);
+
+	if (pool == NULL) {
+		g_ptr_array_unref (packs);
+		g_ptr_array_unref (items);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	failures = g_ptr_array_new_with_free_func (g_free);
+
+	camel_operation_push_message (
+		cancellable, ngettext (
+			"Restoring %d message",
+			"Restoring %d messages",
+			items->len),
+		items->len);
+
+	current = mail_folder_restore_submit_batch (pool, items, 0, cancellable);
+
+	while (current != NULL) {
+		/* Keep the workers busy with the next batch
+		 * while this one is appended to the folder. */
+		next = mail_folder_restore_submit_batch (
+			pool, items, current->end, cancellable);
+
+		mail_folder_restore_wait_batch (current);
+
+		success = mail_folder_restore_append_batch (
+			folder, items, current, failures, cancellable, error);
+
+		camel_operation_progress (
+			cancellable, (current->end * 100) / items->len);
+
+		mail_folder_restore_free_batch (current);
+		current = next;
+
+		if (!success) {
+			mail_folder_restore_free_batch (current);
+			break;
+		}
+	}
+
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	camel_operation_pop_message (cancellable);
+
+	if (success && failures->len > 0) {
+		GString *report;
+		guint ii;
+
+		report = g_string_new (NULL);
+
+		g_string_append_printf (
+			report, ngettext (
+			"%u message of %u could not be restored:",
+			"%u messages of %u could not be restored:",
+			failures->len),
+			failures->len, items->len);
+
+		for (ii = 0; ii < failures->len; ii++)
+			g_string_append_printf (
+				report, "\n%s",
+				(const gchar *) g_ptr_array_index (failures, ii));
+
+		g_set_error_literal (
+			error, G_IO_ERROR, G_IO_ERROR_FAILED, report->str);
+		success = FALSE;
+
+		g_string_free (report, TRUE);
+	}
+
+	g_ptr_array_unref (failures);
+	g_ptr_array_unref (items);
+	g_ptr_array_unref (packs);
+	g_free (root_path);
+
+	return success;
+}
+
+void
+m_mail_folder_restore_messages (CamelFolder *folder,
+                                GFile *source,
+                                gint io_priority,
+                                GCancellable *cancellable,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+	GSimpleAsyncResult *simple;
+	AsyncContext *context;
+
+	g_return_if_fail (CAMEL_IS_FOLDER (folder));
+	g_return_if_fail (G_IS_FILE (source));
+
+	context = g_slice_new0 (AsyncContext);
+	context->source = g_object_ref (source);
+
+	simple = g_simple_async_result_new (
+		G_OBJECT (folder), callback, user_data,
+		m_mail_folder_restore_messages);
+
+	g_simple_async_result_set_check_cancellable (simple, cancellable);
+
+	g_simple_async_result_set_op_res_gpointer (
+		simple, context, (GDestroyNotify) async_context_free);
+
+	g_simple_async_result_run_in_thread (
+		simple, mail_folder_restore_messages_thread,
+		io_priority, cancellable);
+
+	g_object_unref (simple);
+}
+
+gboolean
+m_mail_folder_restore_messages_finish (CamelFolder *folder,
+                                       GAsyncResult *result,
+                                       GError **error)
+{
+	GSimpleAsyncResult *simple;
+
+	g_return_val_if_fail (
+		g_simple_async_result_is_valid (
+		result, G_OBJECT (folder),
+		m_mail_folder_restore_messages), FALSE);
+
+	simple = G_SIMPLE_ASYNC_RESULT (result);
+
+	/* Assume success unless a GError is set. */
+	return !g_simple_async_result_propagate_error (simple, error);
+}
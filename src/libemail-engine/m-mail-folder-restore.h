@@ -0,0 +1,29 @@
+#ifndef M_MAIL_FOLDER_RESTORE_H
+#define M_MAIL_FOLDER_RESTORE_H
+
+/* Restoring messages from the offline store back into a CamelFolder. */
+
+#include <camel/camel.h>
+
+G_BEGIN_DECLS
+
+gboolean	m_mail_folder_restore_messages_sync
+						(CamelFolder *folder,
+						 GFile *source,
+						 GCancellable *cancellable,
+						 GError **error);
+void		m_mail_folder_restore_messages
+						(CamelFolder *folder,
+						 GFile *source,
+						 gint io_priority,
+						 GCancellable *cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer user_data);
+gboolean	m_mail_folder_restore_messages_finish
+						(CamelFolder *folder,
+						 GAsyncResult *result,
+						 GError **error);
+
+G_END_DECLS
+
+#endif /* M_MAIL_FOLDER_RESTORE_H */
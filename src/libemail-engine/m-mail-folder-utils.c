@@ -2,11 +2,68 @@
 
 #include "m-mail-folder-utils.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+
 #include <glib/gi18n-lib.h>
-#include <gio/gunixoutputstream.h>
+#include <glib/gstdio.h>
 
 #include <libedataserver/libedataserver.h>
 
+#include "m-attachment-stubs.h"
+#include "m-export-controller.h"
+#include "m-export-manifest.h"
+#include "m-folder-digest.h"
+#include "m-export-trace.h"
+#include "m-maildir-utils.h"
+#include "m-mail-pack.h"
+
+/* Delivered files kept open until their pages are dropped. */
+#define WRITER_DROP_QUEUE_LEN 32
+
+/* Space taken by a file beyond its size, half a block on average,
+ * as used by the free space check before an export. */
+#define PREFLIGHT_SLACK_PER_FILE 2048
+
+/* Alignment and bounce buffer size of O_DIRECT writes. */
+#define DIRECT_IO_ALIGN 4096
+#define DIRECT_IO_CHUNK (1024 * 1024)
+
+/* Tries per message before a transient error counts as a failure,
+ * and the longest wait between two of them, in microseconds. */
+#define SAVE_MAX_ATTEMPTS 5
+#define SAVE_MAX_BACKOFF (30 * G_USEC_PER_SEC)
+
+/* Serialization buffers grown beyond this by a large message are
+ * freed after it rather than kept around for the next ones. */
+#define SAVE_BUFFER_KEEP_MAX (4 * 1024 * 1024)
+
+/* Requests kept going per connection to a remote store, so that
+ * each connection has the next message to send while the previous
+ * one is being serialized. */
+#define SAVE_FETCHES_PER_CONNECTION 2
+
+/* Bracket one step of a message for both the static probes
+ * and the trace file, see m-export-trace.h. */
+#define TRACE_STEP_START(step, uid, started) G_STMT_START { \
+	M_EXPORT_PROBE_START (step, (uid)); \
+	(started) = g_get_monotonic_time (); \
+	} G_STMT_END
+#define TRACE_STEP_DONE(trace, step, uid, started, n_bytes) G_STMT_START { \
+	M_EXPORT_PROBE_DONE (step, (uid), (n_bytes)); \
+	if ((trace) != NULL) \
+		m_export_trace_span ((trace), #step, (uid), (started), (n_bytes)); \
+	} G_STMT_END
+
 typedef struct _AsyncContext AsyncContext;
 
 struct _AsyncContext {
@@ -16,6 +73,7 @@ struct _AsyncContext {
 	GHashTable *hash_table;
 	GPtrArray *ptr_array;
 	GFile *destination;
+	MExportOptions *options;
 	gchar *orig_subject;
 	gchar *message_uid;
 };
@@ -34,6 +92,8 @@ async_context_free (AsyncContext *context)
 	g_clear_object (&context->part);
 	g_clear_object (&context->destination);
 
+	m_export_options_free (context->options);
+
 	g_free (context->orig_subject);
 	g_free (context->message_uid);
 
@@ -52,223 +112,3029 @@ mail_folder_save_messages_thread (GSimpleAsyncResult *simple,
 
 	m_mail_folder_save_messages_sync (
 		CAMEL_FOLDER (object), context->ptr_array,
-		context->destination, cancellable, &error);
+		context->destination, context->options,
+		cancellable, &error);
 
 	if (error != NULL)
 		g_simple_async_result_take_error (simple, error);
 }
 
-/* Helper for m_mail_folder_save_messages_sync() */
-static void
-mail_folder_save_prepare_part (CamelMimePart *mime_part)
+typedef struct _PrepareData PrepareData;
+
+struct _PrepareData {
+	const gchar *uid;
+	gsize stub_threshold;
+	GCancellable *cancellable;
+};
+
+/* Helper for mail_folder_save_prepare_part() */
+static gboolean
+mail_folder_save_prepare_leaf (CamelMimePart *mime_part,
+                               const gchar *part_id,
+                               gpointer user_data)
 {
+	PrepareData *data = user_data;
 	CamelDataWrapper *content;
+	CamelContentType *type;
+	gsize size;
 
 	content = camel_medium_get_content (CAMEL_MEDIUM (mime_part));
 
-	if (content == NULL)
-		return;
+	/* Save textual parts as 8-bit, not encoded. */
+	type = camel_data_wrapper_get_mime_type_field (content);
+	if (camel_content_type_is (type, "text", "*")) {
+		camel_mime_part_set_encoding (
+			mime_part, CAMEL_TRANSFER_ENCODING_8BIT);
+		return TRUE;
+	}
 
-	if (CAMEL_IS_MULTIPART (content)) {
-		guint n_parts, ii;
+	if (data->stub_threshold == 0)
+		return TRUE;
 
-		n_parts = camel_multipart_get_number (
-			CAMEL_MULTIPART (content));
-		for (ii = 0; ii < n_parts; ii++) {
-			mime_part = camel_multipart_get_part (
-				CAMEL_MULTIPART (content), ii);
-			mail_folder_save_prepare_part (mime_part);
-		}
+	size = camel_data_wrapper_calculate_decoded_size_sync (
+		content, data->cancellable, NULL);
 
-	} else if (CAMEL_IS_MIME_MESSAGE (content)) {
-		mail_folder_save_prepare_part (CAMEL_MIME_PART (content));
+	if (size != (gsize) -1 && size >= data->stub_threshold)
+		m_attachment_stub_replace (mime_part, data->uid, part_id, size);
 
-	} else {
-		CamelContentType *type;
+	return !g_cancellable_is_cancelled (data->cancellable);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static void
+mail_folder_save_prepare_part (CamelMimePart *mime_part,
+                               const gchar *uid,
+                               gsize stub_threshold,
+                               GCancellable *cancellable)
+{
+	PrepareData data;
+
+	data.uid = uid;
+	data.stub_threshold = stub_threshold;
+	data.cancellable = cancellable;
+
+	/* Headers and text always stay, attachments from
+	 * the threshold on are left behind as stubs. */
+	m_attachment_stubs_foreach_part (
+		mime_part, mail_folder_save_prepare_leaf, &data);
+}
+
+struct _MMailFolderWriter {
+	gchar *root_path;
+	MExportLayout layout;
+
+	/* Messages dated before this go into the month packs,
+	 * zero when tiering is disabled. */
+	gint64 pack_before;
+
+	/* Protects the caches below, and the packs themselves. */
+	GMutex lock;
+	GHashTable *maildirs;	/* subfolder name ~> maildir path */
+	GHashTable *packs;	/* pack name ~> MMailPack */
+	GHashTable *maildir_files;	/* maildir path ~> m_maildir_index_files() */
+
+	/* Snapshot mode: root_path is a new dated directory below
+	 * snapshot_root, and link_dest the previous snapshot, if any,
+	 * whose unchanged messages are hardlinked rather than written. */
+	gchar *snapshot_root;
+	gchar *snapshot_name;
+	gchar *link_dest;
+	GHashTable *link_files;	/* message base name ~> path in link_dest */
+	GHashTable *link_done;	/* base names linked already, under lock */
+	GHashTable *link_packs;	/* pack name ~> read-only MMailPack or NULL */
+
+	/* Page cache hints, see MExportOptions; drop_queue holds the
+	 * descriptors of delivered files whose writeback was started. */
+	gboolean cache_hints;
+	gsize direct_io_threshold;
+	GQueue drop_queue;
+
+	/* Write limits, may be NULL. */
+	MThrottle *throttle;
+
+	/* Records commits, may be NULL. */
+	MExportTrace *trace;
+
+	/* Digests of the messages in root_path, and in snapshot mode
+	 * those of link_dest, whose entries unchanged messages keep. */
+	MExportManifest *manifest;
+	MExportManifest *link_manifest;
+
+	/* Whether the manifest lists every message root_path held when
+	 * the writer was created, which then tells the messages that are
+	 * delivered again; otherwise any of them may be. */
+	gboolean manifest_lists_all;
+};
+
+/* Helper for m_mail_folder_writer_write() */
+static gchar *
+mail_folder_writer_dup_maildir (MMailFolderWriter *writer,
+                                gint64 date,
+                                GError **error)
+{
+	gchar *subfolder, *key, *path;
 
-		/* Save textual parts as 8-bit, not encoded. */
-		type = camel_data_wrapper_get_mime_type_field (content);
-		if (camel_content_type_is (type, "text", "*"))
-			camel_mime_part_set_encoding (
-				mime_part, CAMEL_TRANSFER_ENCODING_8BIT);
+	subfolder = m_maildir_build_subfolder (writer->layout, date);
+	key = subfolder != NULL ? subfolder : g_strdup ("");
+
+	g_mutex_lock (&writer->lock);
+
+	path = g_hash_table_lookup (writer->maildirs, key);
+	if (path != NULL) {
+		path = g_strdup (path);
+		g_free (key);
+		goto exit;
+	}
+
+	if (subfolder != NULL)
+		path = g_build_filename (writer->root_path, subfolder, NULL);
+	else
+		path = g_strdup (writer->root_path);
+
+	if (!m_maildir_ensure (path, subfolder != NULL, error)) {
+		g_clear_pointer (&path, g_free);
+		g_free (key);
+		goto exit;
 	}
+
+	g_hash_table_insert (writer->maildirs, key, g_strdup (path));
+
+exit:
+	g_mutex_unlock (&writer->lock);
+
+	return path;
 }
 
+/* Helper for m_mail_folder_writer_write() */
+static GPtrArray *
+mail_folder_writer_dup_old_paths (MMailFolderWriter *writer,
+                                  const gchar *maildir,
+                                  const gchar *basename)
+{
+	GHashTable *files;
+	GPtrArray *paths, *copy = NULL;
+	guint ii;
+
+	g_mutex_lock (&writer->lock);
+
+	/* Read once, the first time a message may be there already. */
+	files = g_hash_table_lookup (writer->maildir_files, maildir);
+	if (files == NULL) {
+		files = m_maildir_index_files (maildir);
+		g_hash_table_insert (writer->maildir_files, g_strdup (maildir), files);
+	}
+
+	paths = g_hash_table_lookup (files, basename);
+
+	if (paths != NULL) {
+		copy = g_ptr_array_new_full (paths->len, g_free);
 
-gint
-open_maildir_message_file(GFile *root, GCancellable* cancellable, GError** error)
+		for (ii = 0; ii < paths->len; ii++)
+			g_ptr_array_add (copy, g_strdup (g_ptr_array_index (paths, ii)));
+	}
+
+	g_mutex_unlock (&writer->lock);
+
+	return copy;
+}
+
+/* Helper for m_mail_folder_writer_write() */
+static void
+mail_folder_writer_set_path (MMailFolderWriter *writer,
+                             const gchar *maildir,
+                             const gchar *basename,
+                             const gchar *path)
 {
-	GError *local_error;
-	GFile *tmp_dir;
-	gchar *tmp_dir_path, *tmpl, *full_template;
-	gboolean dir_created;
-        gint fd;
+	GHashTable *files;
 
-	local_error = NULL;
+	g_mutex_lock (&writer->lock);
 
-	// TODO: Add Time and PID to template
-	tmpl = "a.XXXXXX.c";
+	/* Maildirs not read yet will find the file when they are. */
+	files = g_hash_table_lookup (writer->maildir_files, maildir);
 
-        tmp_dir = g_file_get_child(root, "tmp");
-	dir_created = g_file_make_directory(tmp_dir, cancellable, &local_error);
+	if (files != NULL && path != NULL) {
+		GPtrArray *paths;
 
-	/* If make_directory failed for some reason other than the directory already existing,
-	   pass the error up. Otherwise, continue.  */
-	if (local_error &&
-	    !(local_error->domain == G_IO_ERROR &&
-	      local_error->code == G_IO_ERROR_EXISTS)) {
-		*error = g_error_copy(local_error);
-		return -1;
-        }
+		paths = g_ptr_array_new_with_free_func (g_free);
+		g_ptr_array_add (paths, g_strdup (path));
+
+		g_hash_table_insert (files, g_strdup (basename), paths);
+	} else if (files != NULL) {
+		g_hash_table_remove (files, basename);
+	}
+
+	g_mutex_unlock (&writer->lock);
+}
 
-	tmp_dir_path = g_file_get_path (tmp_dir);
-	full_template = g_strconcat (tmp_dir_path, G_DIR_SEPARATOR_S, tmpl, NULL);
+/* Helper for m_mail_folder_writer_write() */
+static gint
+mail_folder_writer_open_tmp_file (const gchar *maildir,
+                                  const gchar *basename,
+                                  gboolean *inout_direct,
+                                  gchar **out_tmp_path,
+                                  GError **error)
+{
+	gchar *tmp_path;
+	gint flags, fd = -1;
+
+	tmp_path = g_build_filename (maildir, "tmp", basename, NULL);
+
+	/* The base name is unique per UID, so a leftover from an
+	 * interrupted export is simply overwritten. */
+	flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+#ifdef O_DIRECT
+	/* Not every file system supports direct I/O, tmpfs for one
+	 * refuses it, in which case the file is written normally. */
+	if (*inout_direct) {
+		fd = g_open (tmp_path, flags | O_DIRECT, 0600);
+		if (fd == -1 && errno == EINVAL)
+			*inout_direct = FALSE;
+	}
+#else
+	*inout_direct = FALSE;
+#endif
+
+	if (!*inout_direct)
+		fd = g_open (tmp_path, flags, 0600);
+
+	if (fd == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to create “%s”: %s"),
+			tmp_path, g_strerror (errsv));
+		g_free (tmp_path);
+		return -1;
+	}
 
-	fd = g_mkstemp(full_template);
+	*out_tmp_path = tmp_path;
 
 	return fd;
 }
 
+/* Helper for mail_folder_writer_write_file() */
+static gboolean
+mail_folder_writer_preallocate (gint fd,
+                                const gchar *tmp_path,
+                                gsize length,
+                                GError **error)
+{
+#ifdef HAVE_FALLOCATE
+	/* Reserving the size up front lets the file system place the
+	 * file in one piece, and a full disk shows before any write.
+	 * Unlike posix_fallocate(), this never falls back to writing
+	 * zeros, file systems which cannot do it just say so. */
+	if (length > 0 && fallocate (fd, 0, 0, length) == -1 && errno == ENOSPC) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+			_("Failed to write “%s”: %s"),
+			tmp_path, g_strerror (ENOSPC));
+		return FALSE;
+	}
+#endif
 
+	return TRUE;
+}
 
-gboolean
-m_mail_folder_save_messages_sync (CamelFolder *folder,
-                                  GPtrArray *message_uids,
-                                  GFile *destination,
-                                  GCancellable *cancellable,
-                                  GError **error)
+/* Helper for mail_folder_writer_write_file() */
+static gboolean
+mail_folder_writer_write_direct (gint fd,
+                                 const gchar *tmp_path,
+                                 const guint8 *data,
+                                 gsize length,
+                                 GCancellable *cancellable,
+                                 GError **error)
 {
-	GUnixOutputStream *file_output_stream;
-	CamelStream *base_stream = NULL;
-	GByteArray *byte_array;
-	gboolean success = TRUE;
-	guint ii;
+	guint8 *buffer = NULL;
+	gsize offset = 0;
+	gint errsv = 0;
+
+	/* O_DIRECT wants aligned buffers, offsets and lengths, so the
+	 * message goes through an aligned bounce buffer, with the last
+	 * block padded and the padding cut off again afterwards. */
+	if (posix_memalign ((gpointer *) &buffer, DIRECT_IO_ALIGN, DIRECT_IO_CHUNK) != 0) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			_("Failed to write “%s”: %s"),
+			tmp_path, g_strerror (ENOMEM));
+		return FALSE;
+	}
 
-	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), FALSE);
-	g_return_val_if_fail (message_uids != NULL, FALSE);
-	g_return_val_if_fail (G_IS_FILE (destination), FALSE);
+	while (offset < length && errsv == 0) {
+		gsize n_bytes, n_padded, done = 0;
 
-	/* Need at least one message UID to save. */
-	g_return_val_if_fail (message_uids->len > 0, FALSE);
+		if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			free (buffer);
+			return FALSE;
+		}
 
-	camel_operation_push_message (
-		cancellable, ngettext (
-			"Saving %d message",
-			"Saving %d messages",
-			message_uids->len),
-		message_uids->len);
+		n_bytes = MIN (length - offset, DIRECT_IO_CHUNK);
+		n_padded = (n_bytes + DIRECT_IO_ALIGN - 1) & ~((gsize) DIRECT_IO_ALIGN - 1);
 
-	byte_array = g_byte_array_new ();
+		memcpy (buffer, data + offset, n_bytes);
+		memset (buffer + n_bytes, 0, n_padded - n_bytes);
 
-	for (ii = 0; ii < message_uids->len; ii++) {
-		CamelMimeMessage *message;
-		CamelMimeFilter *filter;
-		CamelStream *stream;
-		const gchar *uid;
-		gchar *from_line;
-		gint message_file_fd;
-		gint percent;
-		gint retval;
+		while (done < n_padded) {
+			gssize n_written;
+
+			n_written = pwrite (fd, buffer + done, n_padded - done, offset + done);
+			if (n_written < 0) {
+				if (errno == EINTR)
+					continue;
+				errsv = errno;
+				break;
+			}
+
+			done += n_written;
+		}
+
+		offset += n_bytes;
+	}
+
+	free (buffer);
+
+	if (errsv == 0 && ftruncate (fd, length) == -1)
+		errsv = errno;
+
+	if (errsv != 0) {
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to write “%s”: %s"),
+			tmp_path, g_strerror (errsv));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Helper for mail_folder_writer_write_file() */
+static gboolean
+mail_folder_writer_write_all (gint fd,
+                              const gchar *tmp_path,
+                              const guint8 *data,
+                              gsize length,
+                              GCancellable *cancellable,
+                              GError **error)
+{
+	gsize offset = 0;
 
-		message_file_fd = open_maildir_message_file (destination, cancellable, error);
-		file_output_stream = g_unix_output_stream_new (message_file_fd,
-							       FALSE);
+	/* Plain write() rather than an output stream object, which
+	 * would be created and finalized again for every message. */
+	while (offset < length) {
+		gssize n_written;
 
-		if (file_output_stream == NULL) {
-			camel_operation_pop_message (cancellable);
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
+
+		n_written = write (fd, data + offset, MIN (length - offset, DIRECT_IO_CHUNK));
+		if (n_written < 0) {
+			gint errsv = errno;
+
+			if (errsv == EINTR)
+				continue;
+
+			g_set_error (
+				error, G_IO_ERROR,
+				g_io_error_from_errno (errsv),
+				_("Failed to write “%s”: %s"),
+				tmp_path, g_strerror (errsv));
 			return FALSE;
 		}
 
+		offset += n_written;
+	}
 
-		if (base_stream != NULL)
-			g_object_unref (base_stream);
+	return TRUE;
+}
 
-		/* CamelStreamMem does NOT take ownership of the byte
-		 * array when set with camel_stream_mem_set_byte_array().
-		 * This allows us to reuse the same memory slab for each
-		 * message, which is slightly more efficient. */
-		base_stream = camel_stream_mem_new ();
-		camel_stream_mem_set_byte_array (
-			CAMEL_STREAM_MEM (base_stream), byte_array);
+/* Helper for mail_folder_writer_write_file() */
+static gboolean
+mail_folder_writer_copy_fd (gint source_fd,
+                            gint fd,
+                            const gchar *tmp_path,
+                            gsize length,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+	guint8 buffer[64 * 1024];
+	gsize offset = 0;
+	gint errsv = 0;
+
+#ifdef FICLONE
+	/* Shares the extents of the source on copy-on-write file
+	 * systems like Btrfs or XFS, when both are on the same one. */
+	if (ioctl (fd, FICLONE, source_fd) == 0)
+		return TRUE;
+#endif
+
+	if (!mail_folder_writer_preallocate (fd, tmp_path, length, error))
+		return FALSE;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	/* Otherwise the kernel copies, without a detour through
+	 * user space, and NFS does so even on the server. */
+	while (offset < length) {
+		loff_t in_offset = offset, out_offset = offset;
+		gssize n_copied;
+
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
 
-		uid = g_ptr_array_index (message_uids, ii);
+		n_copied = copy_file_range (
+			source_fd, &in_offset, fd, &out_offset,
+			MIN (length - offset, DIRECT_IO_CHUNK), 0);
 
-		message = camel_folder_get_message_sync (
-			folder, uid, cancellable, error);
-		if (message == NULL) {
-			success = FALSE;
-			goto exit;
+		if (n_copied <= 0) {
+			if (n_copied < 0 && errno == EINTR)
+				continue;
+			errsv = n_copied < 0 ? errno : 0;
+			break;
 		}
 
-		mail_folder_save_prepare_part (CAMEL_MIME_PART (message));
+		offset += n_copied;
+	}
+
+	/* Not between these file systems, or not at all, in which
+	 * case the rest is copied the old-fashioned way below. */
+	if (errsv == EXDEV || errsv == EINVAL || errsv == ENOSYS || errsv == EOPNOTSUPP)
+		errsv = 0;
+#endif
 
-		from_line = camel_mime_message_build_mbox_from (message);
-		g_return_val_if_fail (from_line != NULL, FALSE);
+	while (offset < length && errsv == 0) {
+		gssize n_read, done = 0;
 
-		success = g_output_stream_write_all (
-			G_OUTPUT_STREAM (file_output_stream),
-			from_line, strlen (from_line), NULL,
-			cancellable, error);
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
+
+		n_read = pread (source_fd, buffer, MIN (length - offset, sizeof (buffer)), offset);
+		if (n_read < 0) {
+			if (errno != EINTR)
+				errsv = errno;
+			continue;
+		}
+
+		/* The source got shorter since it was measured. */
+		if (n_read == 0) {
+			errsv = EIO;
+			break;
+		}
+
+		while (done < n_read) {
+			gssize n_written;
+
+			n_written = pwrite (fd, buffer + done, n_read - done, offset + done);
+			if (n_written < 0) {
+				if (errno == EINTR)
+					continue;
+				errsv = errno;
+				break;
+			}
+
+			done += n_written;
+		}
+
+		offset += done;
+	}
+
+	if (errsv != 0) {
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to write “%s”: %s"),
+			tmp_path, g_strerror (errsv));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Helper for mail_folder_writer_queue_drop() */
+static void
+mail_folder_writer_drop_fd (gint fd)
+{
+	/* Clean pages only can be dropped, so wait for the writeback
+	 * started when the file was queued; this is no durability
+	 * guarantee, which is fine for a cache hint. */
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range (
+		fd, 0, 0,
+		SYNC_FILE_RANGE_WAIT_BEFORE |
+		SYNC_FILE_RANGE_WRITE |
+		SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+	fdatasync (fd);
+#endif
+
+#ifdef HAVE_POSIX_FADVISE
+	posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+	close (fd);
+}
+
+/* Helper for mail_folder_writer_write_file() */
+static void
+mail_folder_writer_queue_drop (MMailFolderWriter *writer,
+                               gint fd)
+{
+	gint oldest = -1;
+
+	/* Start the writeback now and drop the pages only a few
+	 * files later, by when it has most likely finished, so the
+	 * writer does not stall on every single message. */
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range (fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+
+	g_mutex_lock (&writer->lock);
+
+	g_queue_push_tail (&writer->drop_queue, GINT_TO_POINTER (fd));
+
+	if (g_queue_get_length (&writer->drop_queue) > WRITER_DROP_QUEUE_LEN)
+		oldest = GPOINTER_TO_INT (g_queue_pop_head (&writer->drop_queue));
+
+	g_mutex_unlock (&writer->lock);
+
+	if (oldest != -1)
+		mail_folder_writer_drop_fd (oldest);
+}
+
+/* Helper for m_mail_folder_writer_write() */
+static gboolean
+mail_folder_writer_write_file (MMailFolderWriter *writer,
+                               const gchar *uid,
+                               gint64 date,
+                               guint32 flags,
+                               const guint8 *data,
+                               gint source_fd,
+                               gsize length,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+	gchar *maildir, *basename, *tmp_path = NULL;
+	gboolean success, direct;
+	gint message_file_fd;
+
+	maildir = mail_folder_writer_dup_maildir (writer, date, error);
+	if (maildir == NULL)
+		return FALSE;
+
+	basename = m_maildir_build_basename (uid, date);
+
+	/* Copies are done by the kernel, which does not need it. */
+	direct = source_fd == -1 && writer->direct_io_threshold > 0 &&
+		length >= writer->direct_io_threshold;
 
-		g_free (from_line);
+	message_file_fd = mail_folder_writer_open_tmp_file (
+		maildir, basename, &direct, &tmp_path, error);
 
-		if (!success) {
-			g_object_unref (message);
-			goto exit;
+	if (message_file_fd == -1) {
+		g_free (basename);
+		g_free (maildir);
+		return FALSE;
+	}
+
+	if (source_fd == -1 && !mail_folder_writer_preallocate (
+		message_file_fd, tmp_path, length, error)) {
+		close (message_file_fd);
+		g_unlink (tmp_path);
+		g_free (tmp_path);
+		g_free (basename);
+		g_free (maildir);
+		return FALSE;
+	}
+
+	if (source_fd != -1) {
+		success = mail_folder_writer_copy_fd (
+			source_fd, message_file_fd, tmp_path, length,
+			cancellable, error);
+	} else if (direct) {
+		success = mail_folder_writer_write_direct (
+			message_file_fd, tmp_path, data, length,
+			cancellable, error);
+	} else {
+		success = mail_folder_writer_write_all (
+			message_file_fd, tmp_path, data, length,
+			cancellable, error);
+	}
+
+	/* Only completely written messages may leave tmp/. */
+	if (success) {
+		guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+		guint64 size;
+		GPtrArray *old_paths = NULL;
+		gint64 started;
+
+		/* An older copy, with other flags, has to go. */
+		if (!writer->manifest_lists_all ||
+		    m_export_manifest_lookup (writer->manifest, uid, digest, &size))
+			old_paths = mail_folder_writer_dup_old_paths (writer, maildir, basename);
+
+		TRACE_STEP_START (commit, uid, started);
+		success = m_maildir_deliver (maildir, tmp_path, basename, flags, old_paths, error);
+		TRACE_STEP_DONE (writer->trace, commit, uid, started, success ? (gssize) length : -1);
+
+		if (success && old_paths != NULL) {
+			gchar *filename, *cur_path;
+
+			filename = m_maildir_build_filename (basename, flags);
+			cur_path = g_build_filename (maildir, "cur", filename, NULL);
+			mail_folder_writer_set_path (writer, maildir, basename, cur_path);
+			g_free (cur_path);
+			g_free (filename);
 		}
 
-		filter = camel_mime_filter_from_new ();
-		stream = camel_stream_filter_new (base_stream);
-		camel_stream_filter_add (CAMEL_STREAM_FILTER (stream), filter);
+		if (old_paths != NULL)
+			g_ptr_array_unref (old_paths);
+	} else {
+		g_unlink (tmp_path);
+	}
+
+	/* Direct writes never went through the page cache. */
+	if (success && writer->cache_hints && !direct) {
+		mail_folder_writer_queue_drop (writer, message_file_fd);
+	} else if (close (message_file_fd) == -1 && success) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to write “%s”: %s"),
+			tmp_path, g_strerror (errsv));
+		success = FALSE;
+	}
+
+	g_free (tmp_path);
+	g_free (basename);
+	g_free (maildir);
+
+	return success;
+}
+
+/* Helper for mail_folder_writer_lookup_pack() */
+static gboolean
+mail_folder_writer_copy_link_dest_pack (MMailFolderWriter *writer,
+                                        const gchar *name,
+                                        const gchar *filename,
+                                        GError **error)
+{
+	GFile *source, *target;
+	gchar *path;
+	gboolean success;
+
+	if (writer->link_dest == NULL)
+		return TRUE;
+
+	path = g_build_filename (writer->link_dest, M_MAIL_PACK_DIR_NAME, name, NULL);
+
+	/* Packs are modified in place, so unlike the message files a pack
+	 * which gets new messages cannot be shared with the previous
+	 * snapshot; it is copied and only then appended to. */
+	if (!g_file_test (path, G_FILE_TEST_IS_REGULAR) ||
+	    g_file_test (filename, G_FILE_TEST_EXISTS)) {
+		g_free (path);
+		return TRUE;
+	}
+
+	source = g_file_new_for_path (path);
+	target = g_file_new_for_path (filename);
+
+	success = g_file_copy (
+		source, target, G_FILE_COPY_NONE,
+		NULL, NULL, NULL, error);
+
+	g_object_unref (target);
+	g_object_unref (source);
+	g_free (path);
 
-		retval = camel_data_wrapper_write_to_stream_sync (
-			CAMEL_DATA_WRAPPER (message),
-			stream, cancellable, error);
+	return success;
+}
+
+/* Helper for mail_folder_writer_lookup_pack() */
+static MMailPack *
+mail_folder_writer_lookup_pack_by_name (MMailFolderWriter *writer,
+                                        const gchar *pack_name,
+                                        GError **error)
+{
+	MMailPack *pack;
+	gchar *name;
 
-		g_object_unref (filter);
-		g_object_unref (stream);
+	name = g_strdup (pack_name);
+	pack = g_hash_table_lookup (writer->packs, name);
 
-		if (retval == -1) {
-			g_object_unref (message);
-			goto exit;
+	if (pack == NULL) {
+		gchar *pack_dir, *filename;
+
+		pack_dir = g_build_filename (writer->root_path, M_MAIL_PACK_DIR_NAME, NULL);
+		filename = g_build_filename (pack_dir, name, NULL);
+
+		if (g_mkdir_with_parents (pack_dir, 0700) == -1) {
+			gint errsv = errno;
+
+			g_set_error (
+				error, G_IO_ERROR,
+				g_io_error_from_errno (errsv),
+				_("Failed to create “%s”: %s"),
+				pack_dir, g_strerror (errsv));
+		} else if (mail_folder_writer_copy_link_dest_pack (writer, name, filename, error)) {
+			pack = m_mail_pack_open (filename, TRUE, error);
 		}
 
-		g_byte_array_append (byte_array, (guint8 *) "\n", 1);
+		if (pack != NULL)
+			g_hash_table_insert (writer->packs, name, pack);
+		else
+			g_free (name);
+
+		g_free (filename);
+		g_free (pack_dir);
+	} else {
+		g_free (name);
+	}
+
+	return pack;
+}
+
+/* Helper for m_mail_folder_writer_write() */
+static MMailPack *
+mail_folder_writer_lookup_pack (MMailFolderWriter *writer,
+                                gint64 date,
+                                GError **error)
+{
+	MMailPack *pack;
+	gchar *name;
+
+	name = m_mail_pack_build_name (date);
+	pack = mail_folder_writer_lookup_pack_by_name (writer, name, error);
+	g_free (name);
+
+	return pack;
+}
+
+/* Helper for m_mail_folder_writer_new() */
+static gchar *
+mail_folder_writer_dup_latest_snapshot (const gchar *snapshot_root)
+{
+	gchar *latest, *target;
+
+	latest = g_build_filename (snapshot_root, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+	target = g_file_read_link (latest, NULL);
+	g_free (latest);
+
+	if (target != NULL && !g_path_is_absolute (target)) {
+		gchar *path;
+
+		path = g_build_filename (snapshot_root, target, NULL);
+		g_free (target);
+		target = path;
+	}
+
+	if (target != NULL && !g_file_test (target, G_FILE_TEST_IS_DIR))
+		g_clear_pointer (&target, g_free);
 
-		success = g_output_stream_write_all (
-			G_OUTPUT_STREAM (file_output_stream),
-			byte_array->data, byte_array->len,
-			NULL, cancellable, error);
+	return target;
+}
+
+/* Helper for mail_folder_writer_index_link_dest() */
+static void
+mail_folder_writer_index_maildir (MMailFolderWriter *writer,
+                                  const gchar *maildir)
+{
+	const gchar *subdirs[] = { "cur", "new" };
+	guint ii;
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		const gchar *name;
+		gchar *path;
+		GDir *dir;
+
+		path = g_build_filename (maildir, subdirs[ii], NULL);
+		dir = g_dir_open (path, 0, NULL);
+
+		while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+			const gchar *info;
 
-		if (!success) {
-			g_object_unref (message);
-			goto exit;
+			/* Keyed by the base name, which does not change
+			 * with the flags nor with the Maildir++ layout. */
+			info = strchr (name, ':');
+			if (info == NULL)
+				info = name + strlen (name);
+
+			g_hash_table_insert (
+				writer->link_files,
+				g_strndup (name, info - name),
+				g_build_filename (path, name, NULL));
 		}
 
-		percent = ((ii + 1) * 100) / message_uids->len;
-		camel_operation_progress (cancellable, percent);
+		if (dir != NULL)
+			g_dir_close (dir);
+		g_free (path);
+	}
+}
+
+/* Helper for m_mail_folder_writer_new() */
+static void
+mail_folder_writer_index_link_dest (MMailFolderWriter *writer)
+{
+	const gchar *name;
+	GDir *dir;
 
-		/* Reset the byte array for the next message. */
-		g_byte_array_set_size (byte_array, 0);
+	mail_folder_writer_index_maildir (writer, writer->link_dest);
 
-		g_object_unref (message);
+	dir = g_dir_open (writer->link_dest, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		gchar *path;
+
+		if (*name != '.')
+			continue;
+
+		path = g_build_filename (writer->link_dest, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_IS_DIR))
+			mail_folder_writer_index_maildir (writer, path);
+		g_free (path);
 	}
 
-exit:
-	if (base_stream != NULL)
-		g_object_unref (base_stream);
+	g_dir_close (dir);
+}
 
-	g_byte_array_free (byte_array, TRUE);
+/* Helper for m_mail_folder_writer_link_unchanged() */
+static MMailPack *
+mail_folder_writer_lookup_link_dest_pack (MMailFolderWriter *writer,
+                                          const gchar *name)
+{
+	MMailPack *pack;
+	gpointer value;
+	gchar *filename;
 
-	g_object_unref (file_output_stream);
+	if (g_hash_table_lookup_extended (writer->link_packs, name, NULL, &value))
+		return value;
 
-	camel_operation_pop_message (cancellable);
+	filename = g_build_filename (writer->link_dest, M_MAIL_PACK_DIR_NAME, name, NULL);
 
-	if (!success) {
-		/* Try deleting the destination file. */
-		g_file_delete (destination, NULL, NULL);
+	pack = NULL;
+	if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
+		pack = m_mail_pack_open (filename, FALSE, NULL);
+
+	/* Remember missing packs too, so they are tried only once. */
+	g_hash_table_insert (writer->link_packs, g_strdup (name), pack);
+
+	g_free (filename);
+
+	return pack;
+}
+
+/* Helper for m_mail_folder_writer_close() */
+static gboolean
+mail_folder_writer_link_untouched_packs (MMailFolderWriter *writer,
+                                         GError **error)
+{
+	const gchar *name;
+	gchar *source_dir, *target_dir;
+	gboolean success = TRUE;
+	GDir *dir;
+
+	source_dir = g_build_filename (writer->link_dest, M_MAIL_PACK_DIR_NAME, NULL);
+	target_dir = g_build_filename (writer->root_path, M_MAIL_PACK_DIR_NAME, NULL);
+
+	dir = g_dir_open (source_dir, 0, NULL);
+
+	while (dir != NULL && success && (name = g_dir_read_name (dir)) != NULL) {
+		gchar *source, *target;
+
+		/* Packs written in this run were copied already. */
+		if (!g_str_has_suffix (name, ".pack") ||
+		    g_hash_table_contains (writer->packs, name))
+			continue;
+
+		if (g_mkdir_with_parents (target_dir, 0700) == -1) {
+			gint errsv = errno;
+
+			g_set_error (
+				error, G_IO_ERROR,
+				g_io_error_from_errno (errsv),
+				_("Failed to create “%s”: %s"),
+				target_dir, g_strerror (errsv));
+			success = FALSE;
+			break;
+		}
+
+		source = g_build_filename (source_dir, name, NULL);
+		target = g_build_filename (target_dir, name, NULL);
+
+		if (link (source, target) == -1 && errno != EEXIST) {
+			gint errsv = errno;
+
+			g_set_error (
+				error, G_IO_ERROR,
+				g_io_error_from_errno (errsv),
+				_("Failed to link “%s”: %s"),
+				target, g_strerror (errsv));
+			success = FALSE;
+		}
+
+		g_free (target);
+		g_free (source);
 	}
 
+	if (dir != NULL)
+		g_dir_close (dir);
+	g_free (target_dir);
+	g_free (source_dir);
+
+	return success;
+}
+
+/* Helper for m_mail_folder_writer_close() */
+static gboolean
+mail_folder_writer_link_untouched_files (MMailFolderWriter *writer,
+                                         GError **error)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	gsize prefix_len;
+	gboolean success = TRUE;
+
+	prefix_len = strlen (writer->link_dest) + 1;
+
+	g_hash_table_iter_init (&iter, writer->link_files);
+
+	/* Whatever this run neither wrote nor linked is linked as it
+	 * is, at the same place, just like untouched packs are, so that
+	 * a run over a few messages keeps all the others. */
+	while (success && g_hash_table_iter_next (&iter, &key, &value)) {
+		const gchar *previous = value;
+		guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+		guint64 size;
+		gchar *uid, *target, *maildir, *dirname;
+
+		if (g_hash_table_contains (writer->link_done, key))
+			continue;
+
+		/* Written anew, maybe into a pack by now. */
+		uid = m_maildir_dup_uid (key);
+
+		if (uid != NULL && m_export_manifest_lookup (writer->manifest, uid, digest, &size)) {
+			g_free (uid);
+			continue;
+		}
+
+		g_free (uid);
+
+		target = g_build_filename (writer->root_path, previous + prefix_len, NULL);
+		dirname = g_path_get_dirname (target);
+		maildir = g_path_get_dirname (dirname);
+
+		success = m_maildir_ensure (maildir, g_strcmp0 (maildir, writer->root_path) != 0, error);
+
+		if (success && link (previous, target) == -1 && errno != EEXIST) {
+			gint errsv = errno;
+
+			g_set_error (
+				error, G_IO_ERROR,
+				g_io_error_from_errno (errsv),
+				_("Failed to link “%s”: %s"),
+				target, g_strerror (errsv));
+			success = FALSE;
+		}
+
+		g_free (maildir);
+		g_free (dirname);
+		g_free (target);
+	}
+
+	return success;
+}
+
+/**
+ * m_mail_folder_writer_new:
+ * @destination: root of the offline store
+ * @options: (nullable): an #MExportOptions, or %NULL for defaults
+ * @error: return location for a #GError, or %NULL
+ *
+ * Creates a writer delivering messages into the offline store at
+ * @destination, which is made a maildir if it is not one already.
+ * The writer may be used from several threads at once.
+ *
+ * Returns: (transfer full): a new #MMailFolderWriter, or %NULL on error
+ **/
+MMailFolderWriter *
+m_mail_folder_writer_new (GFile *destination,
+                          const MExportOptions *options,
+                          GError **error)
+{
+	MMailFolderWriter *writer;
+	gchar *root_path, *cur_path;
+	gboolean fresh;
+
+	g_return_val_if_fail (G_IS_FILE (destination), NULL);
+
+	root_path = g_file_get_path (destination);
+	if (root_path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Messages can be saved only into a local directory"));
+		return NULL;
+	}
+
+	writer = g_slice_new0 (MMailFolderWriter);
+	writer->layout = M_EXPORT_LAYOUT_FLAT;
+	writer->cache_hints = TRUE;
+
+	g_mutex_init (&writer->lock);
+	g_queue_init (&writer->drop_queue);
+
+	if (options != NULL && options->snapshots) {
+		GDateTime *now;
+
+		now = g_date_time_new_now_utc ();
+		writer->snapshot_name = g_date_time_format (now, "%Y-%m-%dT%H%M%SZ");
+		g_date_time_unref (now);
+
+		writer->snapshot_root = root_path;
+		writer->link_dest = mail_folder_writer_dup_latest_snapshot (root_path);
+		root_path = g_build_filename (
+			writer->snapshot_root, writer->snapshot_name, NULL);
+
+		/* Two runs within the same second share the snapshot. */
+		if (g_strcmp0 (writer->link_dest, root_path) == 0)
+			g_clear_pointer (&writer->link_dest, g_free);
+	}
+
+	writer->root_path = root_path;
+
+	cur_path = g_build_filename (root_path, "cur", NULL);
+	fresh = !g_file_test (cur_path, G_FILE_TEST_IS_DIR);
+	g_free (cur_path);
+
+	/* The destination itself is always a maildir, subfolders
+	 * of the Maildir++ layout are created on demand. */
+	if (!m_maildir_ensure (root_path, FALSE, error)) {
+		m_mail_folder_writer_free (writer);
+		return NULL;
+	}
+
+	writer->maildirs = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) g_free);
+
+	writer->packs = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) m_mail_pack_free);
+
+	writer->maildir_files = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) g_hash_table_destroy);
+
+	if (writer->link_dest != NULL) {
+		writer->link_files = g_hash_table_new_full (
+			g_str_hash, g_str_equal,
+			(GDestroyNotify) g_free,
+			(GDestroyNotify) g_free);
+
+		writer->link_done = g_hash_table_new_full (
+			g_str_hash, g_str_equal,
+			(GDestroyNotify) g_free, NULL);
+
+		writer->link_packs = g_hash_table_new_full (
+			g_str_hash, g_str_equal,
+			(GDestroyNotify) g_free,
+			(GDestroyNotify) m_mail_pack_free);
+
+		mail_folder_writer_index_link_dest (writer);
+	}
+
+	/* A new snapshot lists only what it gets, either written
+	 * or carried over, otherwise the store keeps its entries
+	 * for messages this run does not touch. */
+	if (writer->link_dest == NULL)
+		writer->manifest = m_export_manifest_load (root_path, NULL);
+	else
+		writer->link_manifest = m_export_manifest_load (writer->link_dest, NULL);
+
+	/* Stores from before there were manifests have none. */
+	writer->manifest_lists_all = fresh || writer->manifest != NULL;
+
+	if (writer->manifest == NULL)
+		writer->manifest = m_export_manifest_new ();
+
+	if (options != NULL) {
+		writer->layout = options->layout;
+		writer->cache_hints = options->cache_hints;
+		writer->direct_io_threshold = (gsize) options->direct_io_threshold * 1024;
+
+		if (options->throttle != NULL)
+			writer->throttle = m_throttle_ref (options->throttle);
+
+		if (options->trace != NULL)
+			writer->trace = m_export_trace_ref (options->trace);
+
+		if (options->pack_age_days > 0)
+			writer->pack_before = g_get_real_time () / G_USEC_PER_SEC -
+				(gint64) options->pack_age_days * 24 * 60 * 60;
+	}
+
+	return writer;
+}
+
+/**
+ * m_mail_folder_writer_get_root_path:
+ * @writer: an #MMailFolderWriter
+ *
+ * Returns: the maildir messages are written into, which in snapshot
+ *    mode is the new snapshot rather than the destination itself
+ **/
+const gchar *
+m_mail_folder_writer_get_root_path (MMailFolderWriter *writer)
+{
+	g_return_val_if_fail (writer != NULL, NULL);
+
+	return writer->root_path;
+}
+
+/**
+ * m_mail_folder_writer_wants_pack:
+ * @writer: an #MMailFolderWriter
+ * @date: the message date, as a Unix time
+ *
+ * Returns: whether a message from @date will be stored in a month
+ *    pack rather than as a maildir file
+ **/
+gboolean
+m_mail_folder_writer_wants_pack (MMailFolderWriter *writer,
+                                 gint64 date)
+{
+	g_return_val_if_fail (writer != NULL, FALSE);
+
+	return writer->pack_before > 0 && date > 0 && date < writer->pack_before;
+}
+
+/* Helper for m_mail_folder_writer_write() */
+static gchar *
+mail_folder_writer_dup_location (MMailFolderWriter *writer,
+                                 const gchar *uid,
+                                 gint64 date)
+{
+	gchar *location;
+
+	/* Maildir files by their base name, which does not change
+	 * with the flags, and packed messages by their pack. */
+	if (m_mail_folder_writer_wants_pack (writer, date)) {
+		gchar *name;
+
+		name = m_mail_pack_build_name (date);
+		location = g_build_filename (M_MAIL_PACK_DIR_NAME, name, NULL);
+		g_free (name);
+	} else {
+		gchar *subfolder, *basename;
+
+		subfolder = m_maildir_build_subfolder (writer->layout, date);
+		basename = m_maildir_build_basename (uid, date);
+
+		if (subfolder != NULL)
+			location = g_build_filename (subfolder, basename, NULL);
+		else
+			location = g_strdup (basename);
+
+		g_free (basename);
+		g_free (subfolder);
+	}
+
+	return location;
+}
+
+/* Helper for m_mail_folder_writer_write() */
+static void
+mail_folder_writer_record (MMailFolderWriter *writer,
+                           const gchar *uid,
+                           gint64 date,
+                           const guint8 *digest,
+                           gsize length)
+{
+	gchar *location;
+
+	location = mail_folder_writer_dup_location (writer, uid, date);
+	m_export_manifest_set (writer->manifest, uid, location, digest, length);
+	g_free (location);
+}
+
+/* Helper for m_mail_folder_writer_write() */
+static gboolean
+mail_folder_writer_remove_previous (MMailFolderWriter *writer,
+                                    const gchar *uid,
+                                    gint64 date,
+                                    GError **error)
+{
+	gchar *location, *previous, *dirname, *basename;
+	gboolean success = TRUE;
+
+	/* A new snapshot has only what was carried over so far,
+	 * everything else is where the previous one has it. */
+	previous = m_export_manifest_dup_location (writer->manifest, uid);
+	if (previous == NULL && writer->link_manifest != NULL)
+		previous = m_export_manifest_dup_location (writer->link_manifest, uid);
+
+	location = mail_folder_writer_dup_location (writer, uid, date);
+
+	/* Moved between a maildir file and a pack, with the age of the
+	 * message or the pack-age-days setting, or between subfolders
+	 * with the layout; the old copy goes once the new one is in. */
+	if (previous == NULL || g_str_equal (previous, location)) {
+		g_free (location);
+		g_free (previous);
+		return TRUE;
+	}
+
+	dirname = g_path_get_dirname (previous);
+	basename = g_path_get_basename (previous);
+
+	if (g_str_equal (dirname, M_MAIL_PACK_DIR_NAME)) {
+		MMailPack *pack = NULL;
+		gchar *filename;
+		gboolean exists;
+
+		filename = g_build_filename (writer->root_path, previous, NULL);
+		exists = g_file_test (filename, G_FILE_TEST_IS_REGULAR);
+		g_free (filename);
+
+		if (!exists && writer->link_dest != NULL) {
+			filename = g_build_filename (writer->link_dest, previous, NULL);
+			exists = g_file_test (filename, G_FILE_TEST_IS_REGULAR);
+			g_free (filename);
+		}
+
+		/* Dead space until the pack is rewritten, but never
+		 * restored or carried over again. */
+		g_mutex_lock (&writer->lock);
+
+		if (exists || g_hash_table_contains (writer->packs, basename)) {
+			pack = mail_folder_writer_lookup_pack_by_name (writer, basename, error);
+			success = pack != NULL;
+		}
+
+		if (pack != NULL)
+			m_mail_pack_remove (pack, uid);
+
+		g_mutex_unlock (&writer->lock);
+	} else {
+		GPtrArray *old_paths;
+		gchar *maildir;
+		guint ii;
+
+		if (g_str_equal (dirname, "."))
+			maildir = g_strdup (writer->root_path);
+		else
+			maildir = g_build_filename (writer->root_path, dirname, NULL);
+
+		old_paths = mail_folder_writer_dup_old_paths (writer, maildir, basename);
+
+		for (ii = 0; success && old_paths != NULL && ii < old_paths->len; ii++) {
+			const gchar *old_path = g_ptr_array_index (old_paths, ii);
+
+			if (g_unlink (old_path) == -1 && errno != ENOENT) {
+				gint errsv = errno;
+
+				g_set_error (
+					error, G_IO_ERROR,
+					g_io_error_from_errno (errsv),
+					_("Failed to remove “%s”: %s"),
+					old_path, g_strerror (errsv));
+				success = FALSE;
+			}
+		}
+
+		if (success && old_paths != NULL)
+			mail_folder_writer_set_path (writer, maildir, basename, NULL);
+
+		if (old_paths != NULL)
+			g_ptr_array_unref (old_paths);
+
+		g_free (maildir);
+	}
+
+	g_free (basename);
+	g_free (dirname);
+	g_free (location);
+	g_free (previous);
+
+	return success;
+}
+
+/* Helper for m_mail_folder_writer_write() */
+static gboolean
+mail_folder_writer_write_pack (MMailFolderWriter *writer,
+                               const gchar *uid,
+                               gint64 date,
+                               guint32 flags,
+                               const guint8 *data,
+                               gsize length,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+	MMailPack *pack;
+	GBytes *compressed;
+	gboolean success, packed;
+	gint64 started;
+
+	/* Includes waiting for the lock, which is shared by all packs. */
+	TRACE_STEP_START (commit, uid, started);
+
+	g_mutex_lock (&writer->lock);
+
+	/* Already packed, at most its flags change. */
+	pack = mail_folder_writer_lookup_pack (writer, date, error);
+	packed = pack != NULL && m_mail_pack_contains (pack, uid);
+
+	success = packed && m_mail_pack_add (
+		pack, uid, flags, date, NULL, 0,
+		cancellable, error);
+
+	g_mutex_unlock (&writer->lock);
+
+	if (pack == NULL || packed) {
+		TRACE_STEP_DONE (writer->trace, commit, uid, started, success ? (gssize) length : -1);
+		return success;
+	}
+
+	/* Compressed by every write worker on its own,
+	 * only appending to the pack takes turns. */
+	compressed = m_mail_pack_compress (uid, data, length, error);
+	if (compressed == NULL) {
+		TRACE_STEP_DONE (writer->trace, commit, uid, started, -1);
+		return FALSE;
+	}
+
+	/* The writer keeps its packs open until it is freed. */
+	g_mutex_lock (&writer->lock);
+
+	success = m_mail_pack_append (
+		pack, uid, flags, date, compressed, length,
+		cancellable, error);
+
+	g_mutex_unlock (&writer->lock);
+
+	g_bytes_unref (compressed);
+
+	TRACE_STEP_DONE (writer->trace, commit, uid, started, success ? (gssize) length : -1);
+
+	return success;
+}
+
+/**
+ * m_mail_folder_writer_write:
+ * @writer: an #MMailFolderWriter
+ * @uid: the message UID
+ * @date: the message date, as a Unix time
+ * @flags: #CamelMessageFlags of the message
+ * @data: the serialized message
+ * @length: length of @data
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Stores one message, either into the month pack when it is old
+ * enough, or as a maildir file delivered through tmp/ into cur/
+ * of the Maildir++ subfolder its @date belongs to, and lists its
+ * digest in the manifest.  A copy the manifest has somewhere else,
+ * a file for a message packed now or the other way round, is then
+ * removed.  Waits first when the throttle of the writer's options
+ * says so.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_folder_writer_write (MMailFolderWriter *writer,
+                            const gchar *uid,
+                            gint64 date,
+                            guint32 flags,
+                            const guint8 *data,
+                            gsize length,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+	guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+	gboolean success;
+
+	g_return_val_if_fail (writer != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	/* Shared by all writing threads, the limits are global. */
+	if (writer->throttle != NULL &&
+	    !m_throttle_consume (writer->throttle, length, 1, cancellable, error))
+		return FALSE;
+
+	/* While the message is still in the CPU cache from
+	 * serializing it, rather than reading it back later. */
+	m_export_manifest_compute (data, length, digest);
+
+	if (!m_mail_folder_writer_wants_pack (writer, date))
+		success = mail_folder_writer_write_file (
+			writer, uid, date, flags,
+			data, -1, length, cancellable, error);
+	else
+		success = mail_folder_writer_write_pack (
+			writer, uid, date, flags,
+			data, length, cancellable, error);
+
+	if (success)
+		success = mail_folder_writer_remove_previous (writer, uid, date, error);
+
+	if (success)
+		mail_folder_writer_record (writer, uid, date, digest, length);
+
+	return success;
+}
+
+/**
+ * m_mail_folder_writer_copy:
+ * @writer: an #MMailFolderWriter
+ * @uid: the message UID
+ * @date: the message date, as a Unix time
+ * @flags: #CamelMessageFlags of the message
+ * @source_fd: a file holding the message as it is to be stored
+ * @length: length of the file
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Like m_mail_folder_writer_write(), but takes the message from a
+ * file, like the raw copy in the cache of a remote store.  Maildir
+ * files are reflinked where the file system allows, or else copied by
+ * the kernel; the message is read only to hash it, and to pack it.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_folder_writer_copy (MMailFolderWriter *writer,
+                           const gchar *uid,
+                           gint64 date,
+                           guint32 flags,
+                           gint source_fd,
+                           gsize length,
+                           GCancellable *cancellable,
+                           GError **error)
+{
+	guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+	GMappedFile *mapped_file;
+	const guint8 *data;
+	gboolean success;
+
+	g_return_val_if_fail (writer != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+	g_return_val_if_fail (source_fd != -1, FALSE);
+
+	if (writer->throttle != NULL &&
+	    !m_throttle_consume (writer->throttle, length, 1, cancellable, error))
+		return FALSE;
+
+	mapped_file = g_mapped_file_new_from_fd (source_fd, FALSE, error);
+	if (mapped_file == NULL)
+		return FALSE;
+
+	data = (const guint8 *) g_mapped_file_get_contents (mapped_file);
+	length = g_mapped_file_get_length (mapped_file);
+
+	/* The copy never passes through here, so the source is
+	 * hashed instead; a reflink shares its very blocks. */
+	m_export_manifest_compute (data, length, digest);
+
+	if (!m_mail_folder_writer_wants_pack (writer, date))
+		success = mail_folder_writer_write_file (
+			writer, uid, date, flags,
+			NULL, source_fd, length, cancellable, error);
+	else
+		success = mail_folder_writer_write_pack (
+			writer, uid, date, flags,
+			data, length, cancellable, error);
+
+	if (success)
+		success = mail_folder_writer_remove_previous (writer, uid, date, error);
+
+	if (success)
+		mail_folder_writer_record (writer, uid, date, digest, length);
+
+	g_mapped_file_unref (mapped_file);
+
+	return success;
+}
+
+/**
+ * m_mail_folder_writer_has_previous:
+ * @writer: an #MMailFolderWriter
+ * @uid: the message UID
+ * @date: the message date, as a Unix time
+ *
+ * Returns: whether the previous snapshot has the message, which then
+ *    takes no space to carry over, whatever its flags are
+ **/
+gboolean
+m_mail_folder_writer_has_previous (MMailFolderWriter *writer,
+                                   const gchar *uid,
+                                   gint64 date)
+{
+	gboolean found;
+
+	g_return_val_if_fail (writer != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	if (writer->link_dest == NULL)
+		return FALSE;
+
+	if (m_mail_folder_writer_wants_pack (writer, date)) {
+		MMailPack *previous;
+		gchar *name;
+
+		name = m_mail_pack_build_name (date);
+
+		g_mutex_lock (&writer->lock);
+		previous = mail_folder_writer_lookup_link_dest_pack (writer, name);
+		found = previous != NULL && m_mail_pack_contains (previous, uid);
+		g_mutex_unlock (&writer->lock);
+
+		g_free (name);
+	} else {
+		gchar *basename;
+
+		basename = m_maildir_build_basename (uid, date);
+		found = g_hash_table_contains (writer->link_files, basename);
+		g_free (basename);
+	}
+
+	return found;
+}
+
+/**
+ * m_mail_folder_writer_link_unchanged:
+ * @writer: an #MMailFolderWriter
+ * @uid: the message UID
+ * @date: the message date, as a Unix time
+ * @flags: #CamelMessageFlags of the message
+ *
+ * In snapshot mode, carries a message over from the previous snapshot
+ * without its content: a maildir file is hardlinked under a name with
+ * the current @flags, a packed message keeps its place in the pack.
+ * Message content never changes for a given UID, so only the flags
+ * need to be compared, and the manifest entry is carried over as well.
+ *
+ * Returns: %TRUE if the message is in the new snapshot now, %FALSE
+ *    when it has to be written with m_mail_folder_writer_write()
+ **/
+gboolean
+m_mail_folder_writer_link_unchanged (MMailFolderWriter *writer,
+                                     const gchar *uid,
+                                     gint64 date,
+                                     guint32 flags)
+{
+	gboolean linked = FALSE;
+
+	g_return_val_if_fail (writer != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	if (writer->link_dest == NULL)
+		return FALSE;
+
+	if (m_mail_folder_writer_wants_pack (writer, date)) {
+		MMailPack *previous;
+		gchar *name;
+		guint32 previous_flags;
+
+		name = m_mail_pack_build_name (date);
+
+		g_mutex_lock (&writer->lock);
+
+		previous = mail_folder_writer_lookup_link_dest_pack (writer, name);
+
+		if (previous != NULL && m_mail_pack_get_flags (previous, uid, &previous_flags)) {
+			/* An untouched pack is linked as a whole on close,
+			 * otherwise the copy in this snapshot is updated. */
+			if (previous_flags == flags && !g_hash_table_contains (writer->packs, name)) {
+				linked = TRUE;
+			} else {
+				MMailPack *pack;
+
+				pack = mail_folder_writer_lookup_pack (writer, date, NULL);
+
+				linked = pack != NULL &&
+					m_mail_pack_contains (pack, uid) &&
+					m_mail_pack_add (pack, uid, flags, date, NULL, 0, NULL, NULL);
+			}
+		}
+
+		g_mutex_unlock (&writer->lock);
+
+		g_free (name);
+
+	} else {
+		const gchar *previous;
+		gchar *basename;
+
+		basename = m_maildir_build_basename (uid, date);
+		previous = g_hash_table_lookup (writer->link_files, basename);
+
+		if (previous != NULL) {
+			gchar *maildir;
+
+			maildir = mail_folder_writer_dup_maildir (writer, date, NULL);
+
+			if (maildir != NULL) {
+				gchar *filename, *path;
+
+				filename = m_maildir_build_filename (basename, flags);
+				path = g_build_filename (maildir, "cur", filename, NULL);
+
+				/* Anything but success means writing it anew. */
+				linked = link (previous, path) == 0 || errno == EEXIST;
+
+				if (linked) {
+					g_mutex_lock (&writer->lock);
+					g_hash_table_add (writer->link_done, g_strdup (basename));
+					g_mutex_unlock (&writer->lock);
+				}
+
+				g_free (path);
+				g_free (filename);
+				g_free (maildir);
+			}
+		}
+
+		g_free (basename);
+	}
+
+	if (linked && writer->link_manifest != NULL) {
+		guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+		guint64 size;
+
+		if (m_export_manifest_lookup (writer->link_manifest, uid, digest, &size))
+			mail_folder_writer_record (writer, uid, date, digest, size);
+	}
+
+	return linked;
+}
+
+/* Helper for m_mail_folder_writer_close() */
+static gboolean
+mail_folder_writer_flush (MMailFolderWriter *writer,
+                          gboolean link_untouched,
+                          GError **error)
+{
+	GHashTableIter iter;
+	gpointer value;
+	gboolean success = TRUE;
+
+	g_mutex_lock (&writer->lock);
+
+	while (!g_queue_is_empty (&writer->drop_queue))
+		mail_folder_writer_drop_fd (
+			GPOINTER_TO_INT (g_queue_pop_head (&writer->drop_queue)));
+
+	g_hash_table_iter_init (&iter, writer->packs);
+
+	while (g_hash_table_iter_next (&iter, NULL, &value)) {
+		/* Keep closing the rest even if one fails, so that
+		 * as many indexes as possible make it to the disk.
+		 * A closed pack still takes more messages, which go
+		 * after the index written here. */
+		if (!m_mail_pack_close (value, success ? error : NULL))
+			success = FALSE;
+	}
+
+	if (success && link_untouched && writer->link_dest != NULL)
+		success = mail_folder_writer_link_untouched_packs (writer, error);
+
+	if (success && link_untouched && writer->link_dest != NULL)
+		success = mail_folder_writer_link_untouched_files (writer, error);
+
+	g_mutex_unlock (&writer->lock);
+
+	/* Everything of the previous snapshot is in this one now. */
+	if (success && link_untouched && writer->link_manifest != NULL)
+		m_export_manifest_add_missing (writer->manifest, writer->link_manifest);
+
+	if (!m_export_manifest_save (writer->manifest, writer->root_path, success ? error : NULL))
+		success = FALSE;
+
+	return success;
+}
+
+/**
+ * m_mail_folder_writer_checkpoint:
+ * @writer: an #MMailFolderWriter
+ * @error: return location for a #GError, or %NULL
+ *
+ * Makes everything delivered by @writer so far readable while it
+ * goes on writing: the indexes of the packs touched so far and the
+ * manifest are written.  The first snapshot of a destination is also
+ * published right away, since a partial snapshot beats none, while
+ * any later one waits for m_mail_folder_writer_publish() so that the
+ * "latest" link keeps pointing at a complete store.  No message may
+ * be on its way through @writer at the same time.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_folder_writer_checkpoint (MMailFolderWriter *writer,
+                                 GError **error)
+{
+	gboolean success;
+
+	g_return_val_if_fail (writer != NULL, FALSE);
+
+	success = mail_folder_writer_flush (writer, FALSE, error);
+
+	if (success && writer->snapshot_root != NULL && writer->link_dest == NULL)
+		success = m_mail_folder_writer_publish (writer, error);
+
+	return success;
+}
+
+/**
+ * m_mail_folder_writer_close:
+ * @writer: an #MMailFolderWriter
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes the indexes of all packs touched by @writer, and the manifest.
+ * This should be called even after a failed batch, so that whatever
+ * made it into the packs stays readable, and listed.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_folder_writer_close (MMailFolderWriter *writer,
+                            GError **error)
+{
+	g_return_val_if_fail (writer != NULL, FALSE);
+
+	return mail_folder_writer_flush (writer, TRUE, error);
+}
+
+/**
+ * m_mail_folder_writer_publish:
+ * @writer: an #MMailFolderWriter
+ * @error: return location for a #GError, or %NULL
+ *
+ * In snapshot mode, atomically points the "latest" link of the
+ * destination at the snapshot written by @writer, which makes it the
+ * base of the next snapshot.  Call it only after a successful export
+ * and m_mail_folder_writer_close(); it does nothing otherwise.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_folder_writer_publish (MMailFolderWriter *writer,
+                              GError **error)
+{
+	gchar *tmp_path, *latest;
+	gboolean success = TRUE;
+
+	g_return_val_if_fail (writer != NULL, FALSE);
+
+	if (writer->snapshot_root == NULL)
+		return TRUE;
+
+	tmp_path = g_build_filename (writer->snapshot_root, "." M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+	latest = g_build_filename (writer->snapshot_root, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+
+	/* A relative link keeps working when the whole
+	 * destination is moved or mounted elsewhere. */
+	g_unlink (tmp_path);
+
+	if (symlink (writer->snapshot_name, tmp_path) == -1 ||
+	    g_rename (tmp_path, latest) == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to update “%s”: %s"),
+			latest, g_strerror (errsv));
+		g_unlink (tmp_path);
+		success = FALSE;
+	}
+
+	g_free (latest);
+	g_free (tmp_path);
+
+	return success;
+}
+
+void
+m_mail_folder_writer_free (MMailFolderWriter *writer)
+{
+	if (writer == NULL)
+		return;
+
+	/* Only left over when m_mail_folder_writer_close() was not called. */
+	while (!g_queue_is_empty (&writer->drop_queue))
+		close (GPOINTER_TO_INT (g_queue_pop_head (&writer->drop_queue)));
+
+	g_clear_pointer (&writer->packs, g_hash_table_destroy);
+	g_clear_pointer (&writer->maildirs, g_hash_table_destroy);
+	g_clear_pointer (&writer->maildir_files, g_hash_table_destroy);
+	g_clear_pointer (&writer->link_packs, g_hash_table_destroy);
+	g_clear_pointer (&writer->link_files, g_hash_table_destroy);
+	g_clear_pointer (&writer->link_done, g_hash_table_destroy);
+	g_mutex_clear (&writer->lock);
+	g_free (writer->root_path);
+	g_free (writer->snapshot_root);
+	g_free (writer->snapshot_name);
+	g_free (writer->link_dest);
+
+	m_throttle_unref (writer->throttle);
+	m_export_trace_unref (writer->trace);
+	m_export_manifest_free (writer->manifest);
+	m_export_manifest_free (writer->link_manifest);
+
+	g_slice_free (MMailFolderWriter, writer);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gint64
+mail_folder_save_get_message_date (CamelFolder *folder,
+                                   const gchar *uid,
+                                   guint32 *out_flags)
+{
+	CamelMessageInfo *info;
+	gint64 date = 0;
+
+	*out_flags = 0;
+
+	info = camel_folder_get_message_info (folder, uid);
+	if (info == NULL)
+		return 0;
+
+	date = camel_message_info_get_date_received (info);
+	if (date <= 0)
+		date = camel_message_info_get_date_sent (info);
+
+	*out_flags = camel_message_info_get_flags (info);
+
+	g_object_unref (info);
+
+	return date;
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static void
+mail_folder_save_advise_source (CamelFolder *folder,
+                                const gchar *uid,
+                                gboolean will_need)
+{
+#ifdef HAVE_POSIX_FADVISE
+	gchar *filename;
+	gint fd;
+
+	/* Only stores keeping messages in local files have one,
+	 * be it the message itself or its offline cache copy. */
+	filename = camel_folder_get_filename (folder, uid, NULL);
+	if (filename == NULL)
+		return;
+
+	fd = g_open (filename, O_RDONLY | O_CLOEXEC, 0);
+	if (fd != -1) {
+		posix_fadvise (
+			fd, 0, 0, will_need ?
+			POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED);
+		close (fd);
+	}
+
+	g_free (filename);
+#endif
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static guint
+mail_folder_save_get_connection_limit (CamelFolder *folder)
+{
+	CamelService *service;
+	CamelProvider *provider;
+	CamelSettings *settings;
+	GParamSpec *pspec;
+	guint n_connections = 1;
+
+	service = CAMEL_SERVICE (camel_folder_get_parent_store (folder));
+	provider = camel_service_get_provider (service);
+
+	/* Local stores are limited by the disk, which the
+	 * controller finds out about on its own. */
+	if (provider == NULL || (provider->flags & CAMEL_PROVIDER_IS_REMOTE) == 0)
+		return 0;
+
+	/* Only some providers have more than one connection, and
+	 * the number the user configured for the account is the
+	 * most the server is supposed to see, IMAP's for one. */
+	settings = camel_service_ref_settings (service);
+	pspec = g_object_class_find_property (
+		G_OBJECT_GET_CLASS (settings), "concurrent-connections");
+	if (pspec != NULL && pspec->value_type == G_TYPE_UINT)
+		g_object_get (settings, "concurrent-connections", &n_connections, NULL);
+	g_object_unref (settings);
+
+	return MAX (n_connections, 1) * SAVE_FETCHES_PER_CONNECTION;
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gboolean
+mail_folder_save_preflight (CamelFolder *folder,
+                            GPtrArray *message_uids,
+                            MMailFolderWriter *writer,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+	GFile *root;
+	GFileInfo *fs_info;
+	guint64 needed = 0, available;
+	guint ii;
+
+	root = g_file_new_for_path (m_mail_folder_writer_get_root_path (writer));
+	fs_info = g_file_query_filesystem_info (
+		root, G_FILE_ATTRIBUTE_FILESYSTEM_FREE, cancellable, NULL);
+	g_object_unref (root);
+
+	/* Some file systems do not tell, then the writes will. */
+	if (fs_info == NULL)
+		return !g_cancellable_set_error_if_cancelled (cancellable, error);
+
+	if (!g_file_info_has_attribute (fs_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE)) {
+		g_object_unref (fs_info);
+		return TRUE;
+	}
+
+	available = g_file_info_get_attribute_uint64 (
+		fs_info, G_FILE_ATTRIBUTE_FILESYSTEM_FREE);
+	g_object_unref (fs_info);
+
+	for (ii = 0; ii < message_uids->len; ii++) {
+		const gchar *uid = g_ptr_array_index (message_uids, ii);
+		guint8 digest[M_EXPORT_MANIFEST_DIGEST_SIZE];
+		CamelMessageInfo *info;
+		guint64 size, stored_size;
+		gint64 date;
+
+		info = camel_folder_get_message_info (folder, uid);
+		if (info == NULL)
+			continue;
+
+		date = camel_message_info_get_date_received (info);
+		if (date <= 0)
+			date = camel_message_info_get_date_sent (info);
+
+		size = camel_message_info_get_size (info);
+
+		/* Hardlinked from the previous snapshot for free, and
+		 * a message the store has already is replaced in place,
+		 * which takes only what it grew by.  Packed messages are
+		 * counted uncompressed, so the estimate errs on the safe
+		 * side for them. */
+		if (m_mail_folder_writer_has_previous (writer, uid, date)) {
+			/* nothing */
+		} else if (m_export_manifest_lookup (writer->manifest, uid, digest, &stored_size)) {
+			if (size > stored_size)
+				needed += size - stored_size;
+		} else {
+			needed += size + PREFLIGHT_SLACK_PER_FILE;
+		}
+
+		g_object_unref (info);
+	}
+
+	if (needed + needed / 20 > available) {
+		gchar *needed_str, *available_str;
+
+		needed_str = g_format_size (needed);
+		available_str = g_format_size (available);
+
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+			_("Not enough free space for the export: about %s are needed, "
+			  "but only %s are available"),
+			needed_str, available_str);
+
+		g_free (available_str);
+		g_free (needed_str);
+
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+typedef struct _SaveContext SaveContext;
+typedef struct _SaveBuffer SaveBuffer;
+typedef struct _SaveTask SaveTask;
+typedef struct _SaveFailure SaveFailure;
+typedef struct _SaveOrder SaveOrder;
+
+/* State shared by the fetch and write workers of one export. */
+struct _SaveContext {
+	CamelFolder *folder;
+	MMailFolderWriter *writer;
+	MExportController *controller;
+	GCancellable *cancellable;
+	MExportTrace *trace;
+	gboolean cache_hints;
+	gsize stub_threshold;
+	gboolean raw_copy;
+	MThrottleIOPriority io_priority;
+
+	GThreadPool *fetch_pool;
+	GThreadPool *write_pool;
+
+	/* Protects everything below. */
+	GMutex lock;
+	GCond cond;
+	guint n_in_flight;
+	guint n_done;
+	GQueue idle_buffers;	/* SaveBuffers to reuse */
+	GQueue retry_queue;	/* SaveTasks, by retry_at */
+	GPtrArray *failures;	/* SaveFailures */
+	GError *error;		/* stops the whole export */
+	gint64 next_report;	/* monotonic time of the next progress report */
+};
+
+/* A serialized message, with the stream writing into it.  Both are
+ * passed on from message to message, so that serializing settles
+ * into reusing them instead of allocating anew every time. */
+struct _SaveBuffer {
+	GByteArray *data;
+	CamelStream *stream;
+};
+
+/* One message on its way through the pipeline. */
+struct _SaveTask {
+	const gchar *uid;
+	gint64 date;
+	guint32 flags;
+
+	/* Either the serialized message, or the store's own file. */
+	SaveBuffer *buffer;
+	gint source_fd;
+	gsize source_size;
+
+	guint attempts;
+	gint64 retry_at;
+};
+
+/* A message given up on, for the failure report. */
+struct _SaveFailure {
+	gchar *uid;
+	guint attempts;
+	GError *error;
+};
+
+/* A message of a newest first export, with its summary date. */
+struct _SaveOrder {
+	const gchar *uid;
+	gint64 date;
+};
+
+/* Ends of the windows a newest first export checkpoints at, in days
+ * before the start of the export: the last day, week and month. */
+static const guint save_windows[] = { 1, 7, 30 };
+
+static void
+save_failure_free (SaveFailure *failure)
+{
+	g_free (failure->uid);
+	g_clear_error (&failure->error);
+
+	g_slice_free (SaveFailure, failure);
+}
+
+static void
+save_buffer_free (SaveBuffer *buffer)
+{
+	g_object_unref (buffer->stream);
+	g_byte_array_unref (buffer->data);
+
+	g_slice_free (SaveBuffer, buffer);
+}
+
+static gint
+save_task_compare_retry_at (gconstpointer a,
+                            gconstpointer b,
+                            gpointer user_data)
+{
+	const SaveTask *task_a = a, *task_b = b;
+
+	return (task_a->retry_at > task_b->retry_at) -
+	       (task_a->retry_at < task_b->retry_at);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static SaveBuffer *
+mail_folder_save_acquire_buffer (SaveContext *context)
+{
+	SaveBuffer *buffer;
+
+	g_mutex_lock (&context->lock);
+	buffer = g_queue_pop_head (&context->idle_buffers);
+	g_mutex_unlock (&context->lock);
+
+	if (buffer == NULL) {
+		buffer = g_slice_new0 (SaveBuffer);
+		buffer->data = g_byte_array_new ();
+
+		/* CamelStreamMem does NOT take ownership of the byte
+		 * array when set with camel_stream_mem_set_byte_array(). */
+		buffer->stream = camel_stream_mem_new ();
+		camel_stream_mem_set_byte_array (
+			CAMEL_STREAM_MEM (buffer->stream), buffer->data);
+	}
+
+	return buffer;
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static void
+mail_folder_save_release_buffer (SaveContext *context,
+                                 SaveBuffer *buffer)
+{
+	/* Keeps the buffer from pinning the memory of an
+	 * unusually large message for the rest of the export. */
+	if (buffer->data->len > SAVE_BUFFER_KEEP_MAX) {
+		save_buffer_free (buffer);
+		return;
+	}
+
+	g_mutex_lock (&context->lock);
+	g_queue_push_head (&context->idle_buffers, buffer);
+	g_mutex_unlock (&context->lock);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gboolean
+mail_folder_save_serialize (CamelMimeMessage *message,
+                            SaveBuffer *buffer,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+	/* Setting the byte array again would not rewind the stream. */
+	g_byte_array_set_size (buffer->data, 0);
+
+	if (!g_seekable_seek (
+		G_SEEKABLE (buffer->stream), 0,
+		G_SEEK_SET, cancellable, error))
+		return FALSE;
+
+	/* Maildir files and pack entries are both the bare message,
+	 * without the From_ line and ">From " escaping of mbox. */
+	return camel_data_wrapper_write_to_stream_sync (
+		CAMEL_DATA_WRAPPER (message),
+		buffer->stream, cancellable, error) != -1;
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static void
+mail_folder_save_task_done (SaveContext *context,
+                            SaveTask *task,
+                            GError *local_error)
+{
+	if (task->buffer != NULL)
+		mail_folder_save_release_buffer (context, task->buffer);
+
+	if (task->source_fd != -1)
+		close (task->source_fd);
+
+	g_mutex_lock (&context->lock);
+
+	/* Only the first error is reported, the rest
+	 * are most likely caused by the same thing. */
+	if (local_error != NULL && context->error == NULL)
+		context->error = local_error;
+	else
+		g_clear_error (&local_error);
+
+	context->n_in_flight--;
+	context->n_done++;
+
+	g_cond_signal (&context->cond);
+	g_mutex_unlock (&context->lock);
+
+	g_slice_free (SaveTask, task);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gboolean
+mail_folder_save_error_is_transient (const GError *error)
+{
+	if (error->domain == G_IO_ERROR) {
+		switch (error->code) {
+			case G_IO_ERROR_TIMED_OUT:
+			case G_IO_ERROR_BUSY:
+			case G_IO_ERROR_WOULD_BLOCK:
+			case G_IO_ERROR_HOST_UNREACHABLE:
+			case G_IO_ERROR_NETWORK_UNREACHABLE:
+			case G_IO_ERROR_CONNECTION_REFUSED:
+			case G_IO_ERROR_BROKEN_PIPE:
+			case G_IO_ERROR_NOT_CONNECTED:
+				return TRUE;
+			default:
+				return FALSE;
+		}
+	}
+
+	return g_error_matches (error, CAMEL_SERVICE_ERROR, CAMEL_SERVICE_ERROR_UNAVAILABLE) ||
+	       g_error_matches (error, CAMEL_SERVICE_ERROR, CAMEL_SERVICE_ERROR_NOT_CONNECTED);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static void
+mail_folder_save_task_failed (SaveContext *context,
+                              SaveTask *task,
+                              GError *local_error)
+{
+	/* Cancelled, which is reported once for the whole export. */
+	if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+		g_error_free (local_error);
+		mail_folder_save_task_done (context, task, NULL);
+		return;
+	}
+
+	task->attempts++;
+
+	if (task->attempts < SAVE_MAX_ATTEMPTS && local_error != NULL &&
+	    mail_folder_save_error_is_transient (local_error)) {
+		gint64 backoff;
+
+		/* Exponential, with some jitter so that messages failing
+		 * together, on a dropped connection, come back spread out. */
+		backoff = MIN (G_USEC_PER_SEC << (task->attempts - 1), SAVE_MAX_BACKOFF);
+		backoff += g_random_int_range (0, backoff / 4 + 1);
+
+		if (task->buffer != NULL) {
+			mail_folder_save_release_buffer (context, task->buffer);
+			task->buffer = NULL;
+		}
+
+		task->retry_at = g_get_monotonic_time () + backoff;
+
+		g_mutex_lock (&context->lock);
+		g_queue_insert_sorted (
+			&context->retry_queue, task,
+			save_task_compare_retry_at, NULL);
+		context->n_in_flight--;
+		g_cond_signal (&context->cond);
+		g_mutex_unlock (&context->lock);
+
+		g_error_free (local_error);
+		return;
+	}
+
+	/* Give up on this one message, but not on the others. */
+	if (local_error != NULL) {
+		SaveFailure *failure;
+
+		failure = g_slice_new0 (SaveFailure);
+		failure->uid = g_strdup (task->uid);
+		failure->attempts = task->attempts;
+		failure->error = local_error;
+
+		g_mutex_lock (&context->lock);
+		g_ptr_array_add (context->failures, failure);
+		g_mutex_unlock (&context->lock);
+	}
+
+	mail_folder_save_task_done (context, task, NULL);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gboolean
+mail_folder_save_should_stop (SaveContext *context)
+{
+	gboolean stop;
+
+	g_mutex_lock (&context->lock);
+	stop = context->error != NULL;
+	g_mutex_unlock (&context->lock);
+
+	return stop || g_cancellable_is_cancelled (context->cancellable);
+}
+
+/* Helper for mail_folder_save_fetch() */
+static gboolean
+mail_folder_save_open_source (SaveContext *context,
+                              SaveTask *task)
+{
+	struct stat st;
+	gchar *filename;
+	gint fd;
+
+	/* Local stores and the offline cache of remote ones keep
+	 * the raw message in a file, which is not always complete
+	 * or there at all; the mbox store names a file offset. */
+	filename = camel_folder_get_filename (context->folder, task->uid, NULL);
+	if (filename == NULL)
+		return FALSE;
+
+	fd = g_open (filename, O_RDONLY | O_CLOEXEC, 0);
+	g_free (filename);
+
+	if (fd == -1)
+		return FALSE;
+
+	if (fstat (fd, &st) == -1 || !S_ISREG (st.st_mode) || st.st_size == 0) {
+		close (fd);
+		return FALSE;
+	}
+
+	task->source_fd = fd;
+	task->source_size = st.st_size;
+
+	return TRUE;
+}
+
+/* Fetch phase: get the message and serialize it. */
+static void
+mail_folder_save_fetch (SaveContext *context,
+                        SaveTask *task)
+{
+	CamelMimeMessage *message;
+	GError *local_error = NULL;
+	gint64 started, step_started;
+	gboolean success;
+
+	if (mail_folder_save_should_stop (context)) {
+		mail_folder_save_task_done (context, task, NULL);
+		return;
+	}
+
+	started = g_get_monotonic_time ();
+
+	task->date = mail_folder_save_get_message_date (
+		context->folder, task->uid, &task->flags);
+
+	/* Unchanged since the previous snapshot. */
+	if (m_mail_folder_writer_link_unchanged (
+		context->writer, task->uid, task->date, task->flags)) {
+		mail_folder_save_task_done (context, task, NULL);
+		return;
+	}
+
+	TRACE_STEP_START (fetch, task->uid, step_started);
+
+	/* Nothing about the message is to change, so it is copied
+	 * as it is, without parsing and serializing it again. */
+	if (context->raw_copy && mail_folder_save_open_source (context, task)) {
+		TRACE_STEP_DONE (
+			context->trace, fetch, task->uid,
+			step_started, (gssize) task->source_size);
+
+		m_export_controller_record (
+			context->controller, M_EXPORT_PHASE_FETCH,
+			g_get_monotonic_time () - started, task->source_size);
+
+		g_thread_pool_push (context->write_pool, task, NULL);
+		return;
+	}
+
+	message = camel_folder_get_message_sync (
+		context->folder, task->uid,
+		context->cancellable, &local_error);
+	TRACE_STEP_DONE (context->trace, fetch, task->uid, step_started, message != NULL ? 0 : -1);
+
+	if (message == NULL) {
+		mail_folder_save_task_failed (context, task, local_error);
+		return;
+	}
+
+	/* The source is not needed in the cache any longer. */
+	if (context->cache_hints)
+		mail_folder_save_advise_source (context->folder, task->uid, FALSE);
+
+	TRACE_STEP_START (prepare, task->uid, step_started);
+	mail_folder_save_prepare_part (
+		CAMEL_MIME_PART (message), task->uid,
+		context->stub_threshold, context->cancellable);
+	TRACE_STEP_DONE (context->trace, prepare, task->uid, step_started, 0);
+
+	task->buffer = mail_folder_save_acquire_buffer (context);
+
+	TRACE_STEP_START (serialize, task->uid, step_started);
+	success = mail_folder_save_serialize (
+		message, task->buffer, context->cancellable, &local_error);
+	TRACE_STEP_DONE (
+		context->trace, serialize, task->uid, step_started,
+		success ? (gssize) task->buffer->data->len : -1);
+
+	if (!success) {
+		g_object_unref (message);
+		mail_folder_save_task_failed (context, task, local_error);
+		return;
+	}
+
+	g_object_unref (message);
+
+	m_export_controller_record (
+		context->controller, M_EXPORT_PHASE_FETCH,
+		g_get_monotonic_time () - started, task->buffer->data->len);
+
+	g_thread_pool_push (context->write_pool, task, NULL);
+}
+
+/* Write phase: deliver the message into the offline store. */
+static void
+mail_folder_save_write (SaveContext *context,
+                        SaveTask *task)
+{
+	GError *local_error = NULL;
+	gint64 started;
+	gsize length;
+	gboolean success;
+
+	if (mail_folder_save_should_stop (context)) {
+		mail_folder_save_task_done (context, task, NULL);
+		return;
+	}
+
+	TRACE_STEP_START (write, task->uid, started);
+
+	if (task->source_fd != -1) {
+		length = task->source_size;
+		success = m_mail_folder_writer_copy (
+			context->writer, task->uid, task->date, task->flags,
+			task->source_fd, length,
+			context->cancellable, &local_error);
+
+		/* The source is not needed in the cache any longer. */
+#ifdef HAVE_POSIX_FADVISE
+		if (context->cache_hints)
+			posix_fadvise (task->source_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	} else {
+		length = task->buffer->data->len;
+		success = m_mail_folder_writer_write (
+			context->writer, task->uid, task->date, task->flags,
+			task->buffer->data->data, length,
+			context->cancellable, &local_error);
+	}
+
+	TRACE_STEP_DONE (
+		context->trace, write, task->uid, started,
+		success ? (gssize) length : -1);
+
+	if (success)
+		m_export_controller_record (
+			context->controller, M_EXPORT_PHASE_WRITE,
+			g_get_monotonic_time () - started, length);
+
+	mail_folder_save_task_done (context, task, local_error);
+}
+
+static void
+mail_folder_save_fetch_thread (gpointer data,
+                               gpointer user_data)
+{
+	SaveContext *context = user_data;
+	gint io_priority;
+
+	/* Pool threads are shared, so the priority is only
+	 * lowered for as long as they work for the export. */
+	io_priority = m_throttle_lower_io_priority (context->io_priority);
+	mail_folder_save_fetch (context, data);
+	m_throttle_restore_io_priority (io_priority);
+}
+
+static void
+mail_folder_save_write_thread (gpointer data,
+                               gpointer user_data)
+{
+	SaveContext *context = user_data;
+	gint io_priority;
+
+	io_priority = m_throttle_lower_io_priority (context->io_priority);
+	mail_folder_save_write (context, data);
+	m_throttle_restore_io_priority (io_priority);
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static void
+mail_folder_save_dispatch_retries (SaveContext *context)
+{
+	SaveTask *task;
+	gboolean stop;
+	gint64 now;
+
+	/* Called with the lock held. */
+	stop = context->error != NULL ||
+		g_cancellable_is_cancelled (context->cancellable);
+	now = g_get_monotonic_time ();
+
+	while ((task = g_queue_peek_head (&context->retry_queue)) != NULL) {
+		if (!stop && (task->retry_at > now || context->n_in_flight >=
+		    m_export_controller_get_max_in_flight (context->controller)))
+			break;
+
+		g_queue_pop_head (&context->retry_queue);
+
+		/* Nobody is going to wait for it any longer. */
+		if (stop) {
+			g_slice_free (SaveTask, task);
+			continue;
+		}
+
+		context->n_in_flight++;
+		g_thread_pool_push (context->fetch_pool, task, NULL);
+	}
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static void
+mail_folder_save_wait (SaveContext *context,
+                       gboolean drain,
+                       guint n_total)
+{
+	/* Called with the lock held, until there is room for one more
+	 * message, or until nothing is left when draining.  Every quarter
+	 * of a second, whether messages keep finishing or one takes long,
+	 * the waiting thread reports progress and lets the controller
+	 * adjust the pools; retries which are due go out on every pass. */
+	while (TRUE) {
+		gint64 now = g_get_monotonic_time ();
+
+		if (now >= context->next_report) {
+			guint n_done = context->n_done;
+
+			context->next_report = now + G_USEC_PER_SEC / 4;
+
+			g_mutex_unlock (&context->lock);
+
+			camel_operation_progress (
+				context->cancellable,
+				(n_done * 100) / n_total);
+
+			if (m_export_controller_tick (context->controller)) {
+				g_thread_pool_set_max_threads (
+					context->fetch_pool,
+					m_export_controller_get_workers (
+					context->controller, M_EXPORT_PHASE_FETCH), NULL);
+				g_thread_pool_set_max_threads (
+					context->write_pool,
+					m_export_controller_get_workers (
+					context->controller, M_EXPORT_PHASE_WRITE), NULL);
+			}
+
+			g_mutex_lock (&context->lock);
+		}
+
+		mail_folder_save_dispatch_retries (context);
+
+		if (drain) {
+			if (context->n_in_flight == 0 &&
+			    g_queue_is_empty (&context->retry_queue))
+				break;
+		} else if (context->n_in_flight <
+			   m_export_controller_get_max_in_flight (context->controller)) {
+			break;
+		}
+
+		g_cond_wait_until (&context->cond, &context->lock, context->next_report);
+	}
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gint
+mail_folder_save_compare_newest_first (gconstpointer a,
+                                       gconstpointer b)
+{
+	const SaveOrder *order_a = a;
+	const SaveOrder *order_b = b;
+
+	/* Messages without any date end up last. */
+	if (order_a->date == order_b->date)
+		return 0;
+
+	return order_a->date > order_b->date ? -1 : 1;
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static GArray *
+mail_folder_save_order_newest_first (CamelFolder *folder,
+                                     GPtrArray *message_uids)
+{
+	GArray *order;
+	guint ii;
+
+	order = g_array_sized_new (FALSE, FALSE, sizeof (SaveOrder), message_uids->len);
+
+	/* Dates come from the summary, no message is read. */
+	for (ii = 0; ii < message_uids->len; ii++) {
+		SaveOrder item;
+		guint32 flags;
+
+		item.uid = g_ptr_array_index (message_uids, ii);
+		item.date = mail_folder_save_get_message_date (folder, item.uid, &flags);
+
+		g_array_append_val (order, item);
+	}
+
+	g_array_sort (order, mail_folder_save_compare_newest_first);
+
+	return order;
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gboolean
+mail_folder_save_checkpoint (SaveContext *context,
+                             guint n_total)
+{
+	GError *local_error = NULL;
+	gboolean stop;
+
+	/* Everything before the window end has to be in. */
+	g_mutex_lock (&context->lock);
+	mail_folder_save_wait (context, TRUE, n_total);
+	stop = context->error != NULL ||
+		g_cancellable_is_cancelled (context->cancellable);
+	g_mutex_unlock (&context->lock);
+
+	if (stop)
+		return FALSE;
+
+	if (!m_mail_folder_writer_checkpoint (context->writer, &local_error)) {
+		g_mutex_lock (&context->lock);
+		context->error = local_error;
+		g_mutex_unlock (&context->lock);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Helper for m_mail_folder_save_messages_sync() */
+static gboolean
+mail_folder_save_report_failures (SaveContext *context,
+                                  guint n_total,
+                                  GError **error)
+{
+	GString *report;
+	gchar *path;
+	gboolean success;
+	guint ii;
+
+	path = g_build_filename (
+		m_mail_folder_writer_get_root_path (context->writer),
+		M_MAIL_FOLDER_FAILURE_REPORT, NULL);
+
+	/* Not to be confused with the report of an earlier run. */
+	if (context->failures->len == 0) {
+		g_unlink (path);
+		g_free (path);
+		return TRUE;
+	}
+
+	report = g_string_new ("# UID\tattempts\terror\n");
+
+	for (ii = 0; ii < context->failures->len; ii++) {
+		SaveFailure *failure = g_ptr_array_index (context->failures, ii);
+
+		g_string_append_printf (
+			report, "%s\t%u\t%s\n", failure->uid,
+			failure->attempts, failure->error->message);
+	}
+
+	success = g_file_set_contents (path, report->str, report->len, error);
+
+	if (success)
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			ngettext (
+			"%u message of %u could not be saved, see “%s”",
+			"%u messages of %u could not be saved, see “%s”",
+			context->failures->len),
+			context->failures->len, n_total, path);
+
+	g_string_free (report, TRUE);
+	g_free (path);
+
+	return FALSE;
+}
+
+gboolean
+m_mail_folder_save_messages_sync (CamelFolder *folder,
+                                  GPtrArray *message_uids,
+                                  GFile *destination,
+                                  const MExportOptions *options,
+                                  GCancellable *cancellable,
+                                  GError **error)
+{
+	SaveContext context;
+	GArray *order = NULL;
+	gboolean success = TRUE;
+	gint64 export_started;
+	guint connection_limit;
+	guint next_window = 0;
+	guint ii;
+
+	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), FALSE);
+	g_return_val_if_fail (message_uids != NULL, FALSE);
+	g_return_val_if_fail (G_IS_FILE (destination), FALSE);
+
+	/* Need at least one message UID to save. */
+	g_return_val_if_fail (message_uids->len > 0, FALSE);
+
+	memset (&context, 0, sizeof (SaveContext));
+
+	context.writer = m_mail_folder_writer_new (destination, options, error);
+	if (context.writer == NULL)
+		return FALSE;
+
+	/* Fail right away rather than on a full disk an hour later. */
+	if (!mail_folder_save_preflight (folder, message_uids, context.writer, cancellable, error)) {
+		m_mail_folder_writer_free (context.writer);
+		return FALSE;
+	}
+
+	context.folder = folder;
+	context.cancellable = cancellable;
+	context.trace = options != NULL ? options->trace : NULL;
+	context.cache_hints = options == NULL || options->cache_hints;
+	context.stub_threshold = options != NULL ?
+		(gsize) options->attachment_stub_threshold * 1024 : 0;
+
+	/* Stubs are the only change made to a message's content, text
+	 * parts are recoded only when it is serialized anyway. */
+	context.raw_copy = context.stub_threshold == 0;
+	context.io_priority = options != NULL ?
+		options->io_priority : M_THROTTLE_IO_PRIORITY_NORMAL;
+	context.controller = m_export_controller_new (
+		options != NULL ? options->max_workers : 0);
+
+	/* Remote stores fetch over as many connections as the account
+	 * allows, the controller still finds out whether fewer do. */
+	connection_limit = mail_folder_save_get_connection_limit (folder);
+	if (connection_limit > 0)
+		m_export_controller_set_limit (
+			context.controller, M_EXPORT_PHASE_FETCH, connection_limit);
+	context.failures = g_ptr_array_new_with_free_func (
+		(GDestroyNotify) save_failure_free);
+
+	g_mutex_init (&context.lock);
+	g_cond_init (&context.cond);
+	g_queue_init (&context.idle_buffers);
+	g_queue_init (&context.retry_queue);
+
+	/* Shared pools, whose sizes the controller adjusts as it goes. */
+	context.fetch_pool = g_thread_pool_new (
+		mail_folder_save_fetch_thread, &context,
+		m_export_controller_get_workers (
+		context.controller, M_EXPORT_PHASE_FETCH),
+		FALSE, NULL);
+	context.write_pool = g_thread_pool_new (
+		mail_folder_save_write_thread, &context,
+		m_export_controller_get_workers (
+		context.controller, M_EXPORT_PHASE_WRITE),
+		FALSE, NULL);
+
+	camel_operation_push_message (
+		cancellable, ngettext (
+			"Saving %d message",
+			"Saving %d messages",
+			message_uids->len),
+		message_uids->len);
+
+	/* Recent mail is what is wanted offline first, so the pipeline
+	 * is drained and the store made readable at every window end;
+	 * the rest of the pipeline does not care about the order. */
+	if (options != NULL && options->newest_first)
+		order = mail_folder_save_order_newest_first (folder, message_uids);
+
+	export_started = g_get_real_time () / G_USEC_PER_SEC;
+
+	for (ii = 0; ii < message_uids->len; ii++) {
+		const gchar *uid;
+		SaveTask *task;
+		gboolean stop;
+
+		if (order != NULL) {
+			SaveOrder *item = &g_array_index (order, SaveOrder, ii);
+			gboolean window_done = FALSE;
+
+			uid = item->uid;
+
+			while (next_window < G_N_ELEMENTS (save_windows) &&
+			       item->date < export_started - (gint64) save_windows[next_window] * 24 * 60 * 60) {
+				window_done = TRUE;
+				next_window++;
+			}
+
+			if (window_done && ii > 0 &&
+			    !mail_folder_save_checkpoint (&context, message_uids->len))
+				break;
+		} else {
+			uid = g_ptr_array_index (message_uids, ii);
+		}
+
+		g_mutex_lock (&context.lock);
+
+		/* Bound the number of messages held in memory. */
+		mail_folder_save_wait (&context, FALSE, message_uids->len);
+
+		stop = context.error != NULL ||
+			g_cancellable_is_cancelled (cancellable);
+		if (!stop)
+			context.n_in_flight++;
+
+		g_mutex_unlock (&context.lock);
+
+		if (stop)
+			break;
+
+		task = g_slice_new0 (SaveTask);
+		task->uid = uid;
+		task->source_fd = -1;
+
+		/* Let the kernel read the message ahead until a fetch
+		 * worker gets to it, which amounts to a sequential hint
+		 * for the descriptors Camel opens on its own. */
+		if (context.cache_hints)
+			mail_folder_save_advise_source (folder, task->uid, TRUE);
+
+		g_thread_pool_push (context.fetch_pool, task, NULL);
+	}
+
+	/* Wait for whatever is still on its way. */
+	g_mutex_lock (&context.lock);
+	mail_folder_save_wait (&context, TRUE, message_uids->len);
+	g_mutex_unlock (&context.lock);
+
+	g_thread_pool_free (context.fetch_pool, FALSE, TRUE);
+	g_thread_pool_free (context.write_pool, FALSE, TRUE);
+
+	if (order != NULL)
+		g_array_free (order, TRUE);
+
+	if (context.error != NULL) {
+		g_propagate_error (error, context.error);
+		context.error = NULL;
+		success = FALSE;
+	} else if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+		success = FALSE;
+	} else {
+		camel_operation_progress (cancellable, 100);
+	}
+
+	/* Write the indexes of whatever made it into the packs,
+	 * even when the batch failed half way through. */
+	if (!m_mail_folder_writer_close (context.writer, success ? error : NULL))
+		success = FALSE;
+
+	/* Messages which could not be saved do not hold back the
+	 * snapshot, the next one simply tries them again. */
+	if (success && !m_mail_folder_writer_publish (context.writer, error))
+		success = FALSE;
+
+	/* Whatever was saved stays, only the failed messages are
+	 * listed, so that a partial export needs no starting over. */
+	if (success && !mail_folder_save_report_failures (&context, message_uids->len, error))
+		success = FALSE;
+
+	m_mail_folder_writer_free (context.writer);
+	m_export_controller_free (context.controller);
+	g_ptr_array_unref (context.failures);
+
+	while (!g_queue_is_empty (&context.idle_buffers))
+		save_buffer_free (g_queue_pop_head (&context.idle_buffers));
+
+	g_mutex_clear (&context.lock);
+	g_cond_clear (&context.cond);
+
+	camel_operation_pop_message (cancellable);
+
+	return success;
+}
+
+/* Helper for m_mail_folder_sync_messages_sync() */
+static gchar *
+mail_folder_sync_dup_state_path (GFile *destination,
+                                 const MExportOptions *options)
+{
+	gchar *root_path, *latest;
+
+	root_path = g_file_get_path (destination);
+	if (root_path == NULL || options == NULL || !options->snapshots)
+		return root_path;
+
+	/* Snapshot mode keeps the digest with the latest snapshot,
+	 * a destination without one yet has nothing to compare. */
+	latest = g_build_filename (root_path, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+	g_free (root_path);
+
+	return latest;
+}
+
+/**
+ * m_mail_folder_sync_messages_sync:
+ * @folder: a #CamelFolder
+ * @destination: root of the offline store
+ * @options: (nullable): an #MExportOptions, or %NULL for defaults
+ * @out_unchanged: (out) (optional): return location for whether
+ *    @folder was found unchanged and skipped
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Brings the offline store at @destination up to date with the
+ * messages of @folder and their flags.  Messages deleted from @folder
+ * are not deleted from the store, which keeps them just like later
+ * snapshots do.
+ *
+ * The stamp of the folder, where its store keeps one, is compared
+ * with the one saved by the previous sync first, and an equal stamp
+ * ends the sync without walking the summary.  Otherwise the digest
+ * of the folder summary is compared: a folder which did not change
+ * is not looked at any further, and of one which did, only the UID
+ * ranges which changed are exported again.  A new snapshot always
+ * gets the whole folder, whose unchanged messages cost a hardlink
+ * each.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_folder_sync_messages_sync (CamelFolder *folder,
+                                  GFile *destination,
+                                  const MExportOptions *options,
+                                  gboolean *out_unchanged,
+                                  GCancellable *cancellable,
+                                  GError **error)
+{
+	MFolderDigest *digest = NULL, *previous = NULL;
+	GPtrArray *uids = NULL, *changed_uids = NULL;
+	gchar *state_path, *stamp;
+	gboolean success = TRUE;
+
+	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), FALSE);
+	g_return_val_if_fail (G_IS_FILE (destination), FALSE);
+
+	if (out_unchanged != NULL)
+		*out_unchanged = FALSE;
+
+	/* Before the UIDs, so that a change while exporting
+	 * shows in the stamp of the next run. */
+	stamp = m_folder_digest_dup_stamp (folder);
+
+	state_path = mail_folder_sync_dup_state_path (destination, options);
+	if (state_path != NULL)
+		previous = m_folder_digest_load (state_path, NULL);
+
+	if (previous != NULL && stamp != NULL &&
+	    g_strcmp0 (stamp, m_folder_digest_get_stamp (previous)) == 0) {
+		if (out_unchanged != NULL)
+			*out_unchanged = TRUE;
+		goto exit;
+	}
+
+	uids = camel_folder_get_uids (folder);
+	digest = m_folder_digest_new (folder, uids);
+	m_folder_digest_set_stamp (digest, stamp);
+
+	if (previous != NULL && m_folder_digest_equal (digest, previous)) {
+		if (out_unchanged != NULL)
+			*out_unchanged = TRUE;
+
+		/* Say so without a walk next time. */
+		if (g_strcmp0 (stamp, m_folder_digest_get_stamp (previous)) != 0 &&
+		    !m_folder_digest_save (digest, state_path, error))
+			success = FALSE;
+
+		goto exit;
+	}
+
+	if (previous != NULL && (options == NULL || !options->snapshots))
+		changed_uids = m_folder_digest_dup_changed_uids (digest, previous);
+
+	if (changed_uids != NULL && changed_uids->len > 0)
+		success = m_mail_folder_save_messages_sync (
+			folder, changed_uids, destination, options,
+			cancellable, error);
+	else if (changed_uids == NULL && uids->len > 0)
+		success = m_mail_folder_save_messages_sync (
+			folder, uids, destination, options,
+			cancellable, error);
+
+	/* Only once every message made it, or the next sync would
+	 * skip those that did not.  An empty folder may have left
+	 * no store, or no snapshot, to keep the digest with. */
+	if (success && state_path != NULL &&
+	    g_file_test (state_path, G_FILE_TEST_IS_DIR) &&
+	    !m_folder_digest_save (digest, state_path, error))
+		success = FALSE;
+
+exit:
+	if (changed_uids != NULL)
+		g_ptr_array_unref (changed_uids);
+
+	m_folder_digest_free (previous);
+	m_folder_digest_free (digest);
+	if (uids != NULL)
+		camel_folder_free_uids (folder, uids);
+	g_free (state_path);
+	g_free (stamp);
+
 	return success;
 }
 
@@ -276,6 +3142,7 @@ void
 m_mail_folder_save_messages_in_maildir (CamelFolder *folder,
 					GPtrArray *message_uids,
 					GFile *destination,
+					const MExportOptions *options,
 					gint io_priority,
 					GCancellable *cancellable,
 					GAsyncReadyCallback callback,
@@ -294,6 +3161,8 @@ m_mail_folder_save_messages_in_maildir (CamelFolder *folder,
 	context = g_slice_new0 (AsyncContext);
 	context->ptr_array = g_ptr_array_ref (message_uids);
 	context->destination = g_object_ref (destination);
+	context->options = options != NULL ?
+		m_export_options_copy (options) : m_export_options_new ();
 
 	simple = g_simple_async_result_new (
 		G_OBJECT (folder), callback, user_data,
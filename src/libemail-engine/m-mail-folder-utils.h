@@ -5,22 +5,83 @@
 
 #include <camel/camel.h>
 
+#include "m-export-options.h"
+
 G_BEGIN_DECLS
 
+/* Name of the link pointing at the newest snapshot. */
+#define M_MAIL_FOLDER_SNAPSHOT_LATEST "latest"
+
+/* Lists the messages an export could not save, next to them. */
+#define M_MAIL_FOLDER_FAILURE_REPORT "export-failures.txt"
+
+/* Delivers serialized messages into the offline store. */
+typedef struct _MMailFolderWriter MMailFolderWriter;
+
+MMailFolderWriter *
+		m_mail_folder_writer_new	(GFile *destination,
+						 const MExportOptions *options,
+						 GError **error);
+const gchar *	m_mail_folder_writer_get_root_path
+						(MMailFolderWriter *writer);
+gboolean	m_mail_folder_writer_wants_pack	(MMailFolderWriter *writer,
+						 gint64 date);
+gboolean	m_mail_folder_writer_write	(MMailFolderWriter *writer,
+						 const gchar *uid,
+						 gint64 date,
+						 guint32 flags,
+						 const guint8 *data,
+						 gsize length,
+						 GCancellable *cancellable,
+						 GError **error);
+gboolean	m_mail_folder_writer_copy	(MMailFolderWriter *writer,
+						 const gchar *uid,
+						 gint64 date,
+						 guint32 flags,
+						 gint source_fd,
+						 gsize length,
+						 GCancellable *cancellable,
+						 GError **error);
+gboolean	m_mail_folder_writer_has_previous
+						(MMailFolderWriter *writer,
+						 const gchar *uid,
+						 gint64 date);
+gboolean	m_mail_folder_writer_link_unchanged
+						(MMailFolderWriter *writer,
+						 const gchar *uid,
+						 gint64 date,
+						 guint32 flags);
+gboolean	m_mail_folder_writer_checkpoint	(MMailFolderWriter *writer,
+						 GError **error);
+gboolean	m_mail_folder_writer_close	(MMailFolderWriter *writer,
+						 GError **error);
+gboolean	m_mail_folder_writer_publish	(MMailFolderWriter *writer,
+						 GError **error);
+void		m_mail_folder_writer_free	(MMailFolderWriter *writer);
+
 gboolean	m_mail_folder_save_messages_sync
 						(CamelFolder *folder,
 						 GPtrArray *message_uids,
 						 GFile *destination,
+						 const MExportOptions *options,
 						 GCancellable *cancellable,
 						 GError **error);
 void		m_mail_folder_save_messages_in_maildir
 						(CamelFolder *folder,
 						 GPtrArray *message_uids,
 						 GFile *destination,
+						 const MExportOptions *options,
 						 gint io_priority,
 						 GCancellable *cancellable,
 						 GAsyncReadyCallback callback,
 						 gpointer user_data);
+gboolean	m_mail_folder_sync_messages_sync
+						(CamelFolder *folder,
+						 GFile *destination,
+						 const MExportOptions *options,
+						 gboolean *out_unchanged,
+						 GCancellable *cancellable,
+						 GError **error);
 gboolean	m_mail_folder_save_messages_finish
 						(CamelFolder *folder,
 						 GAsyncResult *result,
@@ -0,0 +1,1031 @@
+#include "config.h"
+
+#include "m-mail-pack.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+
+#define PACK_MAGIC		"EOSPACK1"
+#define PACK_INDEX_MAGIC	"EOSPIDX1"
+#define PACK_MAGIC_LEN		8
+
+/* index offset (8) + number of entries (4) + index magic (8) */
+#define PACK_FOOTER_LEN		(8 + 4 + PACK_MAGIC_LEN)
+
+/* How much of a pack is read at once while looking for the last
+ * complete index, after the process died before writing a new one. */
+#define PACK_RECOVER_CHUNK	(64 * 1024)
+
+typedef struct _PackEntry PackEntry;
+
+struct _PackEntry {
+	gchar *uid;
+	guint64 offset;
+	guint32 compressed_length;
+	guint32 length;
+	guint32 flags;
+	gint64 date;
+};
+
+struct _MMailPack {
+	gchar *filename;
+	gint fd;
+	gboolean writable;
+	gboolean dirty;
+
+	/* End of the last index written, or of the data added since,
+	 * which is where the next message or index goes.  An index is
+	 * never overwritten, it stays valid until a newer one is on the
+	 * disk, and becomes dead space after that. */
+	guint64 data_end;
+
+	GArray *entries;	/* PackEntry */
+	GHashTable *uid_index;	/* uid ~> entry position + 1 */
+};
+
+static void
+pack_entry_clear (gpointer data)
+{
+	PackEntry *entry = data;
+
+	g_free (entry->uid);
+}
+
+static void
+mail_pack_set_errno_error (GError **error,
+			   const gchar *filename,
+			   gint errsv)
+{
+	g_set_error (
+		error, G_IO_ERROR,
+		g_io_error_from_errno (errsv),
+		_("Failed to access message pack “%s”: %s"),
+		filename, g_strerror (errsv));
+}
+
+static void
+mail_pack_set_corrupt_error (GError **error,
+			     const gchar *filename)
+{
+	g_set_error (
+		error, G_IO_ERROR,
+		G_IO_ERROR_INVALID_DATA,
+		_("Message pack “%s” is corrupt"),
+		filename);
+}
+
+static gboolean
+mail_pack_pread_all (MMailPack *pack,
+		     gpointer buffer,
+		     gsize count,
+		     guint64 offset,
+		     GError **error)
+{
+	guint8 *ptr = buffer;
+
+	while (count > 0) {
+		gssize n_read;
+
+		n_read = pread (pack->fd, ptr, count, offset);
+		if (n_read < 0) {
+			if (errno == EINTR)
+				continue;
+			mail_pack_set_errno_error (error, pack->filename, errno);
+			return FALSE;
+		}
+
+		if (n_read == 0) {
+			mail_pack_set_corrupt_error (error, pack->filename);
+			return FALSE;
+		}
+
+		ptr += n_read;
+		count -= n_read;
+		offset += n_read;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+mail_pack_pwrite_all (MMailPack *pack,
+		      gconstpointer buffer,
+		      gsize count,
+		      guint64 offset,
+		      GError **error)
+{
+	const guint8 *ptr = buffer;
+
+	while (count > 0) {
+		gssize n_written;
+
+		n_written = pwrite (pack->fd, ptr, count, offset);
+		if (n_written < 0) {
+			if (errno == EINTR)
+				continue;
+			mail_pack_set_errno_error (error, pack->filename, errno);
+			return FALSE;
+		}
+
+		ptr += n_written;
+		count -= n_written;
+		offset += n_written;
+	}
+
+	return TRUE;
+}
+
+static void
+mail_pack_put_uint16 (GByteArray *array,
+		      guint16 value)
+{
+	value = GUINT16_TO_LE (value);
+	g_byte_array_append (array, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+mail_pack_put_uint32 (GByteArray *array,
+		      guint32 value)
+{
+	value = GUINT32_TO_LE (value);
+	g_byte_array_append (array, (const guint8 *) &value, sizeof (value));
+}
+
+static void
+mail_pack_put_uint64 (GByteArray *array,
+		      guint64 value)
+{
+	value = GUINT64_TO_LE (value);
+	g_byte_array_append (array, (const guint8 *) &value, sizeof (value));
+}
+
+static guint16
+mail_pack_get_uint16 (const guint8 *ptr)
+{
+	guint16 value;
+
+	memcpy (&value, ptr, sizeof (value));
+
+	return GUINT16_FROM_LE (value);
+}
+
+static guint32
+mail_pack_get_uint32 (const guint8 *ptr)
+{
+	guint32 value;
+
+	memcpy (&value, ptr, sizeof (value));
+
+	return GUINT32_FROM_LE (value);
+}
+
+static guint64
+mail_pack_get_uint64 (const guint8 *ptr)
+{
+	guint64 value;
+
+	memcpy (&value, ptr, sizeof (value));
+
+	return GUINT64_FROM_LE (value);
+}
+
+static void
+mail_pack_insert_entry (MMailPack *pack,
+			PackEntry *entry)
+{
+	g_array_append_vals (pack->entries, entry, 1);
+
+	g_hash_table_insert (
+		pack->uid_index, entry->uid,
+		GUINT_TO_POINTER (pack->entries->len));
+}
+
+static PackEntry *
+mail_pack_lookup (MMailPack *pack,
+		  const gchar *uid)
+{
+	guint position;
+
+	position = GPOINTER_TO_UINT (g_hash_table_lookup (pack->uid_index, uid));
+	if (position == 0)
+		return NULL;
+
+	return &g_array_index (pack->entries, PackEntry, position - 1);
+}
+
+static void
+mail_pack_clear_entries (MMailPack *pack)
+{
+	/* The keys belong to the entries, so they go first. */
+	g_hash_table_remove_all (pack->uid_index);
+	g_array_set_size (pack->entries, 0);
+}
+
+/* Helper for mail_pack_load_index() */
+static gboolean
+mail_pack_load_index_at (MMailPack *pack,
+			 guint64 footer_end,
+			 GError **error)
+{
+	guint8 footer[PACK_FOOTER_LEN];
+	guint8 *index, *ptr, *end;
+	guint64 index_offset, footer_offset;
+	guint32 n_entries, ii;
+
+	if (footer_end < PACK_MAGIC_LEN + PACK_FOOTER_LEN) {
+		mail_pack_set_corrupt_error (error, pack->filename);
+		return FALSE;
+	}
+
+	footer_offset = footer_end - PACK_FOOTER_LEN;
+
+	if (!mail_pack_pread_all (pack, footer, PACK_FOOTER_LEN, footer_offset, error))
+		return FALSE;
+
+	if (memcmp (footer + 12, PACK_INDEX_MAGIC, PACK_MAGIC_LEN) != 0) {
+		mail_pack_set_corrupt_error (error, pack->filename);
+		return FALSE;
+	}
+
+	index_offset = mail_pack_get_uint64 (footer);
+	n_entries = mail_pack_get_uint32 (footer + 8);
+
+	if (index_offset < PACK_MAGIC_LEN || index_offset > footer_offset) {
+		mail_pack_set_corrupt_error (error, pack->filename);
+		return FALSE;
+	}
+
+	index = g_malloc (footer_offset - index_offset + 1);
+	if (!mail_pack_pread_all (pack, index, footer_offset - index_offset, index_offset, error)) {
+		g_free (index);
+		return FALSE;
+	}
+
+	ptr = index;
+	end = index + (footer_offset - index_offset);
+
+	/* offset (8) + lengths (4 + 4) + flags (4) + date (8) + uid length (2) */
+	for (ii = 0; ii < n_entries; ii++) {
+		PackEntry entry;
+		guint16 uid_len;
+
+		if (end - ptr < 30)
+			break;
+
+		entry.offset = mail_pack_get_uint64 (ptr);
+		entry.compressed_length = mail_pack_get_uint32 (ptr + 8);
+		entry.length = mail_pack_get_uint32 (ptr + 12);
+		entry.flags = mail_pack_get_uint32 (ptr + 16);
+		entry.date = (gint64) mail_pack_get_uint64 (ptr + 20);
+		uid_len = mail_pack_get_uint16 (ptr + 28);
+		ptr += 30;
+
+		if (end - ptr < uid_len ||
+		    entry.offset < PACK_MAGIC_LEN ||
+		    entry.offset + entry.compressed_length > index_offset)
+			break;
+
+		entry.uid = g_strndup ((const gchar *) ptr, uid_len);
+		ptr += uid_len;
+
+		mail_pack_insert_entry (pack, &entry);
+	}
+
+	g_free (index);
+
+	/* The index has to fill the space up to its footer exactly. */
+	if (ii < n_entries || ptr != end) {
+		mail_pack_clear_entries (pack);
+		mail_pack_set_corrupt_error (error, pack->filename);
+		return FALSE;
+	}
+
+	pack->data_end = footer_end;
+
+	return TRUE;
+}
+
+/* Helper for mail_pack_load_index() */
+static gboolean
+mail_pack_recover_index (MMailPack *pack,
+			 guint64 file_size)
+{
+	guint8 *chunk;
+	guint64 chunk_end = file_size;
+	gboolean found = FALSE;
+
+	chunk = g_malloc (PACK_RECOVER_CHUNK + PACK_MAGIC_LEN);
+
+	/* Backwards from the end, for the newest footer whose index is
+	 * complete.  Chunks overlap by the magic, less one byte, so that
+	 * a magic on a chunk border is seen exactly once. */
+	while (!found && chunk_end > PACK_MAGIC_LEN) {
+		guint64 start, end;
+		gsize ii;
+
+		start = chunk_end - MIN (chunk_end - PACK_MAGIC_LEN, PACK_RECOVER_CHUNK);
+		end = MIN (chunk_end + PACK_MAGIC_LEN - 1, file_size);
+
+		if (!mail_pack_pread_all (pack, chunk, end - start, start, NULL))
+			break;
+
+		for (ii = end - start; !found && ii >= PACK_MAGIC_LEN; ii--) {
+			if (memcmp (chunk + ii - PACK_MAGIC_LEN, PACK_INDEX_MAGIC, PACK_MAGIC_LEN) == 0)
+				found = mail_pack_load_index_at (pack, start + ii, NULL);
+		}
+
+		chunk_end = start;
+	}
+
+	g_free (chunk);
+
+	return found;
+}
+
+static gboolean
+mail_pack_load_index (MMailPack *pack,
+		      guint64 file_size,
+		      GError **error)
+{
+	GError *local_error = NULL;
+
+	if (mail_pack_load_index_at (pack, file_size, &local_error))
+		return TRUE;
+
+	/* Messages added after the last index, or an index cut short,
+	 * are lost when the process dies before closing the pack, but
+	 * the messages of the index before are not. */
+	if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA) &&
+	    mail_pack_recover_index (pack, file_size)) {
+		g_error_free (local_error);
+		return TRUE;
+	}
+
+	g_propagate_error (error, local_error);
+
+	return FALSE;
+}
+
+/**
+ * m_mail_pack_build_name:
+ * @date: a message date, as a Unix time
+ *
+ * Returns: (transfer full): the base name of the pack holding messages
+ *    from the month of @date, like "2019-04.pack"
+ **/
+gchar *
+m_mail_pack_build_name (gint64 date)
+{
+	GDateTime *dt;
+	gchar *name;
+
+	dt = g_date_time_new_from_unix_utc (date);
+	if (dt == NULL)
+		return g_strdup ("0000-00.pack");
+
+	name = g_date_time_format (dt, "%Y-%m.pack");
+	g_date_time_unref (dt);
+
+	return name;
+}
+
+/**
+ * m_mail_pack_open:
+ * @filename: path of the pack file
+ * @writable: whether messages will be added to the pack
+ * @error: return location for a #GError, or %NULL
+ *
+ * Opens an existing pack, or creates an empty one when @writable
+ * is %TRUE and @filename does not exist yet.  Only the index is read.
+ *
+ * Returns: (transfer full): a new #MMailPack, or %NULL on error
+ **/
+MMailPack *
+m_mail_pack_open (const gchar *filename,
+		  gboolean writable,
+		  GError **error)
+{
+	MMailPack *pack;
+	struct stat st;
+	gint flags;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+
+	flags = O_CLOEXEC;
+	flags |= writable ? (O_RDWR | O_CREAT) : O_RDONLY;
+
+	pack = g_slice_new0 (MMailPack);
+	pack->filename = g_strdup (filename);
+	pack->writable = writable;
+	pack->entries = g_array_new (FALSE, FALSE, sizeof (PackEntry));
+	g_array_set_clear_func (pack->entries, pack_entry_clear);
+	pack->uid_index = g_hash_table_new (g_str_hash, g_str_equal);
+
+	pack->fd = g_open (filename, flags, 0600);
+	if (pack->fd == -1) {
+		mail_pack_set_errno_error (error, filename, errno);
+		m_mail_pack_free (pack);
+		return NULL;
+	}
+
+	if (fstat (pack->fd, &st) == -1) {
+		mail_pack_set_errno_error (error, filename, errno);
+		m_mail_pack_free (pack);
+		return NULL;
+	}
+
+	if (st.st_size == 0 && writable) {
+		if (!mail_pack_pwrite_all (pack, PACK_MAGIC, PACK_MAGIC_LEN, 0, error)) {
+			m_mail_pack_free (pack);
+			return NULL;
+		}
+
+		pack->data_end = PACK_MAGIC_LEN;
+		pack->dirty = TRUE;
+
+		/* An empty index right away, for the pack to have one
+		 * to fall back to from the very first message on. */
+		if (!m_mail_pack_close (pack, error)) {
+			m_mail_pack_free (pack);
+			return NULL;
+		}
+
+		return pack;
+	}
+
+	if (!mail_pack_load_index (pack, st.st_size, error)) {
+		m_mail_pack_free (pack);
+		return NULL;
+	}
+
+	return pack;
+}
+
+const gchar *
+m_mail_pack_get_filename (MMailPack *pack)
+{
+	g_return_val_if_fail (pack != NULL, NULL);
+
+	return pack->filename;
+}
+
+guint
+m_mail_pack_get_n_messages (MMailPack *pack)
+{
+	g_return_val_if_fail (pack != NULL, 0);
+
+	return pack->entries->len;
+}
+
+gboolean
+m_mail_pack_contains (MMailPack *pack,
+		      const gchar *uid)
+{
+	g_return_val_if_fail (pack != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	return mail_pack_lookup (pack, uid) != NULL;
+}
+
+/**
+ * m_mail_pack_get_flags:
+ * @pack: an #MMailPack
+ * @uid: the message UID
+ * @out_flags: (out): return location for the message flags
+ *
+ * Looks up the flags recorded for @uid without reading the message.
+ *
+ * Returns: %TRUE if @uid is in @pack, %FALSE otherwise
+ **/
+gboolean
+m_mail_pack_get_flags (MMailPack *pack,
+		       const gchar *uid,
+		       guint32 *out_flags)
+{
+	PackEntry *entry;
+
+	g_return_val_if_fail (pack != NULL, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+	g_return_val_if_fail (out_flags != NULL, FALSE);
+
+	entry = mail_pack_lookup (pack, uid);
+	if (entry == NULL)
+		return FALSE;
+
+	*out_flags = entry->flags;
+
+	return TRUE;
+}
+
+static GByteArray *
+mail_pack_deflate (const guint8 *data,
+		   gsize length,
+		   GError **error)
+{
+	GConverter *compressor;
+	GByteArray *out;
+	gsize in_pos = 0, out_pos = 0;
+
+	compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW, -1));
+
+	out = g_byte_array_new ();
+	g_byte_array_set_size (out, MAX (length + length / 8 + 128, 256));
+
+	while (TRUE) {
+		GConverterResult result;
+		GError *local_error = NULL;
+		gsize bytes_read = 0, bytes_written = 0;
+
+		result = g_converter_convert (
+			compressor,
+			data + in_pos, length - in_pos,
+			out->data + out_pos, out->len - out_pos,
+			G_CONVERTER_INPUT_AT_END,
+			&bytes_read, &bytes_written, &local_error);
+
+		if (result == G_CONVERTER_ERROR) {
+			if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NO_SPACE)) {
+				g_clear_error (&local_error);
+				g_byte_array_set_size (out, out->len * 2);
+				continue;
+			}
+
+			g_propagate_error (error, local_error);
+			g_byte_array_free (out, TRUE);
+			out = NULL;
+			break;
+		}
+
+		in_pos += bytes_read;
+		out_pos += bytes_written;
+
+		if (result == G_CONVERTER_FINISHED) {
+			g_byte_array_set_size (out, out_pos);
+			break;
+		}
+
+		if (out_pos == out->len)
+			g_byte_array_set_size (out, out->len * 2);
+	}
+
+	g_object_unref (compressor);
+
+	return out;
+}
+
+static GBytes *
+mail_pack_inflate (MMailPack *pack,
+		   const guint8 *data,
+		   gsize compressed_length,
+		   gsize length,
+		   GError **error)
+{
+	GConverter *decompressor;
+	guint8 *out;
+	gsize in_pos = 0, out_pos = 0;
+
+	if (length == 0)
+		return g_bytes_new (NULL, 0);
+
+	decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_RAW));
+	out = g_malloc (length);
+
+	while (TRUE) {
+		GConverterResult result;
+		gsize bytes_read = 0, bytes_written = 0;
+
+		result = g_converter_convert (
+			decompressor,
+			data + in_pos, compressed_length - in_pos,
+			out + out_pos, length - out_pos,
+			G_CONVERTER_INPUT_AT_END,
+			&bytes_read, &bytes_written, error);
+
+		if (result == G_CONVERTER_ERROR) {
+			g_clear_pointer (&out, g_free);
+			break;
+		}
+
+		in_pos += bytes_read;
+		out_pos += bytes_written;
+
+		if (result == G_CONVERTER_FINISHED)
+			break;
+
+		if (bytes_read == 0 && bytes_written == 0) {
+			mail_pack_set_corrupt_error (error, pack->filename);
+			g_clear_pointer (&out, g_free);
+			break;
+		}
+	}
+
+	g_object_unref (decompressor);
+
+	if (out == NULL)
+		return NULL;
+
+	if (out_pos != length) {
+		mail_pack_set_corrupt_error (error, pack->filename);
+		g_free (out);
+		return NULL;
+	}
+
+	return g_bytes_new_take (out, length);
+}
+
+/**
+ * m_mail_pack_compress:
+ * @uid: the message UID
+ * @data: the raw RFC 822 message
+ * @length: length of @data
+ * @error: return location for a #GError, or %NULL
+ *
+ * Compresses @data the way packs store it, for m_mail_pack_append().
+ * Needs no pack, so that several threads can compress messages for
+ * the same pack at once and take turns only to append them.
+ *
+ * Returns: (transfer full): the compressed message, or %NULL on error
+ **/
+GBytes *
+m_mail_pack_compress (const gchar *uid,
+		      const guint8 *data,
+		      gsize length,
+		      GError **error)
+{
+	GByteArray *compressed;
+
+	g_return_val_if_fail (uid != NULL, NULL);
+	g_return_val_if_fail (data != NULL || length == 0, NULL);
+
+	if (length > G_MAXUINT32) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Message “%s” is too large to be packed"), uid);
+		return NULL;
+	}
+
+	compressed = mail_pack_deflate (data, length, error);
+	if (compressed == NULL)
+		return NULL;
+
+	return g_byte_array_free_to_bytes (compressed);
+}
+
+/* Helper for m_mail_pack_add() */
+static gboolean
+mail_pack_update_flags (MMailPack *pack,
+			const gchar *uid,
+			guint32 flags)
+{
+	PackEntry *existing;
+
+	existing = mail_pack_lookup (pack, uid);
+	if (existing == NULL)
+		return FALSE;
+
+	if (existing->flags != flags) {
+		existing->flags = flags;
+		pack->dirty = TRUE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * m_mail_pack_append:
+ * @pack: an #MMailPack opened as writable
+ * @uid: the message UID
+ * @flags: #CamelMessageFlags of the message
+ * @date: the message date, as a Unix time
+ * @compressed: the message from m_mail_pack_compress()
+ * @length: length of the message before it was compressed
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Appends a compressed message to @pack.  If @uid is already in the
+ * pack, only its flags are updated.  The index is not written until
+ * m_mail_pack_close() is called.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_pack_append (MMailPack *pack,
+		    const gchar *uid,
+		    guint32 flags,
+		    gint64 date,
+		    GBytes *compressed,
+		    gsize length,
+		    GCancellable *cancellable,
+		    GError **error)
+{
+	PackEntry entry;
+	gconstpointer data;
+	gsize compressed_length;
+
+	g_return_val_if_fail (pack != NULL, FALSE);
+	g_return_val_if_fail (pack->writable, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+	g_return_val_if_fail (compressed != NULL, FALSE);
+	g_return_val_if_fail (length <= G_MAXUINT32, FALSE);
+
+	if (g_cancellable_set_error_if_cancelled (cancellable, error))
+		return FALSE;
+
+	if (mail_pack_update_flags (pack, uid, flags))
+		return TRUE;
+
+	data = g_bytes_get_data (compressed, &compressed_length);
+
+	if (!mail_pack_pwrite_all (pack, data, compressed_length, pack->data_end, error))
+		return FALSE;
+
+	entry.uid = g_strdup (uid);
+	entry.offset = pack->data_end;
+	entry.compressed_length = compressed_length;
+	entry.length = length;
+	entry.flags = flags;
+	entry.date = date;
+
+	pack->data_end += compressed_length;
+	pack->dirty = TRUE;
+
+	mail_pack_insert_entry (pack, &entry);
+
+	return TRUE;
+}
+
+/**
+ * m_mail_pack_add:
+ * @pack: an #MMailPack opened as writable
+ * @uid: the message UID
+ * @flags: #CamelMessageFlags of the message
+ * @date: the message date, as a Unix time
+ * @data: the raw RFC 822 message
+ * @length: length of @data
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Compresses @data and appends it to @pack.  If @uid is already in
+ * the pack, only its flags are updated, and @data may be %NULL.  The
+ * index is not written until m_mail_pack_close() is called.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_pack_add (MMailPack *pack,
+		 const gchar *uid,
+		 guint32 flags,
+		 gint64 date,
+		 const guint8 *data,
+		 gsize length,
+		 GCancellable *cancellable,
+		 GError **error)
+{
+	GBytes *compressed;
+	gboolean success;
+
+	g_return_val_if_fail (pack != NULL, FALSE);
+	g_return_val_if_fail (pack->writable, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	if (g_cancellable_set_error_if_cancelled (cancellable, error))
+		return FALSE;
+
+	if (mail_pack_update_flags (pack, uid, flags))
+		return TRUE;
+
+	compressed = m_mail_pack_compress (uid, data, length, error);
+	if (compressed == NULL)
+		return FALSE;
+
+	success = m_mail_pack_append (
+		pack, uid, flags, date, compressed, length,
+		cancellable, error);
+
+	g_bytes_unref (compressed);
+
+	return success;
+}
+
+/**
+ * m_mail_pack_remove:
+ * @pack: an #MMailPack opened as writable
+ * @uid: the message UID
+ *
+ * Drops @uid from the index of @pack.  The compressed message stays
+ * where it is as dead space, packs are never rewritten in place.  The
+ * index is not written until m_mail_pack_close() is called.
+ *
+ * Returns: whether @uid was in @pack
+ **/
+gboolean
+m_mail_pack_remove (MMailPack *pack,
+		    const gchar *uid)
+{
+	guint position;
+
+	g_return_val_if_fail (pack != NULL, FALSE);
+	g_return_val_if_fail (pack->writable, FALSE);
+	g_return_val_if_fail (uid != NULL, FALSE);
+
+	position = GPOINTER_TO_UINT (g_hash_table_lookup (pack->uid_index, uid));
+	if (position == 0)
+		return FALSE;
+
+	/* The key is the entry's UID, which goes with the entry. */
+	g_hash_table_remove (pack->uid_index, uid);
+
+	/* The last entry takes its place, so only that one moves. */
+	g_array_remove_index_fast (pack->entries, position - 1);
+
+	if (position - 1 < pack->entries->len) {
+		PackEntry *moved = &g_array_index (pack->entries, PackEntry, position - 1);
+
+		g_hash_table_insert (pack->uid_index, moved->uid, GUINT_TO_POINTER (position));
+	}
+
+	pack->dirty = TRUE;
+
+	return TRUE;
+}
+
+/**
+ * m_mail_pack_read:
+ * @pack: an #MMailPack
+ * @uid: the message UID
+ * @out_flags: (out) (optional): return location for the message flags
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Reads and decompresses a single message from @pack.
+ *
+ * Returns: (transfer full): the raw message, or %NULL on error
+ **/
+GBytes *
+m_mail_pack_read (MMailPack *pack,
+		  const gchar *uid,
+		  guint32 *out_flags,
+		  GCancellable *cancellable,
+		  GError **error)
+{
+	PackEntry *entry;
+	guint8 *compressed;
+	GBytes *bytes;
+
+	g_return_val_if_fail (pack != NULL, NULL);
+	g_return_val_if_fail (uid != NULL, NULL);
+
+	if (g_cancellable_set_error_if_cancelled (cancellable, error))
+		return NULL;
+
+	entry = mail_pack_lookup (pack, uid);
+	if (entry == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+			_("Message “%s” not found in pack “%s”"),
+			uid, pack->filename);
+		return NULL;
+	}
+
+	compressed = g_malloc (entry->compressed_length + 1);
+
+	if (!mail_pack_pread_all (pack, compressed, entry->compressed_length, entry->offset, error)) {
+		g_free (compressed);
+		return NULL;
+	}
+
+	bytes = mail_pack_inflate (pack, compressed, entry->compressed_length, entry->length, error);
+
+	g_free (compressed);
+
+	if (bytes != NULL && out_flags != NULL)
+		*out_flags = entry->flags;
+
+	return bytes;
+}
+
+/**
+ * m_mail_pack_foreach:
+ * @pack: an #MMailPack
+ * @func: function to call for each message
+ * @user_data: data to pass to @func
+ *
+ * Calls @func for every message in @pack, in the order they were
+ * added, until @func returns %FALSE.
+ **/
+void
+m_mail_pack_foreach (MMailPack *pack,
+		     MMailPackForeachFunc func,
+		     gpointer user_data)
+{
+	guint ii;
+
+	g_return_if_fail (pack != NULL);
+	g_return_if_fail (func != NULL);
+
+	for (ii = 0; ii < pack->entries->len; ii++) {
+		PackEntry *entry = &g_array_index (pack->entries, PackEntry, ii);
+
+		if (!func (pack, entry->uid, entry->flags, entry->date, user_data))
+			break;
+	}
+}
+
+/**
+ * m_mail_pack_close:
+ * @pack: an #MMailPack
+ * @error: return location for a #GError, or %NULL
+ *
+ * Appends a new index and footer to a modified pack and syncs it to
+ * disk.  Earlier indexes are never overwritten, so the pack stays
+ * readable whenever the process dies.  More messages may be added
+ * and the pack closed again; it still needs to be freed with
+ * m_mail_pack_free().
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mail_pack_close (MMailPack *pack,
+		   GError **error)
+{
+	GByteArray *index;
+	gboolean success;
+	guint ii;
+
+	g_return_val_if_fail (pack != NULL, FALSE);
+
+	if (!pack->writable || !pack->dirty || pack->fd == -1)
+		return TRUE;
+
+	index = g_byte_array_new ();
+
+	for (ii = 0; ii < pack->entries->len; ii++) {
+		PackEntry *entry = &g_array_index (pack->entries, PackEntry, ii);
+		gsize uid_len = MIN (strlen (entry->uid), G_MAXUINT16);
+
+		mail_pack_put_uint64 (index, entry->offset);
+		mail_pack_put_uint32 (index, entry->compressed_length);
+		mail_pack_put_uint32 (index, entry->length);
+		mail_pack_put_uint32 (index, entry->flags);
+		mail_pack_put_uint64 (index, (guint64) entry->date);
+		mail_pack_put_uint16 (index, uid_len);
+		g_byte_array_append (index, (const guint8 *) entry->uid, uid_len);
+	}
+
+	mail_pack_put_uint64 (index, pack->data_end);
+	mail_pack_put_uint32 (index, pack->entries->len);
+	g_byte_array_append (index, (const guint8 *) PACK_INDEX_MAGIC, PACK_MAGIC_LEN);
+
+	/* After everything written so far, the previous index included,
+	 * which stays valid until this one made it to the disk. */
+	success = mail_pack_pwrite_all (pack, index->data, index->len, pack->data_end, error);
+
+	/* Drops whatever a crashed run left after the last index. */
+	if (success && ftruncate (pack->fd, pack->data_end + index->len) == -1) {
+		mail_pack_set_errno_error (error, pack->filename, errno);
+		success = FALSE;
+	}
+
+	if (success && fsync (pack->fd) == -1) {
+		mail_pack_set_errno_error (error, pack->filename, errno);
+		success = FALSE;
+	}
+
+#ifdef HAVE_POSIX_FADVISE
+	/* Packs hold the cold messages, there is no point in keeping
+	 * them in the page cache once they are safely on the disk. */
+	if (success)
+		posix_fadvise (pack->fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+	if (success) {
+		pack->data_end += index->len;
+		pack->dirty = FALSE;
+	}
+
+	g_byte_array_free (index, TRUE);
+
+	return success;
+}
+
+void
+m_mail_pack_free (MMailPack *pack)
+{
+	if (pack == NULL)
+		return;
+
+	if (pack->fd != -1)
+		close (pack->fd);
+
+	g_hash_table_destroy (pack->uid_index);
+	g_array_free (pack->entries, TRUE);
+	g_free (pack->filename);
+
+	g_slice_free (MMailPack, pack);
+}
@@ -0,0 +1,78 @@
+#ifndef M_MAIL_PACK_H
+#define M_MAIL_PACK_H
+
+/* Compressed per-month archives for old messages in the offline store.
+ *
+ * A pack holds many messages, each one deflated on its own, followed
+ * by an index of (UID, offset, size, flags, date) records and a fixed
+ * size footer pointing at the index.  Opening a pack reads only the
+ * footer and the index, after which any single message is one pread()
+ * and one inflate away.
+ *
+ * Packs are only ever appended to: every close writes a new index and
+ * footer after the messages added since, and the footer at the end of
+ * the file counts.  Should the process die before that, opening the
+ * pack falls back to the last complete index before the end. */
+
+#include <gio/gio.h>
+
+#define M_MAIL_PACK_DIR_NAME "packs"
+
+G_BEGIN_DECLS
+
+typedef struct _MMailPack MMailPack;
+
+typedef gboolean (* MMailPackForeachFunc)	(MMailPack *pack,
+						 const gchar *uid,
+						 guint32 flags,
+						 gint64 date,
+						 gpointer user_data);
+
+gchar *		m_mail_pack_build_name		(gint64 date);
+MMailPack *	m_mail_pack_open		(const gchar *filename,
+						 gboolean writable,
+						 GError **error);
+const gchar *	m_mail_pack_get_filename	(MMailPack *pack);
+guint		m_mail_pack_get_n_messages	(MMailPack *pack);
+gboolean	m_mail_pack_contains		(MMailPack *pack,
+						 const gchar *uid);
+gboolean	m_mail_pack_get_flags		(MMailPack *pack,
+						 const gchar *uid,
+						 guint32 *out_flags);
+GBytes *	m_mail_pack_compress		(const gchar *uid,
+						 const guint8 *data,
+						 gsize length,
+						 GError **error);
+gboolean	m_mail_pack_append		(MMailPack *pack,
+						 const gchar *uid,
+						 guint32 flags,
+						 gint64 date,
+						 GBytes *compressed,
+						 gsize length,
+						 GCancellable *cancellable,
+						 GError **error);
+gboolean	m_mail_pack_add			(MMailPack *pack,
+						 const gchar *uid,
+						 guint32 flags,
+						 gint64 date,
+						 const guint8 *data,
+						 gsize length,
+						 GCancellable *cancellable,
+						 GError **error);
+gboolean	m_mail_pack_remove		(MMailPack *pack,
+						 const gchar *uid);
+GBytes *	m_mail_pack_read		(MMailPack *pack,
+						 const gchar *uid,
+						 guint32 *out_flags,
+						 GCancellable *cancellable,
+						 GError **error);
+void		m_mail_pack_foreach		(MMailPack *pack,
+						 MMailPackForeachFunc func,
+						 gpointer user_data);
+gboolean	m_mail_pack_close		(MMailPack *pack,
+						 GError **error);
+void		m_mail_pack_free		(MMailPack *pack);
+
+G_END_DECLS
+
+#endif /* M_MAIL_PACK_H */
@@ -0,0 +1,437 @@
+#include "config.h"
+
+#include "m-maildir-utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+
+#include <camel/camel.h>
+
+/* Sorted by flag character, as the maildir specification requires. */
+static const struct {
+	gchar flag;
+	guint32 camel_flag;
+} maildir_flags[] = {
+	{ 'D', CAMEL_MESSAGE_DRAFT },
+	{ 'F', CAMEL_MESSAGE_FLAGGED },
+	{ 'R', CAMEL_MESSAGE_ANSWERED },
+	{ 'S', CAMEL_MESSAGE_SEEN },
+	{ 'T', CAMEL_MESSAGE_DELETED }
+};
+
+static gboolean
+maildir_mkdir (const gchar *path,
+	       GError **error)
+{
+	if (g_mkdir (path, 0700) == -1 && errno != EEXIST) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to create “%s”: %s"),
+			path, g_strerror (errsv));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * m_maildir_ensure:
+ * @path: path of the maildir
+ * @is_subfolder: whether @path is a Maildir++ subfolder
+ * @error: return location for a #GError, or %NULL
+ *
+ * Creates @path with its cur, new and tmp directories, if they do not
+ * exist yet.  Maildir++ subfolders also get their "maildirfolder" tag.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_maildir_ensure (const gchar *path,
+		  gboolean is_subfolder,
+		  GError **error)
+{
+	const gchar *subdirs[] = { "cur", "new", "tmp" };
+	guint ii;
+
+	g_return_val_if_fail (path != NULL, FALSE);
+
+	if (g_mkdir_with_parents (path, 0700) == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to create “%s”: %s"),
+			path, g_strerror (errsv));
+		return FALSE;
+	}
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		gchar *subdir;
+		gboolean success;
+
+		subdir = g_build_filename (path, subdirs[ii], NULL);
+		success = maildir_mkdir (subdir, error);
+		g_free (subdir);
+
+		if (!success)
+			return FALSE;
+	}
+
+	if (is_subfolder) {
+		gchar *tag;
+		gint fd;
+
+		tag = g_build_filename (path, "maildirfolder", NULL);
+		fd = g_open (tag, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+		if (fd != -1)
+			close (fd);
+		g_free (tag);
+	}
+
+	return TRUE;
+}
+
+/**
+ * m_maildir_build_subfolder:
+ * @layout: an #MExportLayout
+ * @date: the message date, as a Unix time
+ *
+ * Returns: (transfer full) (nullable): the Maildir++ subfolder name,
+ *    like ".2019" or ".2019.04", where a message from @date belongs,
+ *    or %NULL when it belongs into the maildir root
+ **/
+gchar *
+m_maildir_build_subfolder (MExportLayout layout,
+			   gint64 date)
+{
+	GDateTime *dt;
+	gchar *name = NULL;
+
+	if (layout == M_EXPORT_LAYOUT_FLAT)
+		return NULL;
+
+	dt = g_date_time_new_from_unix_utc (MAX (date, 0));
+	if (dt == NULL)
+		return NULL;
+
+	if (layout == M_EXPORT_LAYOUT_YEAR)
+		name = g_date_time_format (dt, ".%Y");
+	else if (layout == M_EXPORT_LAYOUT_MONTH)
+		name = g_date_time_format (dt, ".%Y.%m");
+
+	g_date_time_unref (dt);
+
+	return name;
+}
+
+/**
+ * m_maildir_build_basename:
+ * @uid: a Camel message UID
+ * @date: the message date, as a Unix time
+ *
+ * Returns: (transfer full): the unique part of the message file name,
+ *    without the info suffix
+ **/
+gchar *
+m_maildir_build_basename (const gchar *uid,
+			  gint64 date)
+{
+	GString *str;
+	const gchar *ptr;
+
+	g_return_val_if_fail (uid != NULL, NULL);
+
+	str = g_string_sized_new (strlen (uid) + 40);
+	g_string_append_printf (str, "%" G_GINT64_FORMAT ".", MAX (date, 0));
+
+	for (ptr = uid; *ptr; ptr++) {
+		if (*ptr == '/' || *ptr == ':' || *ptr == '%')
+			g_string_append_printf (str, "%%%02X", (guchar) *ptr);
+		else
+			g_string_append_c (str, *ptr);
+	}
+
+	g_string_append (str, "." M_MAILDIR_HOST_TAG);
+
+	return g_string_free (str, FALSE);
+}
+
+/**
+ * m_maildir_build_filename:
+ * @basename: a message base name from m_maildir_build_basename()
+ * @flags: #CamelMessageFlags of the message
+ *
+ * Returns: (transfer full): @basename with the maildir info suffix
+ *    describing @flags appended
+ **/
+gchar *
+m_maildir_build_filename (const gchar *basename,
+			  guint32 flags)
+{
+	gchar info[G_N_ELEMENTS (maildir_flags) + 1];
+	guint ii, len = 0;
+
+	g_return_val_if_fail (basename != NULL, NULL);
+
+	for (ii = 0; ii < G_N_ELEMENTS (maildir_flags); ii++) {
+		if ((flags & maildir_flags[ii].camel_flag) != 0)
+			info[len++] = maildir_flags[ii].flag;
+	}
+
+	info[len] = '\0';
+
+	return g_strconcat (basename, M_MAILDIR_INFO_SEP, info, NULL);
+}
+
+/**
+ * m_maildir_dup_uid:
+ * @filename: a message file name, with or without the directory
+ *
+ * Returns: (transfer full) (nullable): the Camel message UID encoded
+ *    in @filename, or %NULL when the file was not written by us
+ **/
+gchar *
+m_maildir_dup_uid (const gchar *filename)
+{
+	const gchar *start, *end, *ptr;
+	GString *uid;
+
+	g_return_val_if_fail (filename != NULL, NULL);
+
+	start = strrchr (filename, G_DIR_SEPARATOR);
+	start = start ? start + 1 : filename;
+
+	end = strchr (start, ':');
+	if (end == NULL)
+		end = start + strlen (start);
+
+	/* Skip the leading date. */
+	while (start < end && g_ascii_isdigit (*start))
+		start++;
+
+	if (start == end || *start != '.')
+		return NULL;
+	start++;
+
+	if (end - start <= (gssize) strlen ("." M_MAILDIR_HOST_TAG) ||
+	    strncmp (end - strlen ("." M_MAILDIR_HOST_TAG), "." M_MAILDIR_HOST_TAG,
+		     strlen ("." M_MAILDIR_HOST_TAG)) != 0)
+		return NULL;
+
+	end -= strlen ("." M_MAILDIR_HOST_TAG);
+
+	uid = g_string_sized_new (end - start);
+
+	for (ptr = start; ptr < end; ptr++) {
+		if (*ptr == '%' && end - ptr >= 3 &&
+		    g_ascii_isxdigit (ptr[1]) && g_ascii_isxdigit (ptr[2])) {
+			g_string_append_c (
+				uid, (g_ascii_xdigit_value (ptr[1]) << 4) |
+				g_ascii_xdigit_value (ptr[2]));
+			ptr += 2;
+		} else {
+			g_string_append_c (uid, *ptr);
+		}
+	}
+
+	return g_string_free (uid, FALSE);
+}
+
+/**
+ * m_maildir_get_flags_mask:
+ *
+ * Returns: all #CamelMessageFlags an info suffix can describe
+ **/
+guint32
+m_maildir_get_flags_mask (void)
+{
+	guint32 mask = 0;
+	guint ii;
+
+	for (ii = 0; ii < G_N_ELEMENTS (maildir_flags); ii++)
+		mask |= maildir_flags[ii].camel_flag;
+
+	return mask;
+}
+
+/**
+ * m_maildir_get_flags:
+ * @filename: a message file name, with or without the directory
+ *
+ * Returns: the #CamelMessageFlags described by the info suffix
+ *    of @filename
+ **/
+guint32
+m_maildir_get_flags (const gchar *filename)
+{
+	const gchar *info, *ptr;
+	guint32 flags = 0;
+
+	g_return_val_if_fail (filename != NULL, 0);
+
+	info = strrchr (filename, G_DIR_SEPARATOR);
+	info = strstr (info ? info : filename, M_MAILDIR_INFO_SEP);
+	if (info == NULL)
+		return 0;
+
+	for (ptr = info + strlen (M_MAILDIR_INFO_SEP); *ptr; ptr++) {
+		guint ii;
+
+		for (ii = 0; ii < G_N_ELEMENTS (maildir_flags); ii++) {
+			if (maildir_flags[ii].flag == *ptr) {
+				flags |= maildir_flags[ii].camel_flag;
+				break;
+			}
+		}
+	}
+
+	return flags;
+}
+
+/**
+ * m_maildir_index_files:
+ * @maildir: path of a maildir
+ *
+ * Reads cur/ and new/ of @maildir once, so that the copies of many
+ * messages can be looked up without reading them again each time.
+ * Files are keyed by their base name, the part before the info
+ * suffix, which stays the same whatever flags a client gives the
+ * message, its own keyword letters included.
+ *
+ * Returns: (transfer full): a new #GHashTable, message base name
+ *    ~> #GPtrArray of the paths of its files
+ **/
+GHashTable *
+m_maildir_index_files (const gchar *maildir)
+{
+	const gchar *subdirs[] = { "cur", "new" };
+	GHashTable *files;
+	guint ii;
+
+	g_return_val_if_fail (maildir != NULL, NULL);
+
+	files = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) g_ptr_array_unref);
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		const gchar *name;
+		gchar *path;
+		GDir *dir;
+
+		path = g_build_filename (maildir, subdirs[ii], NULL);
+		dir = g_dir_open (path, 0, NULL);
+
+		while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+			const gchar *info;
+			gchar *basename;
+			GPtrArray *paths;
+
+			if (*name == '.')
+				continue;
+
+			info = strchr (name, ':');
+			if (info == NULL)
+				info = name + strlen (name);
+
+			basename = g_strndup (name, info - name);
+
+			paths = g_hash_table_lookup (files, basename);
+			if (paths == NULL) {
+				paths = g_ptr_array_new_with_free_func (g_free);
+				g_hash_table_insert (files, basename, paths);
+			} else {
+				g_free (basename);
+			}
+
+			g_ptr_array_add (paths, g_build_filename (path, name, NULL));
+		}
+
+		if (dir != NULL)
+			g_dir_close (dir);
+		g_free (path);
+	}
+
+	return files;
+}
+
+/**
+ * m_maildir_deliver:
+ * @maildir: path of the target maildir
+ * @tmp_path: path of the completely written message in tmp/
+ * @basename: a message base name from m_maildir_build_basename()
+ * @flags: #CamelMessageFlags of the message
+ * @old_paths: (nullable) (element-type filename): files @maildir held
+ *    the message in already, from m_maildir_index_files(), or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Moves a message from tmp/ into cur/ of @maildir, with its flags
+ * in the info suffix of the file name.  Any of @old_paths other than
+ * the new file, under other flags or still in new/, is removed once
+ * the new one is in place, so that the message is never there twice.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_maildir_deliver (const gchar *maildir,
+		   const gchar *tmp_path,
+		   const gchar *basename,
+		   guint32 flags,
+		   GPtrArray *old_paths,
+		   GError **error)
+{
+	gchar *filename, *cur_path;
+	gboolean success = TRUE;
+	guint ii;
+
+	g_return_val_if_fail (maildir != NULL, FALSE);
+	g_return_val_if_fail (tmp_path != NULL, FALSE);
+	g_return_val_if_fail (basename != NULL, FALSE);
+
+	filename = m_maildir_build_filename (basename, flags);
+	cur_path = g_build_filename (maildir, "cur", filename, NULL);
+
+	if (g_rename (tmp_path, cur_path) == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to deliver “%s”: %s"),
+			cur_path, g_strerror (errsv));
+		success = FALSE;
+	}
+
+	for (ii = 0; success && old_paths != NULL && ii < old_paths->len; ii++) {
+		const gchar *old_path = g_ptr_array_index (old_paths, ii);
+
+		if (g_str_equal (old_path, cur_path))
+			continue;
+
+		if (g_unlink (old_path) == -1 && errno != ENOENT) {
+			gint errsv = errno;
+
+			g_set_error (
+				error, G_IO_ERROR,
+				g_io_error_from_errno (errsv),
+				_("Failed to remove “%s”: %s"),
+				old_path, g_strerror (errsv));
+			success = FALSE;
+		}
+	}
+
+	g_free (cur_path);
+	g_free (filename);
+
+	return success;
+}
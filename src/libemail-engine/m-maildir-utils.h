@@ -0,0 +1,41 @@
+#ifndef M_MAILDIR_UTILS_H
+#define M_MAILDIR_UTILS_H
+
+/* Naming, flag and delivery helpers for the offline maildir.
+ *
+ * Every message file is named "<date>.<uid>.offline-store:2,<flags>",
+ * where <uid> is the Camel message UID with '/', ':' and '%' escaped,
+ * so the source UID can always be recovered from a file name alone. */
+
+#include <gio/gio.h>
+
+#include "m-export-options.h"
+
+#define M_MAILDIR_HOST_TAG	"offline-store"
+#define M_MAILDIR_INFO_SEP	":2,"
+
+G_BEGIN_DECLS
+
+gboolean	m_maildir_ensure		(const gchar *path,
+						 gboolean is_subfolder,
+						 GError **error);
+gchar *		m_maildir_build_subfolder	(MExportLayout layout,
+						 gint64 date);
+gchar *		m_maildir_build_basename	(const gchar *uid,
+						 gint64 date);
+gchar *		m_maildir_build_filename	(const gchar *basename,
+						 guint32 flags);
+gchar *		m_maildir_dup_uid		(const gchar *filename);
+guint32		m_maildir_get_flags_mask	(void);
+guint32		m_maildir_get_flags		(const gchar *filename);
+GHashTable *	m_maildir_index_files		(const gchar *maildir);
+gboolean	m_maildir_deliver		(const gchar *maildir,
+						 const gchar *tmp_path,
+						 const gchar *basename,
+						 guint32 flags,
+						 GPtrArray *old_paths,
+						 GError **error);
+
+G_END_DECLS
+
+#endif /* M_MAILDIR_UTILS_H */
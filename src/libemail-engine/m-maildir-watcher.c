@@ -0,0 +1,490 @@
+#include "config.h"
+
+#include "m-maildir-watcher.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <glib/gi18n-lib.h>
+#include <glib-unix.h>
+
+#include "m-maildir-utils.h"
+#include "m-mail-folder-utils.h"
+
+/* Renames arriving within this many milliseconds of each other end
+ * up in one batch, with a single summary save.  A MUA syncing a whole
+ * mailbox renames hundreds of files in a burst. */
+#define WATCHER_FLUSH_INTERVAL 500
+
+typedef struct _WatchDir WatchDir;
+
+struct _WatchDir {
+	gchar *path;
+	gboolean is_root;	/* the top maildir, which gets subfolders */
+	gboolean is_messages;	/* a cur/ or new/ directory */
+};
+
+struct _MMaildirWatcher {
+	CamelFolder *folder;
+	gchar *root_path;
+	GMainContext *context;
+
+	gint fd;
+	GSource *fd_source;
+	GSource *flush_source;
+
+	GHashTable *watches;	/* watch descriptor ~> WatchDir */
+	GHashTable *pending;	/* message UID ~> CamelMessageFlags */
+};
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+static void
+watch_dir_free (WatchDir *watch_dir)
+{
+	g_free (watch_dir->path);
+
+	g_slice_free (WatchDir, watch_dir);
+}
+
+static gboolean
+maildir_watcher_flush_cb (gpointer user_data)
+{
+	MMaildirWatcher *watcher = user_data;
+
+	g_clear_pointer (&watcher->flush_source, g_source_unref);
+
+	m_maildir_watcher_flush (watcher);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+maildir_watcher_queue (MMaildirWatcher *watcher,
+		       const gchar *filename)
+{
+	gchar *uid;
+
+	/* Files not written by the export have no UID to map back. */
+	uid = m_maildir_dup_uid (filename);
+	if (uid == NULL)
+		return;
+
+	/* Only the newest name of a message matters. */
+	g_hash_table_replace (
+		watcher->pending, uid,
+		GUINT_TO_POINTER (m_maildir_get_flags (filename)));
+
+	if (watcher->flush_source == NULL) {
+		watcher->flush_source = g_timeout_source_new (WATCHER_FLUSH_INTERVAL);
+		g_source_set_callback (
+			watcher->flush_source,
+			maildir_watcher_flush_cb, watcher, NULL);
+		g_source_attach (watcher->flush_source, watcher->context);
+	}
+}
+
+static void
+maildir_watcher_scan (MMaildirWatcher *watcher,
+		      const gchar *path)
+{
+	const gchar *name;
+	GDir *dir;
+
+	dir = g_dir_open (path, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	while ((name = g_dir_read_name (dir)) != NULL)
+		maildir_watcher_queue (watcher, name);
+
+	g_dir_close (dir);
+}
+
+static void
+maildir_watcher_add (MMaildirWatcher *watcher,
+		     const gchar *path,
+		     gboolean is_root,
+		     gboolean is_messages)
+{
+	WatchDir *watch_dir;
+	guint32 mask;
+	gint wd;
+
+	/* Message directories only see renames, which is how both
+	 * deliveries and flag changes arrive in a maildir.  The
+	 * maildirs themselves are watched for cur/, new/ and, at
+	 * the top, Maildir++ subfolders created after the start. */
+	if (is_messages)
+		mask = IN_MOVED_TO | IN_ONLYDIR;
+	else
+		mask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+
+	wd = inotify_add_watch (watcher->fd, path, mask);
+	if (wd == -1)
+		return;
+
+	watch_dir = g_slice_new0 (WatchDir);
+	watch_dir->path = g_strdup (path);
+	watch_dir->is_root = is_root;
+	watch_dir->is_messages = is_messages;
+
+	g_hash_table_replace (watcher->watches, GINT_TO_POINTER (wd), watch_dir);
+}
+
+static void
+maildir_watcher_add_maildir (MMaildirWatcher *watcher,
+			     const gchar *path,
+			     gboolean is_root)
+{
+	const gchar *subdirs[] = { "cur", "new" };
+	guint ii;
+
+	maildir_watcher_add (watcher, path, is_root, FALSE);
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		gchar *subdir;
+
+		subdir = g_build_filename (path, subdirs[ii], NULL);
+		maildir_watcher_add (watcher, subdir, FALSE, TRUE);
+		g_free (subdir);
+	}
+}
+
+/* Helper for m_maildir_watcher_new() */
+static void
+maildir_watcher_add_subfolders (MMaildirWatcher *watcher)
+{
+	const gchar *name;
+	GDir *dir;
+
+	dir = g_dir_open (watcher->root_path, 0, NULL);
+	if (dir == NULL)
+		return;
+
+	while ((name = g_dir_read_name (dir)) != NULL) {
+		gchar *path;
+
+		if (*name != '.')
+			continue;
+
+		path = g_build_filename (watcher->root_path, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_IS_DIR))
+			maildir_watcher_add_maildir (watcher, path, FALSE);
+		g_free (path);
+	}
+
+	g_dir_close (dir);
+}
+
+/* Helper for maildir_watcher_event_cb() */
+static void
+maildir_watcher_handle_event (MMaildirWatcher *watcher,
+			      const struct inotify_event *event)
+{
+	WatchDir *watch_dir;
+	gchar *path;
+
+	watch_dir = g_hash_table_lookup (watcher->watches, GINT_TO_POINTER (event->wd));
+	if (watch_dir == NULL)
+		return;
+
+	if ((event->mask & IN_IGNORED) != 0) {
+		g_hash_table_remove (watcher->watches, GINT_TO_POINTER (event->wd));
+		return;
+	}
+
+	if (event->len == 0)
+		return;
+
+	if (watch_dir->is_messages) {
+		if ((event->mask & IN_ISDIR) == 0)
+			maildir_watcher_queue (watcher, event->name);
+		return;
+	}
+
+	if ((event->mask & IN_ISDIR) == 0)
+		return;
+
+	path = g_build_filename (watch_dir->path, event->name, NULL);
+
+	/* Renames may have happened before the watch was in place,
+	 * so directories showing up late are read once. */
+	if (g_str_equal (event->name, "cur") || g_str_equal (event->name, "new")) {
+		maildir_watcher_add (watcher, path, FALSE, TRUE);
+		maildir_watcher_scan (watcher, path);
+
+	} else if (watch_dir->is_root && *event->name == '.') {
+		gchar *subdir;
+
+		maildir_watcher_add_maildir (watcher, path, FALSE);
+
+		subdir = g_build_filename (path, "cur", NULL);
+		maildir_watcher_scan (watcher, subdir);
+		g_free (subdir);
+	}
+
+	g_free (path);
+}
+
+static gboolean
+maildir_watcher_event_cb (gint fd,
+			  GIOCondition condition,
+			  gpointer user_data)
+{
+	MMaildirWatcher *watcher = user_data;
+	guint8 buffer[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+	while (TRUE) {
+		const guint8 *ptr;
+		gssize n_read;
+
+		n_read = read (fd, buffer, sizeof (buffer));
+		if (n_read < 0 && errno == EINTR)
+			continue;
+		if (n_read <= 0)
+			break;
+
+		for (ptr = buffer; ptr < buffer + n_read; ) {
+			const struct inotify_event *event;
+
+			event = (const struct inotify_event *) ptr;
+			ptr += sizeof (struct inotify_event) + event->len;
+
+			/* The kernel dropped events, so fall back to
+			 * reading every watched directory once. */
+			if ((event->mask & IN_Q_OVERFLOW) != 0) {
+				GHashTableIter iter;
+				gpointer value;
+
+				g_hash_table_iter_init (&iter, watcher->watches);
+
+				while (g_hash_table_iter_next (&iter, NULL, &value)) {
+					WatchDir *watch_dir = value;
+
+					if (watch_dir->is_messages)
+						maildir_watcher_scan (watcher, watch_dir->path);
+				}
+
+				continue;
+			}
+
+			maildir_watcher_handle_event (watcher, event);
+		}
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+#endif /* HAVE_SYS_INOTIFY_H */
+
+/**
+ * m_maildir_watcher_new:
+ * @folder: the #CamelFolder @maildir was exported from
+ * @maildir: root of the offline store
+ * @error: return location for a #GError, or %NULL
+ *
+ * Starts watching @maildir, including its Maildir++ subfolders, for
+ * messages renamed to a different info suffix, and sets the flags so
+ * described on the messages of @folder.  Changes are coalesced and
+ * written in batches.  The watcher runs in the thread-default main
+ * context of the caller.  When @maildir holds export snapshots, the
+ * latest snapshot is watched.
+ *
+ * Returns: (transfer full): a new #MMaildirWatcher, or %NULL on error
+ **/
+MMaildirWatcher *
+m_maildir_watcher_new (CamelFolder *folder,
+		       GFile *maildir,
+		       GError **error)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	MMaildirWatcher *watcher;
+	gchar *root_path, *cur;
+	gint fd;
+
+	g_return_val_if_fail (CAMEL_IS_FOLDER (folder), NULL);
+	g_return_val_if_fail (G_IS_FILE (maildir), NULL);
+
+	root_path = g_file_get_path (maildir);
+	if (root_path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Only a local directory can be watched"));
+		return NULL;
+	}
+
+	cur = g_build_filename (root_path, "cur", NULL);
+	if (!g_file_test (cur, G_FILE_TEST_IS_DIR)) {
+		gchar *latest;
+
+		latest = g_build_filename (root_path, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+
+		if (g_file_test (latest, G_FILE_TEST_IS_DIR)) {
+			g_free (root_path);
+			root_path = latest;
+		} else {
+			g_free (latest);
+		}
+	}
+	g_free (cur);
+
+	fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to watch “%s”: %s"),
+			root_path, g_strerror (errsv));
+		g_free (root_path);
+		return NULL;
+	}
+
+	watcher = g_slice_new0 (MMaildirWatcher);
+	watcher->folder = g_object_ref (folder);
+	watcher->root_path = root_path;
+	watcher->context = g_main_context_ref_thread_default ();
+	watcher->fd = fd;
+
+	watcher->watches = g_hash_table_new_full (
+		g_direct_hash, g_direct_equal,
+		NULL, (GDestroyNotify) watch_dir_free);
+
+	watcher->pending = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free, NULL);
+
+	maildir_watcher_add_maildir (watcher, root_path, TRUE);
+
+	if (g_hash_table_size (watcher->watches) == 0) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+			_("Failed to watch “%s”: %s"),
+			root_path, g_strerror (ENOENT));
+		m_maildir_watcher_free (watcher);
+		return NULL;
+	}
+
+	maildir_watcher_add_subfolders (watcher);
+
+	watcher->fd_source = g_unix_fd_source_new (fd, G_IO_IN);
+	g_source_set_callback (
+		watcher->fd_source,
+		(GSourceFunc) maildir_watcher_event_cb, watcher, NULL);
+	g_source_attach (watcher->fd_source, watcher->context);
+
+	return watcher;
+#else
+	g_set_error (
+		error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+		_("Watching the offline store is not supported on this system"));
+
+	return NULL;
+#endif
+}
+
+/**
+ * m_maildir_watcher_flush:
+ * @watcher: an #MMaildirWatcher
+ *
+ * Sets the flags of all renames seen so far on the messages of the
+ * folder right away, inside a single freeze of the folder, and saves
+ * its summary once.  This happens on its own shortly after a burst
+ * of renames.
+ *
+ * Returns: the number of messages whose flags changed
+ **/
+guint
+m_maildir_watcher_flush (MMaildirWatcher *watcher)
+{
+	CamelFolderSummary *summary;
+	GHashTableIter iter;
+	gpointer key, value;
+	guint32 mask;
+	guint n_changed = 0;
+
+	g_return_val_if_fail (watcher != NULL, 0);
+
+	if (g_hash_table_size (watcher->pending) == 0)
+		return 0;
+
+	/* Flags an info suffix cannot express are left alone. */
+	mask = m_maildir_get_flags_mask ();
+
+	camel_folder_freeze (watcher->folder);
+
+	g_hash_table_iter_init (&iter, watcher->pending);
+
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		CamelMessageInfo *info;
+
+		info = camel_folder_get_message_info (watcher->folder, key);
+		if (info == NULL)
+			continue;
+
+		/* Our own deliveries carry the flags Camel has
+		 * already, which makes this a no-op for them. */
+		if (camel_message_info_set_flags (info, mask, GPOINTER_TO_UINT (value)))
+			n_changed++;
+
+		g_object_unref (info);
+	}
+
+	camel_folder_thaw (watcher->folder);
+
+	g_hash_table_remove_all (watcher->pending);
+
+	summary = camel_folder_get_folder_summary (watcher->folder);
+
+	if (n_changed > 0 && summary != NULL) {
+		GError *local_error = NULL;
+
+		if (!camel_folder_summary_save (summary, &local_error)) {
+			g_warning (
+				"%s: Failed to save summary of “%s”: %s",
+				G_STRFUNC,
+				camel_folder_get_full_name (watcher->folder),
+				local_error ? local_error->message : "Unknown error");
+			g_clear_error (&local_error);
+		}
+	}
+
+	return n_changed;
+}
+
+void
+m_maildir_watcher_free (MMaildirWatcher *watcher)
+{
+	if (watcher == NULL)
+		return;
+
+	/* Do not lose renames seen just before stopping. */
+	m_maildir_watcher_flush (watcher);
+
+	if (watcher->flush_source != NULL) {
+		g_source_destroy (watcher->flush_source);
+		g_source_unref (watcher->flush_source);
+	}
+
+	if (watcher->fd_source != NULL) {
+		g_source_destroy (watcher->fd_source);
+		g_source_unref (watcher->fd_source);
+	}
+
+	if (watcher->fd != -1)
+		close (watcher->fd);
+
+	g_hash_table_destroy (watcher->pending);
+	g_hash_table_destroy (watcher->watches);
+	g_main_context_unref (watcher->context);
+	g_object_unref (watcher->folder);
+	g_free (watcher->root_path);
+
+	g_slice_free (MMaildirWatcher, watcher);
+}
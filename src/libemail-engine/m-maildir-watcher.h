@@ -0,0 +1,22 @@
+#ifndef M_MAILDIR_WATCHER_H
+#define M_MAILDIR_WATCHER_H
+
+/* Pushing flag changes made in the offline maildir, say by mutt,
+ * back to the CamelFolder it was exported from. */
+
+#include <camel/camel.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MMaildirWatcher MMaildirWatcher;
+
+MMaildirWatcher *
+		m_maildir_watcher_new		(CamelFolder *folder,
+						 GFile *maildir,
+						 GError **error);
+guint		m_maildir_watcher_flush		(MMaildirWatcher *watcher);
+void		m_maildir_watcher_free		(MMaildirWatcher *watcher);
+
+G_END_DECLS
+
+#endif /* M_MAILDIR_WATCHER_H */
@@ -0,0 +1,619 @@
+#include "config.h"
+
+#include "m-mbox-import.h"
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include <glib/gi18n-lib.h>
+
+#include "m-mail-folder-utils.h"
+
+/* Messages handed to a worker at once. */
+#define SPLIT_BATCH_SIZE 64
+
+typedef struct _AsyncContext AsyncContext;
+typedef struct _ImportContext ImportContext;
+typedef struct _ScanTask ScanTask;
+typedef struct _SplitTask SplitTask;
+
+struct _AsyncContext {
+	GFile *destination;
+	MExportOptions *options;
+};
+
+struct _ImportContext {
+	const gchar *data;
+	gsize length;
+
+	/* Offsets of the From_ lines, followed by the file length. */
+	GArray *offsets;
+
+	MMailFolderWriter *writer;
+	gchar *uid_prefix;
+	GCancellable *cancellable;
+
+	GMutex lock;
+	GCond cond;
+	guint pending;
+	GError *error;
+
+	gint failed;	/* atomic */
+	guint n_done;	/* atomic */
+};
+
+struct _ScanTask {
+	ImportContext *context;
+	gsize start;
+	gsize end;
+	GArray *offsets;
+};
+
+struct _SplitTask {
+	ImportContext *context;
+	guint first;
+	guint last;
+};
+
+static void
+async_context_free (AsyncContext *context)
+{
+	g_clear_object (&context->destination);
+
+	m_export_options_free (context->options);
+
+	g_slice_free (AsyncContext, context);
+}
+
+static void
+mbox_import_thread (GSimpleAsyncResult *simple,
+                    GObject *object,
+                    GCancellable *cancellable)
+{
+	AsyncContext *context;
+	GError *error = NULL;
+
+	context = g_simple_async_result_get_op_res_gpointer (simple);
+
+	m_mbox_import_sync (
+		G_FILE (object), context->destination,
+		context->options, cancellable, &error);
+
+	if (error != NULL)
+		g_simple_async_result_take_error (simple, error);
+}
+
+static void
+mbox_import_task_done (ImportContext *context)
+{
+	g_mutex_lock (&context->lock);
+	context->pending--;
+	g_cond_signal (&context->cond);
+	g_mutex_unlock (&context->lock);
+}
+
+static void
+mbox_import_take_error (ImportContext *context,
+                        GError *error)
+{
+	g_mutex_lock (&context->lock);
+	if (context->error == NULL)
+		context->error = error;
+	else
+		g_error_free (error);
+	g_mutex_unlock (&context->lock);
+
+	g_atomic_int_set (&context->failed, 1);
+}
+
+/* Finds the From_ lines starting inside [start, end).  The newlines
+ * are located with memchr(), which the C library implements with
+ * vector instructions, so the scan runs at memory bandwidth. */
+static void
+mbox_import_scan_thread (gpointer data,
+                         gpointer user_data)
+{
+	ScanTask *task = data;
+	ImportContext *context = task->context;
+	const gchar *ptr, *limit;
+
+	if (task->start == 0 && context->length >= 5 &&
+	    memcmp (context->data, "From ", 5) == 0) {
+		gsize offset = 0;
+
+		g_array_append_val (task->offsets, offset);
+	}
+
+	ptr = context->data + (task->start > 0 ? task->start - 1 : 0);
+	limit = context->data + task->end - 1;
+
+	while (ptr < limit) {
+		const gchar *newline;
+		gsize offset;
+
+		newline = memchr (ptr, '\n', limit - ptr);
+		if (newline == NULL)
+			break;
+
+		offset = newline + 1 - context->data;
+
+		if (context->length - offset >= 5 &&
+		    memcmp (newline + 1, "From ", 5) == 0)
+			g_array_append_val (task->offsets, offset);
+
+		ptr = newline + 1;
+	}
+
+	mbox_import_task_done (context);
+}
+
+/* Helper for mbox_import_split_thread() */
+static gboolean
+mbox_import_is_escaped_from (const gchar *line,
+                             const gchar *end)
+{
+	if (line >= end || *line != '>')
+		return FALSE;
+
+	while (line < end && *line == '>')
+		line++;
+
+	return end - line >= 5 && memcmp (line, "From ", 5) == 0;
+}
+
+/* Helper for mbox_import_split_thread() */
+static gboolean
+mbox_import_needs_unescape (const gchar *start,
+                            const gchar *end)
+{
+	const gchar *ptr = start;
+
+	while (ptr < end) {
+		const gchar *newline;
+
+		newline = memchr (ptr, '\n', end - ptr);
+		if (newline == NULL)
+			break;
+
+		if (mbox_import_is_escaped_from (newline + 1, end))
+			return TRUE;
+
+		ptr = newline + 1;
+	}
+
+	return FALSE;
+}
+
+/* Helper for mbox_import_split_thread() */
+static void
+mbox_import_unescape (const gchar *start,
+                      const gchar *end,
+                      GByteArray *out)
+{
+	const gchar *line = start;
+
+	g_byte_array_set_size (out, 0);
+
+	/* mboxrd: drop one '>' from every ">From ", ">>From ", ... line. */
+	while (line < end) {
+		const gchar *newline;
+		gsize line_len;
+
+		newline = memchr (line, '\n', end - line);
+		line_len = newline != NULL ? newline + 1 - line : end - line;
+
+		if (mbox_import_is_escaped_from (line, end))
+			g_byte_array_append (out, (const guint8 *) line + 1, line_len - 1);
+		else
+			g_byte_array_append (out, (const guint8 *) line, line_len);
+
+		line += line_len;
+	}
+}
+
+/* Helper for mbox_import_split_thread() */
+static void
+mbox_import_parse_headers (const gchar *start,
+                           const gchar *end,
+                           gint64 *out_date,
+                           guint32 *out_flags)
+{
+	const gchar *line = start;
+
+	*out_date = 0;
+	*out_flags = 0;
+
+	/* Only the few headers needed for naming the file and for
+	 * its flags are looked at, no CamelMimeMessage is built. */
+	while (line < end && *line != '\n' && *line != '\r') {
+		const gchar *newline, *value;
+		gchar *str;
+
+		newline = memchr (line, '\n', end - line);
+		if (newline == NULL)
+			newline = end;
+
+		value = memchr (line, ':', newline - line);
+		if (value == NULL) {
+			line = newline + 1;
+			continue;
+		}
+
+		str = g_strndup (value + 1, newline - value - 1);
+		g_strstrip (str);
+
+		if (value - line == 4 && g_ascii_strncasecmp (line, "Date", 4) == 0) {
+			*out_date = camel_header_decode_date (str, NULL);
+
+		} else if (value - line == 6 && g_ascii_strncasecmp (line, "Status", 6) == 0) {
+			if (strchr (str, 'R') != NULL)
+				*out_flags |= CAMEL_MESSAGE_SEEN;
+
+		} else if (value - line == 8 && g_ascii_strncasecmp (line, "X-Status", 8) == 0) {
+			if (strchr (str, 'A') != NULL)
+				*out_flags |= CAMEL_MESSAGE_ANSWERED;
+			if (strchr (str, 'F') != NULL)
+				*out_flags |= CAMEL_MESSAGE_FLAGGED;
+			if (strchr (str, 'T') != NULL)
+				*out_flags |= CAMEL_MESSAGE_DRAFT;
+			if (strchr (str, 'D') != NULL)
+				*out_flags |= CAMEL_MESSAGE_DELETED;
+		}
+
+		g_free (str);
+
+		line = newline + 1;
+	}
+}
+
+static void
+mbox_import_split_thread (gpointer data,
+                          gpointer user_data)
+{
+	SplitTask *task = data;
+	ImportContext *context = task->context;
+	GByteArray *unescaped;
+	guint ii;
+
+	unescaped = g_byte_array_new ();
+
+	for (ii = task->first; ii < task->last; ii++) {
+		const gchar *start, *end, *newline;
+		const guint8 *message_data;
+		gsize message_len;
+		gchar *uid;
+		gint64 date;
+		guint32 flags;
+		GError *local_error = NULL;
+
+		if (g_atomic_int_get (&context->failed) ||
+		    g_cancellable_is_cancelled (context->cancellable))
+			break;
+
+		start = context->data + g_array_index (context->offsets, gsize, ii);
+		end = context->data + g_array_index (context->offsets, gsize, ii + 1);
+
+		/* Skip the From_ line itself. */
+		newline = memchr (start, '\n', end - start);
+		if (newline == NULL) {
+			g_atomic_int_inc (&context->n_done);
+			continue;
+		}
+
+		start = newline + 1;
+
+		/* The blank line before the next From_ line
+		 * separates messages, it is not part of them. */
+		if (end - start >= 2 && end[-1] == '\n' && end[-2] == '\n')
+			end--;
+
+		mbox_import_parse_headers (start, end, &date, &flags);
+
+		/* Messages without escaped lines are written straight
+		 * from the mapping, without any intermediate copy. */
+		if (mbox_import_needs_unescape (start, end)) {
+			mbox_import_unescape (start, end, unescaped);
+			message_data = unescaped->data;
+			message_len = unescaped->len;
+		} else {
+			message_data = (const guint8 *) start;
+			message_len = end - start;
+		}
+
+		uid = g_strdup_printf (
+			"%s-%" G_GSIZE_FORMAT, context->uid_prefix,
+			g_array_index (context->offsets, gsize, ii));
+
+		if (!m_mail_folder_writer_write (
+			context->writer, uid, date, flags,
+			message_data, message_len,
+			context->cancellable, &local_error))
+			mbox_import_take_error (context, local_error);
+
+		g_free (uid);
+
+		g_atomic_int_inc (&context->n_done);
+	}
+
+	g_byte_array_free (unescaped, TRUE);
+
+	mbox_import_task_done (context);
+}
+
+/* Helper for m_mbox_import_sync() */
+static void
+mbox_import_wait (ImportContext *context,
+                  guint n_messages)
+{
+	g_mutex_lock (&context->lock);
+
+	while (context->pending > 0) {
+		gint64 end_time;
+
+		end_time = g_get_monotonic_time () + G_TIME_SPAN_SECOND / 4;
+		g_cond_wait_until (&context->cond, &context->lock, end_time);
+
+		if (n_messages > 0)
+			camel_operation_progress (
+				context->cancellable,
+				(g_atomic_int_get (&context->n_done) * 100) / n_messages);
+	}
+
+	g_mutex_unlock (&context->lock);
+}
+
+/* Helper for m_mbox_import_sync() */
+static gboolean
+mbox_import_find_messages (ImportContext *context,
+                           guint n_workers,
+                           GError **error)
+{
+	GThreadPool *pool;
+	ScanTask *tasks;
+	gsize chunk_size;
+	guint ii;
+
+	pool = g_thread_pool_new (
+		mbox_import_scan_thread, NULL,
+		n_workers, FALSE, error);
+	if (pool == NULL)
+		return FALSE;
+
+	chunk_size = MAX (context->length / n_workers + 1, 1024 * 1024);
+
+	tasks = g_new0 (ScanTask, n_workers);
+
+	g_mutex_lock (&context->lock);
+
+	for (ii = 0; ii < n_workers; ii++) {
+		tasks[ii].context = context;
+		tasks[ii].start = MIN (ii * chunk_size, context->length);
+		tasks[ii].end = MIN (tasks[ii].start + chunk_size, context->length);
+		tasks[ii].offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+		if (tasks[ii].start < tasks[ii].end) {
+			context->pending++;
+			g_thread_pool_push (pool, &tasks[ii], NULL);
+		}
+	}
+
+	g_mutex_unlock (&context->lock);
+
+	mbox_import_wait (context, 0);
+
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	/* Chunks are in file order, so the offsets come out sorted. */
+	for (ii = 0; ii < n_workers; ii++) {
+		g_array_append_vals (
+			context->offsets,
+			tasks[ii].offsets->data,
+			tasks[ii].offsets->len);
+		g_array_free (tasks[ii].offsets, TRUE);
+	}
+
+	g_free (tasks);
+
+	return TRUE;
+}
+
+/**
+ * m_mbox_import_sync:
+ * @mbox: an mbox file
+ * @destination: root of the offline store
+ * @options: (nullable): an #MExportOptions, or %NULL for defaults
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Splits @mbox into single messages and delivers them into the
+ * offline store at @destination through the same writer the export
+ * uses, so the layout and pack settings in @options apply.  The file
+ * is memory-mapped, message boundaries are found by several threads
+ * at once, and the messages are written by a pool of workers straight
+ * from the mapping, with ">From " lines unescaped.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_mbox_import_sync (GFile *mbox,
+                    GFile *destination,
+                    const MExportOptions *options,
+                    GCancellable *cancellable,
+                    GError **error)
+{
+	ImportContext context;
+	GMappedFile *mapped_file;
+	GThreadPool *pool = NULL;
+	gchar *path;
+	guint n_workers, n_messages = 0, ii;
+	gboolean success = TRUE;
+
+	g_return_val_if_fail (G_IS_FILE (mbox), FALSE);
+	g_return_val_if_fail (G_IS_FILE (destination), FALSE);
+
+	path = g_file_get_path (mbox);
+	if (path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Only local mbox files can be imported"));
+		return FALSE;
+	}
+
+	mapped_file = g_mapped_file_new (path, FALSE, error);
+	if (mapped_file == NULL) {
+		g_free (path);
+		return FALSE;
+	}
+
+	memset (&context, 0, sizeof (ImportContext));
+	context.data = g_mapped_file_get_contents (mapped_file);
+	context.length = g_mapped_file_get_length (mapped_file);
+	context.offsets = g_array_new (FALSE, FALSE, sizeof (gsize));
+	context.uid_prefix = g_strdup_printf ("mbox-%08x", g_str_hash (path));
+	context.cancellable = cancellable;
+	g_mutex_init (&context.lock);
+	g_cond_init (&context.cond);
+
+	if (context.length > 0)
+		posix_madvise ((gpointer) context.data, context.length, POSIX_MADV_SEQUENTIAL);
+
+	n_workers = MAX (g_get_num_processors (), 1);
+
+	camel_operation_push_message (
+		cancellable, _("Importing “%s”"), path);
+
+	success = mbox_import_find_messages (&context, n_workers, error);
+
+	if (success && context.offsets->len == 0) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			_("“%s” is not an mbox file"), path);
+		success = FALSE;
+	}
+
+	if (success) {
+		context.writer = m_mail_folder_writer_new (destination, options, error);
+		success = context.writer != NULL;
+	}
+
+	if (success) {
+		pool = g_thread_pool_new (
+			mbox_import_split_thread, NULL,
+			n_workers, FALSE, error);
+		success = pool != NULL;
+	}
+
+	if (success) {
+		SplitTask *tasks;
+		guint n_tasks;
+
+		n_messages = context.offsets->len;
+
+		/* Sentinel, so that message ii ends at offset ii + 1. */
+		g_array_append_val (context.offsets, context.length);
+
+		n_tasks = (n_messages + SPLIT_BATCH_SIZE - 1) / SPLIT_BATCH_SIZE;
+		tasks = g_new0 (SplitTask, n_tasks);
+
+		g_mutex_lock (&context.lock);
+
+		for (ii = 0; ii < n_tasks; ii++) {
+			tasks[ii].context = &context;
+			tasks[ii].first = ii * SPLIT_BATCH_SIZE;
+			tasks[ii].last = MIN (tasks[ii].first + SPLIT_BATCH_SIZE, n_messages);
+
+			context.pending++;
+			g_thread_pool_push (pool, &tasks[ii], NULL);
+		}
+
+		g_mutex_unlock (&context.lock);
+
+		mbox_import_wait (&context, n_messages);
+
+		g_thread_pool_free (pool, FALSE, TRUE);
+		g_free (tasks);
+
+		if (context.error != NULL) {
+			g_propagate_error (error, context.error);
+			context.error = NULL;
+			success = FALSE;
+
+		} else if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			success = FALSE;
+		}
+	}
+
+	if (context.writer != NULL) {
+		if (!m_mail_folder_writer_close (context.writer, success ? error : NULL))
+			success = FALSE;
+		if (success && !m_mail_folder_writer_publish (context.writer, error))
+			success = FALSE;
+		m_mail_folder_writer_free (context.writer);
+	}
+
+	camel_operation_pop_message (cancellable);
+
+	g_clear_error (&context.error);
+	g_mutex_clear (&context.lock);
+	g_cond_clear (&context.cond);
+	g_array_free (context.offsets, TRUE);
+	g_free (context.uid_prefix);
+	g_mapped_file_unref (mapped_file);
+	g_free (path);
+
+	return success;
+}
+
+void
+m_mbox_import (GFile *mbox,
+               GFile *destination,
+               const MExportOptions *options,
+               gint io_priority,
+               GCancellable *cancellable,
+               GAsyncReadyCallback callback,
+               gpointer user_data)
+{
+	GSimpleAsyncResult *simple;
+	AsyncContext *context;
+
+	g_return_if_fail (G_IS_FILE (mbox));
+	g_return_if_fail (G_IS_FILE (destination));
+
+	context = g_slice_new0 (AsyncContext);
+	context->destination = g_object_ref (destination);
+	context->options = options != NULL ?
+		m_export_options_copy (options) : m_export_options_new ();
+
+	simple = g_simple_async_result_new (
+		G_OBJECT (mbox), callback, user_data,
+		m_mbox_import);
+
+	g_simple_async_result_set_check_cancellable (simple, cancellable);
+
+	g_simple_async_result_set_op_res_gpointer (
+		simple, context, (GDestroyNotify) async_context_free);
+
+	g_simple_async_result_run_in_thread (
+		simple, mbox_import_thread,
+		io_priority, cancellable);
+
+	g_object_unref (simple);
+}
+
+gboolean
+m_mbox_import_finish (GFile *mbox,
+                      GAsyncResult *result,
+                      GError **error)
+{
+	GSimpleAsyncResult *simple;
+
+	g_return_val_if_fail (
+		g_simple_async_result_is_valid (
+		result, G_OBJECT (mbox),
+		m_mbox_import), FALSE);
+
+	simple = G_SIMPLE_ASYNC_RESULT (result);
+
+	/* Assume success unless a GError is set. */
+	return !g_simple_async_result_propagate_error (simple, error);
+}
@@ -0,0 +1,30 @@
+#ifndef M_MBOX_IMPORT_H
+#define M_MBOX_IMPORT_H
+
+/* Splitting legacy mbox archives into the offline store. */
+
+#include <camel/camel.h>
+
+#include "m-export-options.h"
+
+G_BEGIN_DECLS
+
+gboolean	m_mbox_import_sync		(GFile *mbox,
+						 GFile *destination,
+						 const MExportOptions *options,
+						 GCancellable *cancellable,
+						 GError **error);
+void		m_mbox_import			(GFile *mbox,
+						 GFile *destination,
+						 const MExportOptions *options,
+						 gint io_priority,
+						 GCancellable *cancellable,
+						 GAsyncReadyCallback callback,
+						 gpointer user_data);
+gboolean	m_mbox_import_finish		(GFile *mbox,
+						 GAsyncResult *result,
+						 GError **error);
+
+G_END_DECLS
+
+#endif /* M_MBOX_IMPORT_H */
@@ -0,0 +1,1254 @@
+#include "config.h"
+
+#include "m-store-bundle.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib/gi18n-lib.h>
+#include <glib/gstdio.h>
+
+#include "m-export-manifest.h"
+#include "m-maildir-utils.h"
+#include "m-mail-folder-utils.h"
+#include "m-mail-pack.h"
+
+#define BUNDLE_MAGIC		"EOSBNDL1"
+#define BUNDLE_MAGIC_LEN	8
+
+/* In generations/, which also holds one file per generation,
+ * named by its number. */
+#define BUNDLE_SOURCE_ID_FILE	"source-id"
+
+/* In the root of a copy: the source ID and the generation. */
+#define BUNDLE_APPLIED_FILE	"offline-store.generation"
+
+/* One byte each, followed by the UID. */
+#define BUNDLE_RECORD_DELETE	'D'	/* nothing else */
+#define BUNDLE_RECORD_FLAGS	'F'	/* flags (4) */
+#define BUNDLE_RECORD_MESSAGE	'M'	/* date (8), flags (4), length (8), data */
+#define BUNDLE_RECORD_END	'E'	/* no UID either */
+
+typedef struct _StoreMessage StoreMessage;
+
+/* A message found in the store. */
+struct _StoreMessage {
+	guint32 flags;
+	gint64 date;
+
+	/* Either a maildir file, or a message in a pack. */
+	gchar *path;
+	MMailPack *pack;
+};
+
+static void
+store_message_free (StoreMessage *message)
+{
+	g_free (message->path);
+
+	g_slice_free (StoreMessage, message);
+}
+
+static void
+store_bundle_set_corrupt_error (GError **error)
+{
+	g_set_error (
+		error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		_("The bundle is truncated or corrupt"));
+}
+
+/* Helper for store_bundle_scan() */
+static void
+store_bundle_scan_maildir (const gchar *maildir,
+                           GHashTable *messages)
+{
+	const gchar *subdirs[] = { "cur", "new" };
+	guint ii;
+
+	for (ii = 0; ii < G_N_ELEMENTS (subdirs); ii++) {
+		const gchar *name;
+		gchar *path;
+		GDir *dir;
+
+		path = g_build_filename (maildir, subdirs[ii], NULL);
+		dir = g_dir_open (path, 0, NULL);
+
+		while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+			StoreMessage *message;
+			gchar *uid;
+
+			if (*name == '.')
+				continue;
+
+			/* Files not written by us are left alone. */
+			uid = m_maildir_dup_uid (name);
+			if (uid == NULL)
+				continue;
+
+			message = g_slice_new0 (StoreMessage);
+			message->flags = m_maildir_get_flags (name);
+			message->date = g_ascii_strtoll (name, NULL, 10);
+			message->path = g_build_filename (path, name, NULL);
+
+			g_hash_table_insert (messages, uid, message);
+		}
+
+		if (dir != NULL)
+			g_dir_close (dir);
+
+		g_free (path);
+	}
+}
+
+/* Helper for store_bundle_scan() */
+static gboolean
+store_bundle_add_pack_message (MMailPack *pack,
+                               const gchar *uid,
+                               guint32 flags,
+                               gint64 date,
+                               gpointer user_data)
+{
+	GHashTable *messages = user_data;
+	StoreMessage *message;
+
+	message = g_slice_new0 (StoreMessage);
+	message->flags = flags;
+	message->date = date;
+	message->pack = pack;
+
+	g_hash_table_insert (messages, g_strdup (uid), message);
+
+	return TRUE;
+}
+
+/* Finds every message of the store, with its flags; a store which
+ * does not exist yet is empty. */
+static gboolean
+store_bundle_scan (const gchar *root_path,
+                   gboolean writable,
+                   GHashTable *messages,
+                   GPtrArray *packs,
+                   GError **error)
+{
+	const gchar *name;
+	gchar *pack_dir;
+	GDir *dir;
+
+	store_bundle_scan_maildir (root_path, messages);
+
+	/* Maildir++ subfolders of the date-partitioned layout. */
+	dir = g_dir_open (root_path, 0, NULL);
+
+	while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+		gchar *path;
+
+		if (*name != '.' || g_str_equal (name, "..") || g_str_equal (name, "."))
+			continue;
+
+		path = g_build_filename (root_path, name, NULL);
+		if (g_file_test (path, G_FILE_TEST_IS_DIR))
+			store_bundle_scan_maildir (path, messages);
+		g_free (path);
+	}
+
+	if (dir != NULL)
+		g_dir_close (dir);
+
+	pack_dir = g_build_filename (root_path, M_MAIL_PACK_DIR_NAME, NULL);
+	dir = g_dir_open (pack_dir, 0, NULL);
+
+	while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+		MMailPack *pack;
+		gchar *path;
+
+		if (!g_str_has_suffix (name, ".pack"))
+			continue;
+
+		path = g_build_filename (pack_dir, name, NULL);
+		pack = m_mail_pack_open (path, writable, error);
+		g_free (path);
+
+		if (pack == NULL) {
+			g_dir_close (dir);
+			g_free (pack_dir);
+			return FALSE;
+		}
+
+		g_ptr_array_add (packs, pack);
+		m_mail_pack_foreach (pack, store_bundle_add_pack_message, messages);
+	}
+
+	if (dir != NULL)
+		g_dir_close (dir);
+
+	g_free (pack_dir);
+
+	return TRUE;
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static gchar *
+store_bundle_dup_source_id (const gchar *generations_dir,
+                            GError **error)
+{
+	gchar *filename, *source_id = NULL;
+
+	filename = g_build_filename (generations_dir, BUNDLE_SOURCE_ID_FILE, NULL);
+
+	/* Made up once, tells the copies of different stores apart. */
+	if (g_file_get_contents (filename, &source_id, NULL, NULL)) {
+		g_strstrip (source_id);
+	} else {
+		source_id = g_uuid_string_random ();
+
+		if (!g_file_set_contents (filename, source_id, -1, error))
+			g_clear_pointer (&source_id, g_free);
+	}
+
+	g_free (filename);
+
+	return source_id;
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static guint
+store_bundle_get_latest_generation (const gchar *generations_dir)
+{
+	const gchar *name;
+	guint latest = 0;
+	GDir *dir;
+
+	dir = g_dir_open (generations_dir, 0, NULL);
+
+	while (dir != NULL && (name = g_dir_read_name (dir)) != NULL) {
+		gchar *end;
+		guint64 generation;
+
+		generation = g_ascii_strtoull (name, &end, 10);
+		if (end != name && *end == '\0' && generation <= G_MAXUINT32)
+			latest = MAX (latest, (guint) generation);
+	}
+
+	if (dir != NULL)
+		g_dir_close (dir);
+
+	return latest;
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static GHashTable *
+store_bundle_load_generation (const gchar *generations_dir,
+                              guint generation,
+                              GError **error)
+{
+	GHashTable *flags;
+	gchar *filename, *contents, *name;
+	gchar **lines;
+	guint ii;
+
+	flags = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	/* The empty store, which every complete bundle starts from. */
+	if (generation == 0)
+		return flags;
+
+	name = g_strdup_printf ("%u", generation);
+	filename = g_build_filename (generations_dir, name, NULL);
+	g_free (name);
+
+	if (!g_file_get_contents (filename, &contents, NULL, error)) {
+		g_hash_table_destroy (flags);
+		g_free (filename);
+		return NULL;
+	}
+
+	lines = g_strsplit (contents, "\n", -1);
+
+	/* One "UID<tab>flags" line per message. */
+	for (ii = 0; lines[ii] != NULL; ii++) {
+		gchar *tab;
+
+		tab = strrchr (lines[ii], '\t');
+		if (tab == NULL)
+			continue;
+
+		*tab++ = '\0';
+
+		g_hash_table_insert (
+			flags, g_strdup (lines[ii]),
+			GUINT_TO_POINTER (strtoul (tab, NULL, 10)));
+	}
+
+	g_strfreev (lines);
+	g_free (contents);
+	g_free (filename);
+
+	return flags;
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static gboolean
+store_bundle_save_generation (const gchar *generations_dir,
+                              guint generation,
+                              GHashTable *messages,
+                              GError **error)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GString *contents;
+	gchar *filename, *name;
+	gboolean success;
+
+	contents = g_string_sized_new (g_hash_table_size (messages) * 32);
+
+	g_hash_table_iter_init (&iter, messages);
+
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		StoreMessage *message = value;
+
+		g_string_append_printf (contents, "%s\t%u\n", (const gchar *) key, message->flags);
+	}
+
+	name = g_strdup_printf ("%u", generation);
+	filename = g_build_filename (generations_dir, name, NULL);
+
+	success = g_file_set_contents (filename, contents->str, contents->len, error);
+
+	g_free (filename);
+	g_free (name);
+	g_string_free (contents, TRUE);
+
+	return success;
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static gboolean
+store_bundle_put_uid (GDataOutputStream *stream,
+                      gchar type,
+                      const gchar *uid,
+                      GCancellable *cancellable,
+                      GError **error)
+{
+	gsize length = MIN (strlen (uid), G_MAXUINT16);
+
+	return g_data_output_stream_put_byte (stream, type, cancellable, error) &&
+		g_data_output_stream_put_uint16 (stream, length, cancellable, error) &&
+		g_output_stream_write_all (
+			G_OUTPUT_STREAM (stream), uid, length,
+			NULL, cancellable, error);
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static gboolean
+store_bundle_put_message (GDataOutputStream *stream,
+                          const gchar *uid,
+                          StoreMessage *message,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+	GMappedFile *mapped_file = NULL;
+	GBytes *bytes = NULL;
+	gconstpointer data;
+	gsize length;
+	gboolean success;
+
+	if (message->pack != NULL) {
+		bytes = m_mail_pack_read (message->pack, uid, NULL, cancellable, error);
+		if (bytes == NULL)
+			return FALSE;
+
+		data = g_bytes_get_data (bytes, &length);
+	} else {
+		mapped_file = g_mapped_file_new (message->path, FALSE, error);
+		if (mapped_file == NULL)
+			return FALSE;
+
+		data = g_mapped_file_get_contents (mapped_file);
+		length = g_mapped_file_get_length (mapped_file);
+	}
+
+	success =
+		store_bundle_put_uid (stream, BUNDLE_RECORD_MESSAGE, uid, cancellable, error) &&
+		g_data_output_stream_put_int64 (stream, message->date, cancellable, error) &&
+		g_data_output_stream_put_uint32 (stream, message->flags, cancellable, error) &&
+		g_data_output_stream_put_uint64 (stream, length, cancellable, error) &&
+		g_output_stream_write_all (
+			G_OUTPUT_STREAM (stream), data, length,
+			NULL, cancellable, error);
+
+	if (mapped_file != NULL)
+		g_mapped_file_unref (mapped_file);
+	if (bytes != NULL)
+		g_bytes_unref (bytes);
+
+	return success;
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static gint
+store_bundle_compare_new (gconstpointer a,
+                          gconstpointer b,
+                          gpointer user_data)
+{
+	GHashTable *messages = user_data;
+	StoreMessage *message_a, *message_b;
+	const gchar *key_a, *key_b;
+
+	message_a = g_hash_table_lookup (messages, *((const gchar **) a));
+	message_b = g_hash_table_lookup (messages, *((const gchar **) b));
+
+	/* Directory by directory, and pack by pack. */
+	key_a = message_a->pack != NULL ?
+		m_mail_pack_get_filename (message_a->pack) : message_a->path;
+	key_b = message_b->pack != NULL ?
+		m_mail_pack_get_filename (message_b->pack) : message_b->path;
+
+	return strcmp (key_a, key_b);
+}
+
+/* Helper for m_store_bundle_create_sync() */
+static gboolean
+store_bundle_write (GDataOutputStream *stream,
+                    const gchar *source_id,
+                    guint since,
+                    guint generation,
+                    GHashTable *previous,
+                    GHashTable *messages,
+                    GCancellable *cancellable,
+                    GError **error)
+{
+	GHashTableIter iter;
+	GPtrArray *new_uids;
+	gpointer key, value;
+	gboolean success;
+	guint ii;
+
+	success =
+		g_output_stream_write_all (
+			G_OUTPUT_STREAM (stream), BUNDLE_MAGIC, BUNDLE_MAGIC_LEN,
+			NULL, cancellable, error) &&
+		store_bundle_put_uid (stream, BUNDLE_RECORD_END, source_id, cancellable, error) &&
+		g_data_output_stream_put_uint32 (stream, since, cancellable, error) &&
+		g_data_output_stream_put_uint32 (stream, generation, cancellable, error);
+
+	/* Deletions first, so that a copy never holds more than either
+	 * of the two generations at any time while applying. */
+	g_hash_table_iter_init (&iter, previous);
+
+	while (success && g_hash_table_iter_next (&iter, &key, NULL)) {
+		if (!g_hash_table_contains (messages, key))
+			success = store_bundle_put_uid (
+				stream, BUNDLE_RECORD_DELETE, key,
+				cancellable, error);
+	}
+
+	new_uids = g_ptr_array_new ();
+
+	g_hash_table_iter_init (&iter, messages);
+
+	while (success && g_hash_table_iter_next (&iter, &key, &value)) {
+		StoreMessage *message = value;
+		gpointer previous_flags;
+
+		if (!g_hash_table_lookup_extended (previous, key, NULL, &previous_flags)) {
+			g_ptr_array_add (new_uids, key);
+		} else if (GPOINTER_TO_UINT (previous_flags) != message->flags) {
+			success =
+				store_bundle_put_uid (
+					stream, BUNDLE_RECORD_FLAGS, key,
+					cancellable, error) &&
+				g_data_output_stream_put_uint32 (
+					stream, message->flags,
+					cancellable, error);
+		}
+	}
+
+	/* In the order of the store, to read it sequentially. */
+	g_ptr_array_sort_with_data (new_uids, store_bundle_compare_new, messages);
+
+	for (ii = 0; success && ii < new_uids->len; ii++) {
+		const gchar *uid = g_ptr_array_index (new_uids, ii);
+
+		success = store_bundle_put_message (
+			stream, uid, g_hash_table_lookup (messages, uid),
+			cancellable, error);
+
+		camel_operation_progress (cancellable, (ii + 1) * 100 / new_uids->len);
+	}
+
+	if (success)
+		success = g_data_output_stream_put_byte (
+			stream, BUNDLE_RECORD_END, cancellable, error);
+
+	g_ptr_array_unref (new_uids);
+
+	return success;
+}
+
+/**
+ * m_store_bundle_create_sync:
+ * @source: root of the offline store
+ * @bundle: the bundle file to write
+ * @since: the generation the copy to bring up to date is at, or
+ *    %M_STORE_BUNDLE_SINCE_LATEST
+ * @out_generation: (out) (optional): return location for the
+ *    generation the bundle brings a copy to
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes what changed in the offline store at @source since the
+ * generation @since into @bundle, and records the store as it is now
+ * as a new generation, which the next bundle starts from by default.
+ * When @source holds export snapshots, the latest snapshot is used.
+ * @source has to be a single store: the root of an export of several
+ * folders fails, each folder below it makes its own bundles.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_store_bundle_create_sync (GFile *source,
+                            GFile *bundle,
+                            guint since,
+                            guint *out_generation,
+                            GCancellable *cancellable,
+                            GError **error)
+{
+	GHashTable *previous, *messages;
+	GPtrArray *packs;
+	GFileOutputStream *file_stream;
+	GOutputStream *converter_stream;
+	GDataOutputStream *data_stream;
+	GConverter *compressor;
+	gchar *root_path, *cur, *generations_dir, *source_id;
+	gboolean success;
+	guint latest;
+
+	g_return_val_if_fail (G_IS_FILE (source), FALSE);
+	g_return_val_if_fail (G_IS_FILE (bundle), FALSE);
+
+	root_path = g_file_get_path (source);
+	if (root_path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Bundles can be made only from a local directory"));
+		return FALSE;
+	}
+
+	/* Next to the snapshots, not in one, since every
+	 * export starts a new snapshot without them. */
+	generations_dir = g_build_filename (root_path, M_STORE_BUNDLE_GENERATIONS_DIR, NULL);
+
+	/* A destination holding snapshots bundles its latest one. */
+	cur = g_build_filename (root_path, "cur", NULL);
+	if (!g_file_test (cur, G_FILE_TEST_IS_DIR)) {
+		gchar *latest_path;
+
+		latest_path = g_build_filename (root_path, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+
+		if (g_file_test (latest_path, G_FILE_TEST_IS_DIR)) {
+			g_free (root_path);
+			root_path = latest_path;
+		} else {
+			g_free (latest_path);
+		}
+	}
+	g_free (cur);
+
+	/* Anything else, like the root of an export of all folders
+	 * with one store per folder below it, would make an empty
+	 * bundle; UIDs are unique within a folder only. */
+	cur = g_build_filename (root_path, "cur", NULL);
+	success = g_file_test (cur, G_FILE_TEST_IS_DIR);
+	g_free (cur);
+
+	if (!success) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+			_("“%s” is neither an offline store nor holds export snapshots; "
+			  "of an export of several folders, bundle each folder on its own"),
+			root_path);
+		g_free (generations_dir);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	if (g_mkdir_with_parents (generations_dir, 0700) == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to create “%s”: %s"),
+			generations_dir, g_strerror (errsv));
+		g_free (generations_dir);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	source_id = store_bundle_dup_source_id (generations_dir, error);
+	if (source_id == NULL) {
+		g_free (generations_dir);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	latest = store_bundle_get_latest_generation (generations_dir);
+
+	if (since == M_STORE_BUNDLE_SINCE_LATEST)
+		since = latest;
+
+	previous = since <= latest ?
+		store_bundle_load_generation (generations_dir, since, error) : NULL;
+
+	if (previous == NULL) {
+		if (since > latest)
+			g_set_error (
+				error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+				_("There is no generation %u, the latest is %u"),
+				since, latest);
+		g_free (source_id);
+		g_free (generations_dir);
+		g_free (root_path);
+		return FALSE;
+	}
+
+	messages = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) store_message_free);
+	packs = g_ptr_array_new_with_free_func ((GDestroyNotify) m_mail_pack_free);
+
+	success = store_bundle_scan (root_path, FALSE, messages, packs, error);
+
+	file_stream = success ? g_file_replace (
+		bundle, NULL, FALSE, G_FILE_CREATE_PRIVATE,
+		cancellable, error) : NULL;
+
+	if (file_stream != NULL) {
+		camel_operation_push_message (cancellable, _("Writing bundle"));
+
+		compressor = G_CONVERTER (g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
+		converter_stream = g_converter_output_stream_new (G_OUTPUT_STREAM (file_stream), compressor);
+		data_stream = g_data_output_stream_new (converter_stream);
+
+		success = store_bundle_write (
+			data_stream, source_id, since, latest + 1,
+			previous, messages, cancellable, error);
+
+		/* Also closes the streams below, which flushes the
+		 * compressor and the file, and may still fail. */
+		if (!g_output_stream_close (G_OUTPUT_STREAM (data_stream), cancellable, success ? error : NULL))
+			success = FALSE;
+
+		g_object_unref (data_stream);
+		g_object_unref (converter_stream);
+		g_object_unref (compressor);
+		g_object_unref (file_stream);
+
+		camel_operation_pop_message (cancellable);
+	} else {
+		success = FALSE;
+	}
+
+	/* Recorded only once the bundle to get there exists. */
+	if (success)
+		success = store_bundle_save_generation (
+			generations_dir, latest + 1, messages, error);
+
+	if (success && out_generation != NULL)
+		*out_generation = latest + 1;
+
+	g_hash_table_destroy (messages);
+	g_ptr_array_unref (packs);
+	g_hash_table_destroy (previous);
+	g_free (source_id);
+	g_free (generations_dir);
+	g_free (root_path);
+
+	return success;
+}
+
+/* Helper for m_store_bundle_apply_sync() */
+static gchar *
+store_bundle_read_uid (GDataInputStream *stream,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+	GError *local_error = NULL;
+	gchar *uid;
+	gsize n_read = 0;
+	guint16 length;
+
+	length = g_data_input_stream_read_uint16 (stream, cancellable, &local_error);
+	if (local_error != NULL) {
+		g_propagate_error (error, local_error);
+		return NULL;
+	}
+
+	uid = g_malloc (length + 1);
+
+	if (!g_input_stream_read_all (
+		G_INPUT_STREAM (stream), uid, length,
+		&n_read, cancellable, error)) {
+		g_free (uid);
+		return NULL;
+	}
+
+	if (n_read != length) {
+		store_bundle_set_corrupt_error (error);
+		g_free (uid);
+		return NULL;
+	}
+
+	uid[length] = '\0';
+
+	return uid;
+}
+
+/* Helper for m_store_bundle_apply_sync() */
+static gboolean
+store_bundle_delete (GHashTable *messages,
+                     const gchar *uid,
+                     MExportManifest *manifest,
+                     GError **error)
+{
+	StoreMessage *message;
+
+	message = g_hash_table_lookup (messages, uid);
+
+	/* Gone already, from an earlier attempt. */
+	if (message == NULL)
+		return TRUE;
+
+	if (message->pack != NULL) {
+		m_mail_pack_remove (message->pack, uid);
+	} else if (g_unlink (message->path) == -1 && errno != ENOENT) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to remove “%s”: %s"),
+			message->path, g_strerror (errsv));
+		return FALSE;
+	}
+
+	if (manifest != NULL)
+		m_export_manifest_remove (manifest, uid);
+
+	g_hash_table_remove (messages, uid);
+
+	return TRUE;
+}
+
+/* Helper for m_store_bundle_apply_sync() */
+static gboolean
+store_bundle_set_flags (GHashTable *messages,
+                        const gchar *uid,
+                        guint32 flags,
+                        GError **error)
+{
+	StoreMessage *message;
+	gchar *dirname, *maildir, *basename, *filename, *path;
+	const gchar *info;
+	gboolean success = TRUE;
+
+	message = g_hash_table_lookup (messages, uid);
+
+	if (message == NULL || message->flags == flags)
+		return TRUE;
+
+	if (message->pack != NULL)
+		return m_mail_pack_add (
+			message->pack, uid, flags, message->date,
+			NULL, 0, NULL, error);
+
+	/* Renamed into cur/, which is where messages with any
+	 * flags belong, even if it was in new/ before. */
+	dirname = g_path_get_dirname (message->path);
+	maildir = g_path_get_dirname (dirname);
+	basename = g_path_get_basename (message->path);
+
+	info = strchr (basename, ':');
+	if (info != NULL)
+		basename[info - basename] = '\0';
+
+	filename = m_maildir_build_filename (basename, flags);
+	path = g_build_filename (maildir, "cur", filename, NULL);
+
+	if (g_rename (message->path, path) == -1) {
+		gint errsv = errno;
+
+		g_set_error (
+			error, G_IO_ERROR,
+			g_io_error_from_errno (errsv),
+			_("Failed to rename “%s”: %s"),
+			message->path, g_strerror (errsv));
+		success = FALSE;
+	} else {
+		g_free (message->path);
+		message->path = g_steal_pointer (&path);
+		message->flags = flags;
+	}
+
+	g_free (path);
+	g_free (filename);
+	g_free (basename);
+	g_free (maildir);
+	g_free (dirname);
+
+	return success;
+}
+
+/* Helper for m_store_bundle_apply_sync() */
+static gboolean
+store_bundle_finish_changes (GPtrArray *packs,
+                             MExportManifest *manifest,
+                             const gchar *root_path,
+                             GError **error)
+{
+	gboolean success = TRUE;
+	guint ii;
+
+	/* Keep closing the rest even if one fails, so that
+	 * as many indexes as possible make it to the disk. */
+	for (ii = 0; ii < packs->len; ii++) {
+		if (!m_mail_pack_close (g_ptr_array_index (packs, ii), success ? error : NULL))
+			success = FALSE;
+	}
+
+	if (manifest != NULL &&
+	    !m_export_manifest_save (manifest, root_path, success ? error : NULL))
+		success = FALSE;
+
+	return success;
+}
+
+/* Helper for m_store_bundle_apply_sync() */
+static gboolean
+store_bundle_read_applied (const gchar *root_path,
+                           gchar **out_source_id,
+                           guint *out_generation)
+{
+	gchar *filename, *contents;
+	gchar **fields;
+	gboolean success;
+
+	filename = g_build_filename (root_path, BUNDLE_APPLIED_FILE, NULL);
+	success = g_file_get_contents (filename, &contents, NULL, NULL);
+	g_free (filename);
+
+	if (!success)
+		return FALSE;
+
+	fields = g_strsplit (g_strstrip (contents), " ", 2);
+	success = g_strv_length (fields) == 2;
+
+	if (success) {
+		*out_source_id = g_strdup (fields[0]);
+		*out_generation = (guint) g_ascii_strtoull (fields[1], NULL, 10);
+	}
+
+	g_strfreev (fields);
+	g_free (contents);
+
+	return success;
+}
+
+/* Helper for m_store_bundle_apply_sync() */
+static gboolean
+store_bundle_apply (GDataInputStream *stream,
+                    const gchar *root_path,
+                    GFile *destination,
+                    const MExportOptions *options,
+                    GHashTable *messages,
+                    GPtrArray *packs,
+                    GHashTable *listed,
+                    GCancellable *cancellable,
+                    GError **error)
+{
+	MMailFolderWriter *writer = NULL;
+	MExportManifest *manifest;
+	GByteArray *buffer;
+	gboolean success = TRUE;
+	gboolean done = FALSE;
+
+	manifest = m_export_manifest_load (root_path, NULL);
+	buffer = g_byte_array_new ();
+
+	while (success && !done) {
+		GError *local_error = NULL;
+		gchar *uid = NULL;
+		guchar type;
+		guint32 flags;
+
+		if (g_cancellable_set_error_if_cancelled (cancellable, error)) {
+			success = FALSE;
+			break;
+		}
+
+		type = g_data_input_stream_read_byte (stream, cancellable, &local_error);
+
+		if (local_error == NULL && type != BUNDLE_RECORD_END)
+			uid = store_bundle_read_uid (stream, cancellable, &local_error);
+
+		if (local_error != NULL) {
+			g_propagate_error (error, local_error);
+			success = FALSE;
+			break;
+		}
+
+		switch (type) {
+		case BUNDLE_RECORD_DELETE:
+			success = store_bundle_delete (messages, uid, manifest, error);
+			break;
+
+		case BUNDLE_RECORD_FLAGS:
+			flags = g_data_input_stream_read_uint32 (stream, cancellable, &local_error);
+			if (local_error == NULL)
+				success = store_bundle_set_flags (messages, uid, flags, error);
+			break;
+
+		case BUNDLE_RECORD_MESSAGE: {
+			StoreMessage *message;
+			gint64 date;
+			guint64 length;
+			gsize n_read = 0;
+
+			date = g_data_input_stream_read_int64 (stream, cancellable, &local_error);
+			if (local_error == NULL)
+				flags = g_data_input_stream_read_uint32 (stream, cancellable, &local_error);
+			if (local_error == NULL)
+				length = g_data_input_stream_read_uint64 (stream, cancellable, &local_error);
+			if (local_error != NULL)
+				break;
+
+			if (length > G_MAXUINT) {
+				store_bundle_set_corrupt_error (error);
+				success = FALSE;
+				break;
+			}
+
+			g_byte_array_set_size (buffer, length);
+
+			success = g_input_stream_read_all (
+				G_INPUT_STREAM (stream), buffer->data, length,
+				&n_read, cancellable, error);
+
+			if (success && n_read != length) {
+				store_bundle_set_corrupt_error (error);
+				success = FALSE;
+			}
+
+			if (!success)
+				break;
+
+			if (listed != NULL)
+				g_hash_table_add (listed, g_strdup (uid));
+
+			/* Delivered by an earlier attempt at this bundle,
+			 * with these very flags.  Any other flags, which a
+			 * complete bundle may find, are written anew and
+			 * the writer replaces the old copy. */
+			message = g_hash_table_lookup (messages, uid);
+			if (message != NULL && message->flags == flags)
+				break;
+
+			/* The changes to what was there are complete, the
+			 * writer takes over the packs and the manifest. */
+			if (writer == NULL) {
+				MExportOptions *writer_options;
+
+				success = store_bundle_finish_changes (packs, manifest, root_path, error);
+				g_clear_pointer (&manifest, m_export_manifest_free);
+
+				writer_options = options != NULL ?
+					m_export_options_copy (options) : m_export_options_new ();
+				writer_options->snapshots = FALSE;
+
+				if (success)
+					writer = m_mail_folder_writer_new (destination, writer_options, error);
+				success = writer != NULL;
+
+				m_export_options_free (writer_options);
+
+				if (!success)
+					break;
+			}
+
+			success = m_mail_folder_writer_write (
+				writer, uid, date, flags,
+				buffer->data, length,
+				cancellable, error);
+			break;
+		}
+
+		case BUNDLE_RECORD_END:
+			done = TRUE;
+			break;
+
+		default:
+			store_bundle_set_corrupt_error (error);
+			success = FALSE;
+			break;
+		}
+
+		if (local_error != NULL) {
+			g_propagate_error (error, local_error);
+			success = FALSE;
+		}
+
+		g_free (uid);
+	}
+
+	/* Even after an error, so that the store stays readable
+	 * and the manifest lists what got in. */
+	if (writer != NULL) {
+		if (!m_mail_folder_writer_close (writer, success ? error : NULL))
+			success = FALSE;
+		m_mail_folder_writer_free (writer);
+	} else if (!store_bundle_finish_changes (packs, manifest, root_path, success ? error : NULL)) {
+		success = FALSE;
+	}
+
+	m_export_manifest_free (manifest);
+	g_byte_array_free (buffer, TRUE);
+
+	return success;
+}
+
+/* Helper for m_store_bundle_apply_sync() */
+static gboolean
+store_bundle_delete_unlisted (const gchar *root_path,
+                              GHashTable *listed,
+                              GError **error)
+{
+	MExportManifest *manifest;
+	GHashTable *messages;
+	GPtrArray *packs, *uids;
+	GHashTableIter iter;
+	gpointer key;
+	gboolean success;
+	guint ii;
+
+	messages = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) store_message_free);
+	packs = g_ptr_array_new_with_free_func ((GDestroyNotify) m_mail_pack_free);
+
+	/* Scanned again, the writer changed the packs since. */
+	success = store_bundle_scan (root_path, TRUE, messages, packs, error);
+
+	uids = g_ptr_array_new_with_free_func (g_free);
+
+	g_hash_table_iter_init (&iter, messages);
+
+	while (success && g_hash_table_iter_next (&iter, &key, NULL)) {
+		if (!g_hash_table_contains (listed, key))
+			g_ptr_array_add (uids, g_strdup (key));
+	}
+
+	manifest = m_export_manifest_load (root_path, NULL);
+
+	for (ii = 0; success && ii < uids->len; ii++)
+		success = store_bundle_delete (
+			messages, g_ptr_array_index (uids, ii),
+			manifest, error);
+
+	if (!store_bundle_finish_changes (packs, manifest, root_path, success ? error : NULL))
+		success = FALSE;
+
+	m_export_manifest_free (manifest);
+	g_ptr_array_unref (uids);
+	g_ptr_array_unref (packs);
+	g_hash_table_destroy (messages);
+
+	return success;
+}
+
+/**
+ * m_store_bundle_apply_sync:
+ * @bundle: a bundle from m_store_bundle_create_sync()
+ * @destination: root of the copy of the offline store
+ * @options: (nullable): an #MExportOptions for the new messages, or
+ *    %NULL for defaults
+ * @out_generation: (out) (optional): return location for the
+ *    generation the copy is at now
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Brings the copy at @destination to the generation of the source
+ * store @bundle was made for: deleted messages are removed, flags are
+ * renamed, and new messages are delivered with the layout and packing
+ * of @options.  The copy has to be at the generation @bundle was made
+ * from, unless @bundle is complete.  A complete bundle makes any copy
+ * just like the source: messages it does not hold are removed, and
+ * those it holds with other flags get its flags.  An interrupted
+ * bundle can simply be applied again.  Export snapshots cannot be
+ * updated in place.
+ *
+ * Returns: %TRUE on success, %FALSE on error
+ **/
+gboolean
+m_store_bundle_apply_sync (GFile *bundle,
+                           GFile *destination,
+                           const MExportOptions *options,
+                           guint *out_generation,
+                           GCancellable *cancellable,
+                           GError **error)
+{
+	GHashTable *messages, *listed = NULL;
+	GPtrArray *packs;
+	GFileInputStream *file_stream;
+	GInputStream *converter_stream;
+	GDataInputStream *data_stream;
+	GConverter *decompressor;
+	GError *local_error = NULL;
+	gchar magic[BUNDLE_MAGIC_LEN];
+	gchar *root_path, *latest_path;
+	gchar *source_id = NULL, *applied_source_id = NULL;
+	guint since = 0, generation = 0, applied = 0;
+	gsize n_read = 0;
+	gboolean success;
+
+	g_return_val_if_fail (G_IS_FILE (bundle), FALSE);
+	g_return_val_if_fail (G_IS_FILE (destination), FALSE);
+
+	root_path = g_file_get_path (destination);
+	if (root_path == NULL) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Bundles can be applied only to a local directory"));
+		return FALSE;
+	}
+
+	/* Packs are shared between snapshots by hardlinks. */
+	latest_path = g_build_filename (root_path, M_MAIL_FOLDER_SNAPSHOT_LATEST, NULL);
+	success = !g_file_test (latest_path, G_FILE_TEST_IS_SYMLINK);
+	g_free (latest_path);
+
+	if (!success) {
+		g_set_error (
+			error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+			_("Bundles cannot be applied to export snapshots"));
+		g_free (root_path);
+		return FALSE;
+	}
+
+	file_stream = g_file_read (bundle, cancellable, error);
+	if (file_stream == NULL) {
+		g_free (root_path);
+		return FALSE;
+	}
+
+	decompressor = G_CONVERTER (g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP));
+	converter_stream = g_converter_input_stream_new (G_INPUT_STREAM (file_stream), decompressor);
+	data_stream = g_data_input_stream_new (converter_stream);
+
+	success = g_input_stream_read_all (
+		G_INPUT_STREAM (data_stream), magic, BUNDLE_MAGIC_LEN,
+		&n_read, cancellable, error);
+
+	if (success && (n_read != BUNDLE_MAGIC_LEN ||
+	    memcmp (magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN) != 0)) {
+		store_bundle_set_corrupt_error (error);
+		success = FALSE;
+	}
+
+	/* The source ID comes as the UID of an end record. */
+	if (success) {
+		success = g_data_input_stream_read_byte (data_stream, cancellable, &local_error) == BUNDLE_RECORD_END &&
+			(source_id = store_bundle_read_uid (data_stream, cancellable, &local_error)) != NULL;
+		if (success)
+			since = g_data_input_stream_read_uint32 (data_stream, cancellable, &local_error);
+		if (success && local_error == NULL)
+			generation = g_data_input_stream_read_uint32 (data_stream, cancellable, &local_error);
+
+		if (local_error != NULL) {
+			g_propagate_error (error, local_error);
+			success = FALSE;
+		} else if (!success) {
+			store_bundle_set_corrupt_error (error);
+		}
+	}
+
+	if (success && since > 0) {
+		if (!store_bundle_read_applied (root_path, &applied_source_id, &applied) ||
+		    g_strcmp0 (applied_source_id, source_id) != 0) {
+			g_set_error (
+				error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				_("“%s” is not a copy of the store the bundle was made from, "
+				  "it takes only a complete bundle"), root_path);
+			success = FALSE;
+		} else if (applied != since) {
+			g_set_error (
+				error, G_IO_ERROR, G_IO_ERROR_FAILED,
+				_("The bundle goes from generation %u, but “%s” is at generation %u"),
+				since, root_path, applied);
+			success = FALSE;
+		}
+	}
+
+	messages = g_hash_table_new_full (
+		g_str_hash, g_str_equal,
+		(GDestroyNotify) g_free,
+		(GDestroyNotify) store_message_free);
+	packs = g_ptr_array_new_with_free_func ((GDestroyNotify) m_mail_pack_free);
+
+	if (success)
+		success = store_bundle_scan (root_path, TRUE, messages, packs, error);
+
+	/* A complete bundle lists every message the copy is to keep,
+	 * whatever the copy held before. */
+	if (since == 0)
+		listed = g_hash_table_new_full (
+			g_str_hash, g_str_equal,
+			(GDestroyNotify) g_free, NULL);
+
+	if (success) {
+		camel_operation_push_message (cancellable, _("Applying bundle"));
+
+		success = store_bundle_apply (
+			data_stream, root_path, destination, options,
+			messages, packs, listed, cancellable, error);
+
+		if (success && listed != NULL)
+			success = store_bundle_delete_unlisted (root_path, listed, error);
+
+		camel_operation_pop_message (cancellable);
+	}
+
+	/* Only now may the next bundle be applied. */
+	if (success) {
+		gchar *filename, *contents;
+
+		filename = g_build_filename (root_path, BUNDLE_APPLIED_FILE, NULL);
+		contents = g_strdup_printf ("%s %u\n", source_id, generation);
+
+		success = g_file_set_contents (filename, contents, -1, error);
+
+		g_free (contents);
+		g_free (filename);
+	}
+
+	if (success && out_generation != NULL)
+		*out_generation = generation;
+
+	if (listed != NULL)
+		g_hash_table_destroy (listed);
+	g_hash_table_destroy (messages);
+	g_ptr_array_unref (packs);
+
+	g_object_unref (data_stream);
+	g_object_unref (converter_stream);
+	g_object_unref (decompressor);
+	g_object_unref (file_stream);
+
+	g_free (applied_source_id);
+	g_free (source_id);
+	g_free (root_path);
+
+	return success;
+}
@@ -0,0 +1,42 @@
+#ifndef M_STORE_BUNDLE_H
+#define M_STORE_BUNDLE_H
+
+/* Delta bundles, to keep copies of an offline store on other machines
+ * in step without copying the whole store again.
+ *
+ * Creating a bundle records a new generation of the source store: the
+ * UIDs and flags it holds, in generations/ at its root, next to the
+ * snapshots if it has any.  The bundle holds what changed since an
+ * earlier generation, deletions first, then flag changes, then the
+ * new messages in full, as one gzip stream to be written and read
+ * front to back.  A copy remembers the generation it was brought to,
+ * and takes only bundles made from that one. */
+
+#include <gio/gio.h>
+
+#include "m-export-options.h"
+
+#define M_STORE_BUNDLE_GENERATIONS_DIR "generations"
+
+/* For m_store_bundle_create_sync(): since the generation recorded
+ * last; generation 0 is the empty store, for a complete bundle. */
+#define M_STORE_BUNDLE_SINCE_LATEST G_MAXUINT
+
+G_BEGIN_DECLS
+
+gboolean	m_store_bundle_create_sync	(GFile *source,
+						 GFile *bundle,
+						 guint since,
+						 guint *out_generation,
+						 GCancellable *cancellable,
+						 GError **error);
+gboolean	m_store_bundle_apply_sync	(GFile *bundle,
+						 GFile *destination,
+						 const MExportOptions *options,
+						 guint *out_generation,
+						 GCancellable *cancellable,
+						 GError **error);
+
+G_END_DECLS
+
+#endif /* M_STORE_BUNDLE_H */
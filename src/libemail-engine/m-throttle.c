@@ -0,0 +1,309 @@
+#include "config.h"
+
+#include "m-throttle.h"
+
+#include <unistd.h>
+
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+
+/* Longest single sleep, so that cancellation and new rates
+ * are noticed quickly even when a lot is owed. */
+#define THROTTLE_MAX_SLEEP (G_USEC_PER_SEC / 10)
+
+/* From linux/ioprio.h, which is not meant for user space. */
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+typedef struct _Bucket Bucket;
+
+struct _Bucket {
+	gdouble rate;	/* per second, zero for unlimited */
+	gdouble tokens;	/* negative when in debt */
+};
+
+struct _MThrottle {
+	volatile gint ref_count;
+
+	GMutex lock;
+	Bucket bytes;
+	Bucket files;
+	gint64 last_refill;
+
+	GSettings *settings;
+	gulong changed_handler_id;
+};
+
+static void
+throttle_bucket_set_rate (Bucket *bucket,
+			  guint rate)
+{
+	bucket->rate = rate;
+
+	/* Start from a full second's worth, and forget any
+	 * debt when the limit is lifted. */
+	bucket->tokens = rate;
+}
+
+static void
+throttle_bucket_refill (Bucket *bucket,
+			gdouble seconds)
+{
+	if (bucket->rate <= 0.0)
+		return;
+
+	/* At most one second's worth can be saved up, which is
+	 * the largest burst a paused export can make. */
+	bucket->tokens = MIN (bucket->tokens + seconds * bucket->rate, bucket->rate);
+}
+
+static gint64
+throttle_bucket_get_wait (Bucket *bucket)
+{
+	if (bucket->rate <= 0.0 || bucket->tokens >= 0.0)
+		return 0;
+
+	return (gint64) (-bucket->tokens / bucket->rate * G_USEC_PER_SEC) + 1;
+}
+
+static void
+throttle_settings_changed_cb (GSettings *settings,
+			      const gchar *key,
+			      MThrottle *throttle)
+{
+	if (g_strcmp0 (key, "max-kib-per-second") != 0 &&
+	    g_strcmp0 (key, "max-files-per-second") != 0)
+		return;
+
+	m_throttle_set_rates (
+		throttle,
+		g_settings_get_uint (settings, "max-kib-per-second") * 1024,
+		g_settings_get_uint (settings, "max-files-per-second"));
+}
+
+/**
+ * m_throttle_new:
+ * @bytes_per_second: the most bytes to write per second, or 0
+ * @files_per_second: the most files to write per second, or 0
+ *
+ * Creates a throttle with fixed limits; 0 means unlimited.
+ *
+ * Returns: (transfer full): a new #MThrottle
+ **/
+MThrottle *
+m_throttle_new (guint bytes_per_second,
+		guint files_per_second)
+{
+	MThrottle *throttle;
+
+	throttle = g_slice_new0 (MThrottle);
+	throttle->ref_count = 1;
+	throttle->last_refill = g_get_monotonic_time ();
+
+	g_mutex_init (&throttle->lock);
+
+	throttle_bucket_set_rate (&throttle->bytes, bytes_per_second);
+	throttle_bucket_set_rate (&throttle->files, files_per_second);
+
+	return throttle;
+}
+
+/**
+ * m_throttle_new_for_settings:
+ * @settings: the plugin's #GSettings
+ *
+ * Creates a throttle which follows the "max-kib-per-second" and
+ * "max-files-per-second" keys of @settings, also while an export is
+ * running.  Changes arrive in the main context @settings belongs to.
+ *
+ * Returns: (transfer full): a new #MThrottle
+ **/
+MThrottle *
+m_throttle_new_for_settings (GSettings *settings)
+{
+	MThrottle *throttle;
+
+	g_return_val_if_fail (G_IS_SETTINGS (settings), NULL);
+
+	throttle = m_throttle_new (
+		g_settings_get_uint (settings, "max-kib-per-second") * 1024,
+		g_settings_get_uint (settings, "max-files-per-second"));
+
+	throttle->settings = g_object_ref (settings);
+	throttle->changed_handler_id = g_signal_connect (
+		settings, "changed",
+		G_CALLBACK (throttle_settings_changed_cb), throttle);
+
+	return throttle;
+}
+
+MThrottle *
+m_throttle_ref (MThrottle *throttle)
+{
+	g_return_val_if_fail (throttle != NULL, NULL);
+
+	g_atomic_int_inc (&throttle->ref_count);
+
+	return throttle;
+}
+
+void
+m_throttle_unref (MThrottle *throttle)
+{
+	if (throttle == NULL)
+		return;
+
+	if (!g_atomic_int_dec_and_test (&throttle->ref_count))
+		return;
+
+	if (throttle->settings != NULL) {
+		g_signal_handler_disconnect (
+			throttle->settings,
+			throttle->changed_handler_id);
+		g_object_unref (throttle->settings);
+	}
+
+	g_mutex_clear (&throttle->lock);
+
+	g_slice_free (MThrottle, throttle);
+}
+
+/**
+ * m_throttle_set_rates:
+ * @throttle: an #MThrottle
+ * @bytes_per_second: the most bytes to write per second, or 0
+ * @files_per_second: the most files to write per second, or 0
+ *
+ * Changes the limits; threads waiting in m_throttle_consume() pick
+ * them up within a tenth of a second.  May be called from any thread.
+ **/
+void
+m_throttle_set_rates (MThrottle *throttle,
+		      guint bytes_per_second,
+		      guint files_per_second)
+{
+	g_return_if_fail (throttle != NULL);
+
+	g_mutex_lock (&throttle->lock);
+
+	if (throttle->bytes.rate != bytes_per_second)
+		throttle_bucket_set_rate (&throttle->bytes, bytes_per_second);
+
+	if (throttle->files.rate != files_per_second)
+		throttle_bucket_set_rate (&throttle->files, files_per_second);
+
+	g_mutex_unlock (&throttle->lock);
+}
+
+/**
+ * m_throttle_consume:
+ * @throttle: an #MThrottle
+ * @n_bytes: bytes about to be written
+ * @n_files: files about to be written
+ * @cancellable: optional #GCancellable object, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * Takes @n_bytes and @n_files from the buckets and sleeps until the
+ * rates allow them.  A message larger than one second's worth is let
+ * through once the bucket is full and the debt is paid off by whoever
+ * comes next, so no size is ever refused.
+ *
+ * Returns: %TRUE to go on, %FALSE when cancelled while waiting
+ **/
+gboolean
+m_throttle_consume (MThrottle *throttle,
+		    gsize n_bytes,
+		    guint n_files,
+		    GCancellable *cancellable,
+		    GError **error)
+{
+	gboolean first = TRUE;
+
+	g_return_val_if_fail (throttle != NULL, FALSE);
+
+	while (TRUE) {
+		gint64 now, wait;
+
+		g_mutex_lock (&throttle->lock);
+
+		now = g_get_monotonic_time ();
+		throttle_bucket_refill (&throttle->bytes, (gdouble) (now - throttle->last_refill) / G_USEC_PER_SEC);
+		throttle_bucket_refill (&throttle->files, (gdouble) (now - throttle->last_refill) / G_USEC_PER_SEC);
+		throttle->last_refill = now;
+
+		/* Wait for earlier debt first, then take our share. */
+		wait = MAX (
+			throttle_bucket_get_wait (&throttle->bytes),
+			throttle_bucket_get_wait (&throttle->files));
+
+		if (wait == 0 && first) {
+			if (throttle->bytes.rate > 0.0)
+				throttle->bytes.tokens -= n_bytes;
+			if (throttle->files.rate > 0.0)
+				throttle->files.tokens -= n_files;
+			first = FALSE;
+		}
+
+		g_mutex_unlock (&throttle->lock);
+
+		if (wait == 0 && !first)
+			return TRUE;
+
+		if (g_cancellable_set_error_if_cancelled (cancellable, error))
+			return FALSE;
+
+		g_usleep (MIN (wait, THROTTLE_MAX_SLEEP));
+	}
+}
+
+/**
+ * m_throttle_lower_io_priority:
+ * @priority: an #MThrottleIOPriority
+ *
+ * Moves the calling thread into a lower I/O scheduling class with
+ * ioprio_set(), on Linux only.  Worker threads are shared within the
+ * process, so the previous priority has to be put back with
+ * m_throttle_restore_io_priority() before the thread goes back.
+ *
+ * Returns: the previous priority, or -1 if nothing was changed
+ **/
+gint
+m_throttle_lower_io_priority (MThrottleIOPriority priority)
+{
+#if defined (SYS_ioprio_get) && defined (SYS_ioprio_set)
+	gint previous, value;
+
+	if (priority == M_THROTTLE_IO_PRIORITY_NORMAL)
+		return -1;
+
+	if (priority == M_THROTTLE_IO_PRIORITY_IDLE)
+		value = IOPRIO_PRIO_VALUE (IOPRIO_CLASS_IDLE, 0);
+	else
+		value = IOPRIO_PRIO_VALUE (IOPRIO_CLASS_BE, 7);
+
+	/* "who" 0 is the calling thread. */
+	previous = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+	if (previous == -1 || previous == value)
+		return -1;
+
+	if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) == -1)
+		return -1;
+
+	return previous;
+#else
+	return -1;
+#endif
+}
+
+void
+m_throttle_restore_io_priority (gint previous)
+{
+#ifdef SYS_ioprio_set
+	if (previous != -1)
+		syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, previous);
+#endif
+}
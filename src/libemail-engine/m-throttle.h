@@ -0,0 +1,40 @@
+#ifndef M_THROTTLE_H
+#define M_THROTTLE_H
+
+/* Keeping background exports out of the way of interactive work:
+ * token buckets on bytes and files per second, adjustable while an
+ * export runs, and a lower I/O scheduling class for its threads. */
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* Keep in sync with the IOPriority enum of the GSettings schema. */
+typedef enum {
+	M_THROTTLE_IO_PRIORITY_NORMAL,
+	M_THROTTLE_IO_PRIORITY_LOW,
+	M_THROTTLE_IO_PRIORITY_IDLE
+} MThrottleIOPriority;
+
+typedef struct _MThrottle MThrottle;
+
+MThrottle *	m_throttle_new			(guint bytes_per_second,
+						 guint files_per_second);
+MThrottle *	m_throttle_new_for_settings	(GSettings *settings);
+MThrottle *	m_throttle_ref			(MThrottle *throttle);
+void		m_throttle_unref		(MThrottle *throttle);
+void		m_throttle_set_rates		(MThrottle *throttle,
+						 guint bytes_per_second,
+						 guint files_per_second);
+gboolean	m_throttle_consume		(MThrottle *throttle,
+						 gsize n_bytes,
+						 guint n_files,
+						 GCancellable *cancellable,
+						 GError **error);
+
+gint		m_throttle_lower_io_priority	(MThrottleIOPriority priority);
+void		m_throttle_restore_io_priority	(gint previous);
+
+G_END_DECLS
+
+#endif /* M_THROTTLE_H */
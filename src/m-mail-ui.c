@@ -34,8 +34,6 @@
 
 #include "mail/m-mail-reader-utils.h"
 
-#define REQUIRE_SERVICE_PROTOCOL "maildir"
-
 static void
 action_mail_message_cb (GtkAction *action,
 			EShellView *shell_view)
@@ -55,6 +53,42 @@ action_mail_message_cb (GtkAction *action,
   }
 }
 
+static void
+action_mail_restore_cb (GtkAction *action,
+			EShellView *shell_view)
+{
+	EShellContent *shell_content;
+	EMailView *mail_view = NULL;
+
+	g_return_if_fail (E_IS_SHELL_VIEW (shell_view));
+
+	shell_content = e_shell_view_get_shell_content (shell_view);
+	g_object_get (shell_content, "mail-view", &mail_view, NULL);
+
+	if (E_IS_MAIL_PANED_VIEW (mail_view))
+		m_mail_reader_restore_messages (E_MAIL_READER (mail_view));
+
+	g_clear_object (&mail_view);
+}
+
+static void
+action_mail_import_mbox_cb (GtkAction *action,
+			    EShellView *shell_view)
+{
+	EShellContent *shell_content;
+	EMailView *mail_view = NULL;
+
+	g_return_if_fail (E_IS_SHELL_VIEW (shell_view));
+
+	shell_content = e_shell_view_get_shell_content (shell_view);
+	g_object_get (shell_content, "mail-view", &mail_view, NULL);
+
+	if (E_IS_MAIL_PANED_VIEW (mail_view))
+		m_mail_reader_import_mbox (E_MAIL_READER (mail_view));
+
+	g_clear_object (&mail_view);
+}
+
 static GtkActionEntry mail_message_menu_entries[] = {
 	{ "my-mail-ui-message-action",
 	  "document-new",
@@ -64,6 +98,22 @@ static GtkActionEntry mail_message_menu_entries[] = {
 	  G_CALLBACK (action_mail_message_cb) }
 };
 
+static GtkActionEntry mail_folder_menu_entries[] = {
+	{ "offline-store-restore-action",
+	  "document-open",
+	  N_("_Restore from Offline Store..."),
+	  NULL,
+	  N_("Append all messages of an offline store to this folder"),
+	  G_CALLBACK (action_mail_restore_cb) },
+
+	{ "offline-store-import-mbox-action",
+	  NULL,
+	  N_("_Import mbox Archive into Offline Store..."),
+	  NULL,
+	  N_("Split an mbox file into an offline store"),
+	  G_CALLBACK (action_mail_import_mbox_cb) }
+};
+
 static void
 m_mail_ui_update_actions_cb (EShellView *shell_view,
 			     GtkActionEntry *entries)
@@ -86,7 +136,9 @@ m_mail_ui_update_actions_cb (EShellView *shell_view,
 		if (selected_store) {
 			CamelProvider *provider = camel_service_get_provider (CAMEL_SERVICE (selected_store));
 
-			if (provider && g_ascii_strcasecmp (provider->protocol, REQUIRE_SERVICE_PROTOCOL) == 0) {
+			/* Any store holding mail, local or remote, but not
+			 * the virtual folders, which only point elsewhere. */
+			if (provider && (provider->flags & CAMEL_PROVIDER_IS_STORAGE) != 0) {
 				account_node = !selected_path || !*selected_path;
 				folder_node = !account_node;
 			}
@@ -114,6 +166,7 @@ m_mail_ui_update_actions_cb (EShellView *shell_view,
 	action_group = e_lookup_action_group (ui_manager, "mail");
 
 	m_utils_enable_actions (action_group, mail_message_menu_entries, G_N_ELEMENTS (mail_message_menu_entries), has_message);
+	m_utils_enable_actions (action_group, mail_folder_menu_entries, G_N_ELEMENTS (mail_folder_menu_entries), folder_node);
 }
 
 void
@@ -127,6 +180,8 @@ m_mail_ui_init (GtkUIManager *ui_manager,
 		"    <menu action='mail-message-menu'>\n"
 		"      <placeholder name='mail-message-custom-menus'>\n"
 		"        <menuitem action=\"my-mail-ui-message-action\"/>\n"
+		"        <menuitem action=\"offline-store-restore-action\"/>\n"
+		"        <menuitem action=\"offline-store-import-mbox-action\"/>\n"
 		"      </placeholder>\n"
 		"    </menu>\n"
 		"  </placeholder>\n"
@@ -147,6 +202,9 @@ m_mail_ui_init (GtkUIManager *ui_manager,
 	e_action_group_add_actions_localized (
 		action_group, GETTEXT_PACKAGE,
 		mail_message_menu_entries, G_N_ELEMENTS (mail_message_menu_entries), shell_view);
+	e_action_group_add_actions_localized (
+		action_group, GETTEXT_PACKAGE,
+		mail_folder_menu_entries, G_N_ELEMENTS (mail_folder_menu_entries), shell_view);
 
 	/* Decide whether we want this option to be visible or not */
 	g_signal_connect (
@@ -13,6 +13,8 @@
 
 #include <libemail-engine/libemail-engine.h>
 #include "../libemail-engine/m-mail-folder-utils.h"
+#include "../libemail-engine/m-mail-folder-restore.h"
+#include "../libemail-engine/m-mbox-import.h"
 
 #include <em-format/e-mail-parser.h>
 #include <em-format/e-mail-part-utils.h>
@@ -114,6 +116,7 @@ m_mail_reader_save_messages (EMailReader *reader)
 	GCancellable *cancellable;
 	AsyncContext *async_context;
 	EShellBackend *shell_backend;
+	MExportOptions *options;
 	CamelMessageInfo *info;
 	CamelFolder *folder;
 	GFile *destination;
@@ -128,7 +131,10 @@ m_mail_reader_save_messages (EMailReader *reader)
 	uids = e_mail_reader_get_selected_uids (reader);
 	g_return_if_fail (uids != NULL && uids->len > 0);
 
-	if (uids->len > 1) {
+	options = m_export_options_new_from_settings ();
+
+	/* The export puts them in its own order otherwise. */
+	if (uids->len > 1 && !options->newest_first) {
 		GtkWidget *message_list;
 
 		message_list = e_mail_reader_get_message_list (reader);
@@ -183,6 +189,7 @@ m_mail_reader_save_messages (EMailReader *reader)
 	m_mail_folder_save_messages_in_maildir (
 		folder, uids,
 		destination,
+		options,
 		G_PRIORITY_DEFAULT,
 		cancellable,
 		mail_reader_save_messages_cb,
@@ -193,6 +200,184 @@ m_mail_reader_save_messages (EMailReader *reader)
 	g_object_unref (destination);
 
 exit:
+	m_export_options_free (options);
 	g_clear_object (&folder);
 	g_ptr_array_unref (uids);
 }
+
+static void
+mail_reader_restore_messages_cb (GObject *source_object,
+                                 GAsyncResult *result,
+                                 gpointer user_data)
+{
+	EActivity *activity;
+	EAlertSink *alert_sink;
+	AsyncContext *async_context;
+	GError *local_error = NULL;
+
+	async_context = (AsyncContext *) user_data;
+
+	activity = async_context->activity;
+	alert_sink = e_activity_get_alert_sink (activity);
+
+	m_mail_folder_restore_messages_finish (
+		CAMEL_FOLDER (source_object), result, &local_error);
+
+	if (e_activity_handle_cancellation (activity, local_error)) {
+		g_error_free (local_error);
+
+	} else if (local_error != NULL) {
+		e_alert_submit (
+			alert_sink,
+			"system:simple-error",
+			local_error->message, NULL);
+		g_error_free (local_error);
+
+	} else {
+		e_activity_set_state (activity, E_ACTIVITY_COMPLETED);
+	}
+
+	async_context_free (async_context);
+}
+
+void
+m_mail_reader_restore_messages (EMailReader *reader)
+{
+	EShell *shell;
+	EActivity *activity;
+	EMailBackend *backend;
+	GCancellable *cancellable;
+	AsyncContext *async_context;
+	EShellBackend *shell_backend;
+	CamelFolder *folder;
+	GFile *source;
+
+	folder = e_mail_reader_ref_folder (reader);
+	g_return_if_fail (folder != NULL);
+
+	backend = e_mail_reader_get_backend (reader);
+
+	shell_backend = E_SHELL_BACKEND (backend);
+	shell = e_shell_backend_get_shell (shell_backend);
+
+	source = m_shell_run_select_dir_dialog (
+		shell, _("Restore Messages"), NULL, NULL);
+
+	if (source == NULL)
+		goto exit;
+
+	/* Restore messages asynchronously. */
+
+	activity = e_mail_reader_new_activity (reader);
+	cancellable = e_activity_get_cancellable (activity);
+
+	async_context = g_slice_new0 (AsyncContext);
+	async_context->activity = g_object_ref (activity);
+	async_context->reader = g_object_ref (reader);
+
+	m_mail_folder_restore_messages (
+		folder, source,
+		G_PRIORITY_DEFAULT,
+		cancellable,
+		mail_reader_restore_messages_cb,
+		async_context);
+
+	g_object_unref (activity);
+
+	g_object_unref (source);
+
+exit:
+	g_clear_object (&folder);
+}
+
+static void
+mail_reader_import_mbox_cb (GObject *source_object,
+                            GAsyncResult *result,
+                            gpointer user_data)
+{
+	EActivity *activity;
+	EAlertSink *alert_sink;
+	AsyncContext *async_context;
+	GError *local_error = NULL;
+
+	async_context = (AsyncContext *) user_data;
+
+	activity = async_context->activity;
+	alert_sink = e_activity_get_alert_sink (activity);
+
+	m_mbox_import_finish (G_FILE (source_object), result, &local_error);
+
+	if (e_activity_handle_cancellation (activity, local_error)) {
+		g_error_free (local_error);
+
+	} else if (local_error != NULL) {
+		e_alert_submit (
+			alert_sink,
+			"system:simple-error",
+			local_error->message, NULL);
+		g_error_free (local_error);
+
+	} else {
+		e_activity_set_state (activity, E_ACTIVITY_COMPLETED);
+	}
+
+	async_context_free (async_context);
+}
+
+void
+m_mail_reader_import_mbox (EMailReader *reader)
+{
+	EShell *shell;
+	EActivity *activity;
+	EMailBackend *backend;
+	GCancellable *cancellable;
+	AsyncContext *async_context;
+	EShellBackend *shell_backend;
+	MExportOptions *options;
+	GFile *mbox, *destination = NULL;
+
+	backend = e_mail_reader_get_backend (reader);
+
+	shell_backend = E_SHELL_BACKEND (backend);
+	shell = e_shell_backend_get_shell (shell_backend);
+
+	mbox = e_shell_run_open_dialog (
+		shell, _("Import mbox Archive"), NULL, NULL);
+
+	if (mbox == NULL)
+		return;
+
+	destination = m_shell_run_create_dir_dialog (
+		shell, _("Import mbox Archive into Offline Store"),
+		NULL, NULL, NULL);
+
+	if (destination == NULL)
+		goto exit;
+
+	/* Import asynchronously. */
+
+	activity = e_mail_reader_new_activity (reader);
+	cancellable = e_activity_get_cancellable (activity);
+
+	async_context = g_slice_new0 (AsyncContext);
+	async_context->activity = g_object_ref (activity);
+	async_context->reader = g_object_ref (reader);
+
+	options = m_export_options_new_from_settings ();
+
+	m_mbox_import (
+		mbox, destination,
+		options,
+		G_PRIORITY_DEFAULT,
+		cancellable,
+		mail_reader_import_mbox_cb,
+		async_context);
+
+	m_export_options_free (options);
+
+	g_object_unref (activity);
+
+exit:
+	g_clear_object (&destination);
+	g_object_unref (mbox);
+}
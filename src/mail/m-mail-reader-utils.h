@@ -8,6 +8,8 @@
 G_BEGIN_DECLS
 
 void		m_mail_reader_save_messages	(EMailReader *reader);
+void		m_mail_reader_restore_messages	(EMailReader *reader);
+void		m_mail_reader_import_mbox	(EMailReader *reader);
 
 G_END_DECLS
 
@@ -15,28 +15,14 @@
 #include <shell/e-shell-utils.h>
 #include "m-shell-utils.h"
 
-/**
- * m_shell_run_create_dir_dialog:
- * @shell: an #EShell
- * @title: file chooser dialog title
- * @suggestion: file name suggestion, or %NULL
- * @filters: Possible filters for dialog, or %NULL
- * @customize_func: optional dialog customization function
- * @customize_data: optional data to pass to @customize_func
- *
- * Runs a #GtkFileChooserNative in create_folder mode with the given
- * title and returns the selected #GFile.  If @customize_func is
- * provided, the function is called just prior to running the dialog.
- * If the user cancels the dialog the function will return %NULL.
- *
- * Returns: the #GFile to save to, or %NULL
- **/
-GFile *
-m_shell_run_create_dir_dialog (EShell *shell,
-			       const gchar *title,
-			       const gchar *suggestion,
-			       EShellOepnSaveCustomizeFunc customize_func,
-			       gpointer customize_data)
+static GFile *
+shell_run_dir_dialog (EShell *shell,
+		      GtkFileChooserAction action,
+		      const gchar *title,
+		      const gchar *accept_label,
+		      const gchar *suggestion,
+		      EShellOepnSaveCustomizeFunc customize_func,
+		      gpointer customize_data)
 {
 	GtkFileChooser *file_chooser;
 	GFile *chosen_file = NULL;
@@ -48,9 +34,8 @@ m_shell_run_create_dir_dialog (EShell *shell,
 	parent = e_shell_get_active_window (shell);
 
 	native = gtk_file_chooser_native_new (
-		title, parent,
-		GTK_FILE_CHOOSER_ACTION_CREATE_FOLDER,
-		_("_Create"), _("_Cancel"));
+		title, parent, action,
+		accept_label, _("_Cancel"));
 
 	file_chooser = GTK_FILE_CHOOSER (native);
 
@@ -82,3 +67,58 @@ m_shell_run_create_dir_dialog (EShell *shell,
 
 	return chosen_file;
 }
+
+/**
+ * m_shell_run_create_dir_dialog:
+ * @shell: an #EShell
+ * @title: file chooser dialog title
+ * @suggestion: file name suggestion, or %NULL
+ * @filters: Possible filters for dialog, or %NULL
+ * @customize_func: optional dialog customization function
+ * @customize_data: optional data to pass to @customize_func
+ *
+ * Runs a #GtkFileChooserNative in create_folder mode with the given
+ * title and returns the selected #GFile.  If @customize_func is
+ * provided, the function is called just prior to running the dialog.
+ * If the user cancels the dialog the function will return %NULL.
+ *
+ * Returns: the #GFile to save to, or %NULL
+ **/
+GFile *
+m_shell_run_create_dir_dialog (EShell *shell,
+			       const gchar *title,
+			       const gchar *suggestion,
+			       EShellOepnSaveCustomizeFunc customize_func,
+			       gpointer customize_data)
+{
+	return shell_run_dir_dialog (
+		shell, GTK_FILE_CHOOSER_ACTION_CREATE_FOLDER,
+		title, _("_Create"), suggestion,
+		customize_func, customize_data);
+}
+
+/**
+ * m_shell_run_select_dir_dialog:
+ * @shell: an #EShell
+ * @title: file chooser dialog title
+ * @customize_func: optional dialog customization function
+ * @customize_data: optional data to pass to @customize_func
+ *
+ * Runs a #GtkFileChooserNative in select_folder mode with the given
+ * title and returns the selected #GFile.  If @customize_func is
+ * provided, the function is called just prior to running the dialog.
+ * If the user cancels the dialog the function will return %NULL.
+ *
+ * Returns: the #GFile to read from, or %NULL
+ **/
+GFile *
+m_shell_run_select_dir_dialog (EShell *shell,
+			       const gchar *title,
+			       EShellOepnSaveCustomizeFunc customize_func,
+			       gpointer customize_data)
+{
+	return shell_run_dir_dialog (
+		shell, GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER,
+		title, _("_Open"), NULL,
+		customize_func, customize_data);
+}
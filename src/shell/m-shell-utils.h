@@ -13,6 +13,10 @@ GFile *		m_shell_run_create_dir_dialog	(EShell *shell,
 						 const gchar *suggestion,
 						 EShellOepnSaveCustomizeFunc customize_func,
 						 gpointer customize_data);
+GFile *		m_shell_run_select_dir_dialog	(EShell *shell,
+						 const gchar *title,
+						 EShellOepnSaveCustomizeFunc customize_func,
+						 gpointer customize_data);
 
 G_END_DECLS
 
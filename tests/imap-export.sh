@@ -0,0 +1,206 @@
+#!/bin/sh
+# Serves the messages below MESSAGES from a throwaway Dovecot, one
+# folder per directory, exports them with --all-folders over several
+# connections and checks that the export has exactly those messages
+# and passes verify.
+#
+# Dovecot runs over a pipe in preauth mode, as the user running the
+# test, so no port, password or configuration of the system is needed.
+#
+# Usage: imap-export.sh TOOL DOVECOT DBUS-RUN-SESSION MESSAGES
+
+set -eu
+
+tool=$1
+dovecot=$2
+dbus_run_session=$3
+messages=$4
+
+account=offline-store-test
+user=$(id -un)
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+mail=$work/mail
+destination=$work/export
+
+# Message digests without line endings, which IMAP turns into CRLF.
+digests () {
+	for file in "$1"/cur/* "$1"/new/*; do
+		[ -f "$file" ] || continue
+		tr -d '\r' < "$file" | sha256sum | cut -d ' ' -f 1
+	done | sort
+}
+
+folder_maildir () {
+	if [ "$1" = INBOX ]; then
+		echo "$mail"
+	else
+		echo "$mail/.$1"
+	fi
+}
+
+# The fixture folders, INBOX being the root of the Maildir++ tree.
+folders=
+for dir in "$messages"/*/; do
+	name=$(basename "$dir")
+	maildir=$(folder_maildir "$name")
+	mkdir -p "$maildir/cur" "$maildir/new" "$maildir/tmp"
+
+	n=0
+	for file in "$dir"*.eml; do
+		n=$((n + 1))
+		cp "$file" "$maildir/cur/fixture-$n.localhost:2,S"
+	done
+
+	folders="$folders $name"
+	[ "$name" = INBOX ] || echo "$name" >> "$mail/subscriptions"
+done
+
+# Enough messages to keep every connection busy with several requests.
+n=1
+while [ $n -le 64 ]; do
+	cat > "$mail/new/bulk-$n.localhost" <<EOF
+From: Bulk <bulk@example.org>
+To: Test <test@localhost>
+Subject: Bulk message $n
+Date: Sat, 01 Jun 2024 10:00:00 +0000
+Message-ID: <bulk-$n@example.org>
+MIME-Version: 1.0
+Content-Type: text/plain; charset=us-ascii
+
+Bulk message number $n of 64.
+EOF
+	n=$((n + 1))
+done
+
+for name in $folders; do
+	digests "$(folder_maildir "$name")" > "$work/expected-$name"
+done
+
+# Dovecot 2.4 renamed most mail settings.
+mkdir -p "$work/run" "$work/state"
+case $("$dovecot" --version) in
+2.[0-3].*)
+	cat > "$work/dovecot.conf" <<EOF
+mail_location = maildir:$mail
+EOF
+	;;
+*)
+	cat > "$work/dovecot.conf" <<EOF
+dovecot_config_version = 2.4.0
+dovecot_storage_version = 2.4.0
+mail_driver = maildir
+mail_path = $mail
+EOF
+	;;
+esac
+cat >> "$work/dovecot.conf" <<EOF
+protocols = imap
+base_dir = $work/run
+state_dir = $work/state
+log_path = $work/dovecot.log
+ssl = no
+default_internal_user = $user
+default_login_user = $user
+first_valid_uid = 0
+EOF
+
+# The account, as the ESource registry reads it.
+sources=$work/config/evolution/sources
+mkdir -p "$sources" "$work/home" "$work/data" "$work/cache"
+
+cat > "$sources/$account.source" <<EOF
+[Data Source]
+DisplayName=Dovecot
+Enabled=true
+Parent=
+
+[Offline]
+StaySynchronized=false
+
+[Mail Account]
+BackendName=imapx
+IdentityUid=$account-identity
+
+[Authentication]
+Host=localhost
+Method=none
+Port=143
+User=$user
+
+[Security]
+Method=none
+
+[Imapx Backend]
+UseShellCommand=true
+ShellCommand=$dovecot -c $work/dovecot.conf --exec-mail imap
+ConcurrentConnections=3
+UseSubscriptions=false
+UseIdle=false
+EOF
+
+cat > "$sources/$account-identity.source" <<EOF
+[Data Source]
+DisplayName=Dovecot
+Enabled=true
+Parent=$account
+
+[Mail Identity]
+Address=test@localhost
+Name=Test
+
+[Mail Submission]
+TransportUid=$account-transport
+EOF
+
+cat > "$sources/$account-transport.source" <<EOF
+[Data Source]
+DisplayName=Dovecot
+Enabled=true
+Parent=$account
+
+[Mail Transport]
+BackendName=sendmail
+EOF
+
+export HOME="$work/home"
+export USER="$user"
+export XDG_CONFIG_HOME="$work/config"
+export XDG_DATA_HOME="$work/data"
+export XDG_CACHE_HOME="$work/cache"
+export GSETTINGS_BACKEND=memory
+
+status=0
+
+"$dbus_run_session" -- "$tool" export \
+	--account=$account --all-folders --destination="$destination" \
+	--pack-age-days=0 --layout=flat --quiet || status=$?
+
+if [ $status -ne 0 ]; then
+	echo "export failed with status $status" >&2
+	[ -f "$work/dovecot.log" ] && cat "$work/dovecot.log" >&2
+	exit 1
+fi
+
+for name in $folders; do
+	if ! "$tool" verify --source="$destination/$name" --quiet > "$work/problems-$name"; then
+		echo "$name: verify failed" >&2
+		status=1
+	elif [ -s "$work/problems-$name" ]; then
+		echo "$name: verify found problems:" >&2
+		cat "$work/problems-$name" >&2
+		status=1
+	fi
+
+	digests "$destination/$name" > "$work/exported-$name"
+
+	if ! cmp -s "$work/expected-$name" "$work/exported-$name"; then
+		echo "$name: exported messages differ from the served ones:" >&2
+		diff "$work/expected-$name" "$work/exported-$name" >&2 || true
+		status=1
+	fi
+done
+
+exit $status